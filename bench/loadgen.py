@@ -0,0 +1,298 @@
+#!/usr/bin/env python3
+#
+# Load generator for benchmarking mod_crowdsec.
+#
+# Sends requests to httpd with the client address in X-Forwarded-For, for
+# mod_remoteip to hand to mod_crowdsec, following one of the scenarios:
+#
+#   distinct  every request from a new address with no decision
+#   nat       a few hot addresses, each connection keeping to one, as
+#             behind a NAT or a corporate proxy
+#   flood     every request from a new address with a ban decision
+#   outage    a mix of hot and new addresses, while the mock LAPI goes
+#             down part way through and comes back
+#
+# Reports requests per second, the 50th and 99th percentile latency (as
+# added to a baseline run without crowdsec, when given one), the rate of
+# calls made to the mock LAPI, and the share of verdicts found in one of
+# the caches, from the crowdsec-metrics handler.
+
+import argparse
+import http.client
+import ipaddress
+import json
+import os
+import random
+import sys
+import threading
+import time
+import urllib.request
+from array import array
+from collections import Counter
+from concurrent.futures import ProcessPoolExecutor
+
+
+def fetch_json(url):
+    try:
+        with urllib.request.urlopen(url, timeout=5) as response:
+            return json.loads(response.read())
+    except (OSError, ValueError):
+        return {}
+
+
+def get(url):
+    try:
+        with urllib.request.urlopen(url, timeout=5) as response:
+            response.read()
+    except OSError as e:
+        print("warning: %s: %s" % (url, e), file=sys.stderr)
+
+
+class Addresses:
+    """Hands out client addresses for a scenario, per worker thread."""
+
+    def __init__(self, args, worker):
+        self.args = args
+        self.worker = worker
+        self.count = 0
+        rnd = random.Random(worker)
+        self.hot = ["192.0.2.%d" % (i + 1) for i in range(args.hot)]
+        self.pinned = self.hot[rnd.randrange(len(self.hot))]
+        self.bans = ipaddress.ip_network(args.ban_net)
+        self.rnd = rnd
+
+    def distinct(self):
+        # a block of 2^16 addresses per worker, clear of the ban nets
+        n = self.worker * 65536 + self.count % 65536
+        self.count += 1
+        return str(ipaddress.ip_address(0x0a000000 + (n % 0x00c00000)))
+
+    def next(self):
+        scenario = self.args.scenario
+        if scenario == "nat":
+            return self.pinned
+        if scenario == "flood":
+            self.count += 1
+            return str(self.bans[1 + (self.worker * 7919 + self.count) %
+                                 self.args.bans])
+        if scenario == "outage" and self.rnd.random() < 0.5:
+            return self.pinned
+        return self.distinct()
+
+
+def worker(args, first, threads, deadline):
+    """Run the given number of client threads within one process."""
+
+    results = []
+
+    def client(n):
+        addresses = Addresses(args, n)
+        latencies = array("f")
+        statuses = Counter()
+        conn = None
+        while time.time() < deadline:
+            ip = addresses.next()
+            start = time.perf_counter()
+            try:
+                if conn is None:
+                    conn = http.client.HTTPConnection(args.host, args.port,
+                                                      timeout=30)
+                conn.request("GET", args.path,
+                             headers={"X-Forwarded-For": ip})
+                response = conn.getresponse()
+                response.read()
+                statuses[response.status] += 1
+                if not args.keepalive or response.will_close:
+                    conn.close()
+                    conn = None
+            except (OSError, http.client.HTTPException):
+                statuses["error"] += 1
+                if conn is not None:
+                    conn.close()
+                conn = None
+                continue
+            latencies.append((time.perf_counter() - start) * 1000)
+        if conn is not None:
+            conn.close()
+        results.append((latencies, statuses))
+
+    pool = [threading.Thread(target=client, args=(first + i,))
+            for i in range(threads)]
+    for t in pool:
+        t.start()
+    for t in pool:
+        t.join()
+
+    latencies = array("f")
+    statuses = Counter()
+    for lat, st in results:
+        latencies.extend(lat)
+        statuses.update(st)
+    return latencies.tobytes(), dict(statuses)
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    k = min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))
+    return values[k]
+
+
+def metrics_delta(before, after):
+    return {
+        key: after.get(key, 0) - before.get(key, 0)
+        for key in after if isinstance(after.get(key), int)
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Load generator for benchmarking mod_crowdsec.")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--path", default="/index.html")
+    parser.add_argument("--scenario", default="distinct",
+                        choices=("distinct", "nat", "flood", "outage"))
+    parser.add_argument("--duration", type=float, default=10.0,
+                        help="seconds to run for")
+    parser.add_argument("--concurrency", type=int, default=32,
+                        help="client connections in flight")
+    parser.add_argument("--procs", type=int, default=os.cpu_count() or 1,
+                        help="processes the connections are spread over")
+    parser.add_argument("--no-keepalive", dest="keepalive",
+                        action="store_false",
+                        help="open a new connection for every request")
+    parser.add_argument("--hot", type=int, default=16,
+                        help="hot addresses in the nat and outage scenarios")
+    parser.add_argument("--bans", type=int, default=10000,
+                        help="banned addresses the mock LAPI was given")
+    parser.add_argument("--ban-net", default="10.200.0.0/16")
+    parser.add_argument("--lapi", default="http://127.0.0.1:8081",
+                        help="the mock LAPI, for its counters and outages")
+    parser.add_argument("--metrics", default=None,
+                        help="url of the crowdsec-metrics handler")
+    parser.add_argument("--outage-at", type=float, default=0.3,
+                        help="part of the run after which LAPI goes down")
+    parser.add_argument("--outage-for", type=float, default=0.4,
+                        help="part of the run LAPI stays down for")
+    parser.add_argument("--outage-mode", default="down",
+                        choices=("down", "slow", "error"))
+    parser.add_argument("--label", default="",
+                        help="mode and cache, shown in the report")
+    parser.add_argument("--baseline", default=None,
+                        help="file with a baseline run to subtract")
+    parser.add_argument("--save-baseline", default=None,
+                        help="file to save this run to as a baseline")
+    parser.add_argument("--header", action="store_true",
+                        help="print the column headings first")
+    parser.add_argument("--json", action="store_true",
+                        help="report as JSON rather than as a table row")
+    args = parser.parse_args()
+
+    if args.header:
+        print("%-9s %-20s %9s %9s %9s %9s %7s %7s" % (
+            "scenario", "mode/cache", "req/s", "p50 ms", "p99 ms",
+            "lapi/s", "hit %", "errors"))
+
+    lapi_before = fetch_json(args.lapi + "/_stats")
+    metrics_before = fetch_json(args.metrics) if args.metrics else {}
+
+    procs = max(1, min(args.procs, args.concurrency))
+    start = time.time()
+    deadline = start + args.duration
+
+    timers = []
+    if args.scenario == "outage":
+        timers.append(threading.Timer(
+            args.duration * args.outage_at, get,
+            (args.lapi + "/_mode?" + args.outage_mode,)))
+        timers.append(threading.Timer(
+            args.duration * (args.outage_at + args.outage_for), get,
+            (args.lapi + "/_mode?up",)))
+        for t in timers:
+            t.start()
+
+    latencies = array("f")
+    statuses = Counter()
+    with ProcessPoolExecutor(max_workers=procs) as pool:
+        futures = []
+        first = 0
+        for i in range(procs):
+            threads = args.concurrency // procs + \
+                (1 if i < args.concurrency % procs else 0)
+            futures.append(pool.submit(worker, args, first, threads,
+                                       deadline))
+            first += threads
+        for future in futures:
+            lat, st = future.result()
+            chunk = array("f")
+            chunk.frombytes(lat)
+            latencies.extend(chunk)
+            statuses.update(st)
+
+    for t in timers:
+        t.cancel()
+    if timers:
+        get(args.lapi + "/_mode?up")
+
+    elapsed = time.time() - start
+    lapi_after = fetch_json(args.lapi + "/_stats")
+    metrics_after = fetch_json(args.metrics) if args.metrics else {}
+
+    ordered = sorted(latencies)
+    p50 = percentile(ordered, 50)
+    p99 = percentile(ordered, 99)
+
+    baseline = {}
+    if args.baseline:
+        try:
+            with open(args.baseline) as f:
+                baseline = json.load(f)
+        except (OSError, ValueError):
+            baseline = {}
+
+    lapi = metrics_delta(lapi_before, lapi_after)
+    calls = lapi.get("lookups", 0) + lapi.get("pulls", 0)
+
+    m = metrics_delta(metrics_before, metrics_after)
+    hits = m.get("connection_hits", 0) + m.get("l1_hits", 0) + \
+        m.get("cache_hits", 0)
+    checked = hits + m.get("cache_misses", 0)
+
+    result = {
+        "scenario": args.scenario,
+        "label": args.label,
+        "requests": len(latencies),
+        "rps": len(latencies) / elapsed if elapsed else 0.0,
+        "p50": p50,
+        "p99": p99,
+        "p50_added": p50 - baseline["p50"] if "p50" in baseline else None,
+        "p99_added": p99 - baseline["p99"] if "p99" in baseline else None,
+        "lapi_rps": calls / elapsed if elapsed else 0.0,
+        "hit_ratio": hits / checked if checked else None,
+        "statuses": {str(k): v for k, v in statuses.items()},
+        "metrics": m,
+    }
+
+    if args.save_baseline:
+        with open(args.save_baseline, "w") as f:
+            json.dump({"p50": p50, "p99": p99}, f)
+
+    if args.json:
+        print(json.dumps(result))
+        return
+
+    def ms(added, value):
+        return "%+9.2f" % added if added is not None else "%9.2f" % value
+
+    print("%-9s %-20s %9.0f %s %s %9.1f %7s %7d" % (
+        args.scenario, args.label or "-", result["rps"],
+        ms(result["p50_added"], p50), ms(result["p99_added"], p99),
+        result["lapi_rps"],
+        "%.1f" % (100 * result["hit_ratio"])
+        if result["hit_ratio"] is not None else "-",
+        statuses.get("error", 0)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,258 @@
+#!/usr/bin/env python3
+#
+# A stand in for the crowdsec local API, for benchmarking mod_crowdsec.
+#
+# Serves /v1/decisions for live mode and /v1/decisions/stream for stream
+# mode, from a generated set of decisions, with a configurable latency.
+# The service can be made slow, down, or failing while it runs, to see
+# how the module behaves during a LAPI outage:
+#
+#   /_mode?up         answer normally
+#   /_mode?slow       answer after --slow-latency
+#   /_mode?down       close the connection without answering
+#   /_mode?error      answer 503
+#   /_stats           lookups and pulls served so far, as JSON
+#   /_reset           reset the counters
+#
+# Decisions:
+#
+#   --bans N          ban the first N addresses of --ban-net
+#   --ranges N        ban N /24 ranges of --range-net
+#   --throttles N     throttle the first N addresses of --throttle-net
+#   --stream-extra N  pad the first stream pull with N more bans, to
+#                     measure large stream payloads
+#   --churn N         add and delete N decisions on each later pull
+
+import argparse
+import ipaddress
+import json
+import random
+import socket
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlsplit
+
+
+class State:
+
+    def __init__(self, args):
+        self.args = args
+        self.mode = "up"
+        self.lock = threading.Lock()
+        self.lookups = 0
+        self.pulls = 0
+        self.errors = 0
+        self.decisions = {}
+        self.ranges = []
+        self.churned = []
+        self.next_id = 1
+
+        net = ipaddress.ip_network(args.ban_net)
+        for i, ip in zip(range(args.bans), net.hosts()):
+            self.add("ban", "Ip", str(ip))
+
+        net = ipaddress.ip_network(args.throttle_net)
+        for i, ip in zip(range(args.throttles), net.hosts()):
+            self.add("throttle", "Ip", str(ip))
+
+        net = ipaddress.ip_network(args.range_net)
+        for i, sub in zip(range(args.ranges), net.subnets(new_prefix=24)):
+            self.add("ban", "Range", str(sub))
+
+    def add(self, type, scope, value):
+        decision = {
+            "id": self.next_id,
+            "origin": "crowdsec",
+            "type": type,
+            "scope": scope,
+            "value": value,
+            "duration": "3h59m59s",
+            "scenario": "bench/mock",
+        }
+        self.next_id += 1
+        self.decisions[value] = decision
+        if scope == "Range":
+            self.ranges.append((ipaddress.ip_network(value), decision))
+        return decision
+
+    def lookup(self, ip):
+        found = self.decisions.get(ip)
+        if found:
+            return [found]
+        try:
+            addr = ipaddress.ip_address(ip)
+        except ValueError:
+            return None
+        for net, decision in self.ranges:
+            if addr.version == net.version and addr in net:
+                return [decision]
+        return None
+
+    def stream(self, startup):
+        with self.lock:
+            if startup:
+                new = list(self.decisions.values())
+                net = ipaddress.ip_network(self.args.extra_net)
+                for i, ip in zip(range(self.args.stream_extra), net.hosts()):
+                    new.append({
+                        "id": 0,
+                        "origin": "CAPI",
+                        "type": "ban",
+                        "scope": "Ip",
+                        "value": str(ip),
+                        "duration": "23h59m59s",
+                        "scenario": "bench/extra",
+                    })
+                return {"new": new, "deleted": []}
+
+            deleted = self.churned
+            self.churned = []
+            for decision in deleted:
+                self.decisions.pop(decision["value"], None)
+            for i in range(self.args.churn):
+                ip = "100.%d.%d.%d" % (random.randrange(64, 128),
+                                       random.randrange(256),
+                                       random.randrange(1, 255))
+                self.churned.append(self.add("ban", "Ip", ip))
+            return {"new": self.churned, "deleted": deleted}
+
+
+class Handler(BaseHTTPRequestHandler):
+
+    protocol_version = "HTTP/1.1"
+    server_version = "mock-lapi"
+    # one write per response, so that delayed acks do not add latency
+    wbufsize = -1
+    disable_nagle_algorithm = True
+
+    def log_message(self, format, *args):
+        if self.server.state.args.verbose:
+            BaseHTTPRequestHandler.log_message(self, format, *args)
+
+    def reply(self, code, body=b"", content_type="application/json"):
+        self.send_response(code)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def control(self, path, query):
+        state = self.server.state
+        if path == "/_mode":
+            mode = query or "up"
+            if mode not in ("up", "slow", "down", "error"):
+                return self.reply(400, b"unknown mode\n", "text/plain")
+            state.mode = mode
+            return self.reply(200, (mode + "\n").encode(), "text/plain")
+        if path == "/_stats":
+            with state.lock:
+                stats = {
+                    "lookups": state.lookups,
+                    "pulls": state.pulls,
+                    "errors": state.errors,
+                    "decisions": len(state.decisions),
+                    "mode": state.mode,
+                }
+            return self.reply(200, json.dumps(stats).encode())
+        if path == "/_reset":
+            with state.lock:
+                state.lookups = state.pulls = state.errors = 0
+            return self.reply(200, b"reset\n", "text/plain")
+        return self.reply(404, b"not found\n", "text/plain")
+
+    def do_GET(self):
+        state = self.server.state
+        args = state.args
+        url = urlsplit(self.path)
+
+        if url.path.startswith("/_"):
+            return self.control(url.path, url.query)
+
+        if args.key and self.headers.get("X-Api-Key") != args.key:
+            return self.reply(403, b'{"message":"access forbidden"}')
+
+        if state.mode == "down":
+            with state.lock:
+                state.errors += 1
+            self.close_connection = True
+            try:
+                self.connection.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+            return
+
+        if state.mode == "error":
+            with state.lock:
+                state.errors += 1
+            return self.reply(503, b'{"message":"unavailable"}')
+
+        latency = args.slow_latency if state.mode == "slow" else args.latency
+        if args.jitter:
+            latency += random.uniform(0, args.jitter)
+        if latency:
+            time.sleep(latency / 1000.0)
+
+        query = parse_qs(url.query)
+
+        if url.path == "/v1/decisions":
+            with state.lock:
+                state.lookups += 1
+            found = state.lookup(query.get("ip", [""])[0])
+            return self.reply(200, json.dumps(found).encode())
+
+        if url.path == "/v1/decisions/stream":
+            with state.lock:
+                state.pulls += 1
+            startup = query.get("startup", ["false"])[0] == "true"
+            return self.reply(200, json.dumps(state.stream(startup)).encode())
+
+        return self.reply(404, b'{"message":"not found"}')
+
+
+class Server(ThreadingHTTPServer):
+
+    daemon_threads = True
+
+    def handle_error(self, request, client_address):
+        # clients hanging up on a slow or down service are expected
+        if self.state.args.verbose:
+            ThreadingHTTPServer.handle_error(self, request, client_address)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Stand in for the crowdsec local API.")
+    parser.add_argument("--listen", default="127.0.0.1:8081",
+                        help="address and port to listen on")
+    parser.add_argument("--key", default="bench",
+                        help="API key expected in X-Api-Key, empty for any")
+    parser.add_argument("--latency", type=float, default=1.0,
+                        help="milliseconds before each answer")
+    parser.add_argument("--jitter", type=float, default=0.0,
+                        help="random milliseconds added to the latency")
+    parser.add_argument("--slow-latency", type=float, default=2000.0,
+                        help="milliseconds before each answer when slow")
+    parser.add_argument("--mode", default="up",
+                        choices=("up", "slow", "down", "error"))
+    parser.add_argument("--bans", type=int, default=10000)
+    parser.add_argument("--ban-net", default="10.200.0.0/16")
+    parser.add_argument("--throttles", type=int, default=0)
+    parser.add_argument("--throttle-net", default="10.201.0.0/16")
+    parser.add_argument("--ranges", type=int, default=16)
+    parser.add_argument("--range-net", default="10.202.0.0/16")
+    parser.add_argument("--stream-extra", type=int, default=0)
+    parser.add_argument("--extra-net", default="100.64.0.0/10")
+    parser.add_argument("--churn", type=int, default=0)
+    parser.add_argument("--verbose", action="store_true")
+    args = parser.parse_args()
+
+    host, port = args.listen.rsplit(":", 1)
+    server = Server((host, int(port)), Handler)
+    server.state = State(args)
+    server.state.mode = args.mode
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
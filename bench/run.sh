@@ -0,0 +1,271 @@
+#!/bin/sh
+#
+# Benchmark mod_crowdsec against a mock LAPI.
+#
+# Starts bench/mock_lapi.py, then for each mode and CrowdsecCache provider
+# starts httpd with mod_crowdsec, drives it with bench/loadgen.py through
+# each scenario, and prints one row per run: requests per second, the
+# p50 and p99 latency added over a run with crowdsec off, the rate of calls
+# made to LAPI, and the share of verdicts found in a cache.
+#
+# Run it with "make bench", or directly, tuned through the environment:
+#
+#   APXS         apxs of the httpd to benchmark (apxs)
+#   HTTPD        the httpd binary (found with apxs)
+#   MODULE       the mod_crowdsec.so to load (.libs/mod_crowdsec.so)
+#   MPM          the MPM to load if none is built in (event)
+#   MODES        modes to run (proxy builtin stream)
+#   CACHES       CrowdsecCache providers for live mode (none shmcb native)
+#   SCENARIOS    scenarios to run (distinct nat flood outage)
+#   DURATION     seconds per run (10)
+#   CONCURRENCY  client connections in flight (32)
+#   BANS         addresses the mock LAPI bans, and the flood comes from
+#                (10000)
+#   EXTRA_CONF   further directives for each run, such as
+#                "CrowdsecCacheL1 4096"
+#   LAPI_ARGS    further arguments to mock_lapi.py, such as "--latency 5"
+#   LOADGEN_ARGS further arguments to loadgen.py, such as "--no-keepalive"
+#   PORT         port httpd listens on (18080)
+#   LAPI_PORT    port the mock LAPI listens on (18081)
+#   KEEP         set to keep the configuration and logs of each run
+
+set -eu
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+
+APXS=${APXS:-apxs}
+HTTPD=${HTTPD:-$("$APXS" -q SBINDIR)/$("$APXS" -q TARGET)}
+LIBEXECDIR=${LIBEXECDIR:-$("$APXS" -q LIBEXECDIR)}
+MODULE=${MODULE:-$BENCH/../.libs/mod_crowdsec.so}
+MPM=${MPM:-event}
+MODES=${MODES:-proxy builtin stream}
+CACHES=${CACHES:-none shmcb native}
+SCENARIOS=${SCENARIOS:-distinct nat flood outage}
+DURATION=${DURATION:-10}
+CONCURRENCY=${CONCURRENCY:-32}
+BANS=${BANS:-10000}
+EXTRA_CONF=${EXTRA_CONF:-}
+LAPI_ARGS=${LAPI_ARGS:-}
+LOADGEN_ARGS=${LOADGEN_ARGS:-}
+PORT=${PORT:-18080}
+LAPI_PORT=${LAPI_PORT:-18081}
+PYTHON=${PYTHON:-python3}
+
+LAPI=http://127.0.0.1:$LAPI_PORT
+METRICS=http://127.0.0.1:$PORT/crowdsec-metrics?json
+
+if [ ! -f "$MODULE" ]; then
+    echo "bench: $MODULE not found, build the module first" >&2
+    exit 1
+fi
+MODULE=$(cd "$(dirname "$MODULE")" && pwd)/$(basename "$MODULE")
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/crowdsec-bench.XXXXXX")
+mkdir -p "$WORK/htdocs"
+echo "ok" > "$WORK/htdocs/index.html"
+
+LAPI_PID=
+
+stop_httpd() {
+    if [ -f "$WORK/httpd.pid" ]; then
+        "$HTTPD" -f "$WORK/httpd.conf" -k stop 2>/dev/null || true
+        i=0
+        while [ -f "$WORK/httpd.pid" ] && [ $i -lt 50 ]; do
+            sleep 0.2
+            i=$((i + 1))
+        done
+    fi
+}
+
+cleanup() {
+    stop_httpd
+    if [ -n "$LAPI_PID" ]; then
+        kill "$LAPI_PID" 2>/dev/null || true
+    fi
+    if [ -z "${KEEP:-}" ]; then
+        rm -rf "$WORK"
+    else
+        echo "bench: configuration and logs kept in $WORK" >&2
+    fi
+}
+trap cleanup EXIT INT TERM
+
+wait_for() {
+    i=0
+    while ! "$PYTHON" -c 'import sys, urllib.request
+urllib.request.urlopen(sys.argv[1], timeout=1)' "$1" 2>/dev/null; do
+        i=$((i + 1))
+        if [ $i -ge 50 ]; then
+            echo "bench: $1 did not answer, see $WORK" >&2
+            KEEP=1
+            return 1
+        fi
+        sleep 0.2
+    done
+}
+
+# write the httpd configuration for a run; mode is off, proxy, builtin or
+# stream, and cache is a CrowdsecCache provider or none
+configure() {
+    mode=$1
+    cache=$2
+
+    cat > "$WORK/httpd.conf" <<EOF
+ServerRoot "$WORK"
+ServerName localhost
+Listen 127.0.0.1:$PORT
+PidFile "$WORK/httpd.pid"
+DefaultRuntimeDir "$WORK"
+ErrorLog "$WORK/error.log"
+LogLevel warn
+DocumentRoot "$WORK/htdocs"
+
+<IfModule !mpm_event_module>
+<IfModule !mpm_worker_module>
+<IfModule !mpm_prefork_module>
+  LoadModule mpm_${MPM}_module "$LIBEXECDIR/mod_mpm_${MPM}.so"
+</IfModule>
+</IfModule>
+</IfModule>
+<IfModule !unixd_module>
+  LoadModule unixd_module "$LIBEXECDIR/mod_unixd.so"
+</IfModule>
+<IfModule !authz_core_module>
+  LoadModule authz_core_module "$LIBEXECDIR/mod_authz_core.so"
+</IfModule>
+<IfModule !remoteip_module>
+  LoadModule remoteip_module "$LIBEXECDIR/mod_remoteip.so"
+</IfModule>
+<IfModule !proxy_module>
+  LoadModule proxy_module "$LIBEXECDIR/mod_proxy.so"
+</IfModule>
+<IfModule !proxy_http_module>
+  LoadModule proxy_http_module "$LIBEXECDIR/mod_proxy_http.so"
+</IfModule>
+<IfModule !socache_shmcb_module>
+  LoadModule socache_shmcb_module "$LIBEXECDIR/mod_socache_shmcb.so"
+</IfModule>
+<IfModule !watchdog_module>
+  LoadModule watchdog_module "$LIBEXECDIR/mod_watchdog.so"
+</IfModule>
+LoadModule crowdsec_module "$MODULE"
+
+<IfModule mpm_event_module>
+  StartServers 2
+  ServerLimit 4
+  ThreadsPerChild 64
+  MaxRequestWorkers 256
+</IfModule>
+<IfModule mpm_worker_module>
+  StartServers 2
+  ServerLimit 4
+  ThreadsPerChild 64
+  MaxRequestWorkers 256
+</IfModule>
+KeepAlive On
+MaxKeepAliveRequests 0
+
+# the load generator hands each request a client address
+RemoteIPHeader X-Forwarded-For
+RemoteIPInternalProxy 127.0.0.1
+
+CrowdsecURL $LAPI
+CrowdsecAPIKey bench
+CrowdsecFallback allow
+CrowdsecBlockedHTTPCode 403
+
+<Proxy "$LAPI">
+  ProxySet connectiontimeout=1 timeout=5
+</Proxy>
+
+<Location /crowdsec-metrics>
+  SetHandler crowdsec-metrics
+  Crowdsec off
+</Location>
+EOF
+
+    case "$mode" in
+        off)
+            echo "Crowdsec off" >> "$WORK/httpd.conf"
+            ;;
+        proxy|builtin)
+            echo "CrowdsecClient $mode" >> "$WORK/httpd.conf"
+            ;;
+        stream)
+            printf 'CrowdsecMode stream\nCrowdsecStreamInterval 1\n' \
+                >> "$WORK/httpd.conf"
+            ;;
+    esac
+
+    if [ "$mode" != "stream" ] && [ "$cache" != "none" ]; then
+        printf 'CrowdsecCache %s\nCrowdsecCacheTimeout 60\n' "$cache" \
+            >> "$WORK/httpd.conf"
+    fi
+
+    if [ "$mode" != "off" ]; then
+        printf '%s\nCrowdsec on\n' "$EXTRA_CONF" >> "$WORK/httpd.conf"
+    fi
+}
+
+# run one scenario against a freshly started httpd
+run() {
+    scenario=$1
+    mode=$2
+    cache=$3
+    shift 3
+
+    configure "$mode" "$cache"
+    rm -f "$WORK/error.log"
+
+    if ! "$HTTPD" -t -f "$WORK/httpd.conf" >/dev/null 2>&1; then
+        "$HTTPD" -t -f "$WORK/httpd.conf" >&2 || true
+        return 1
+    fi
+    "$HTTPD" -f "$WORK/httpd.conf" -k start
+    wait_for "http://127.0.0.1:$PORT/index.html"
+
+    # give stream mode its first pull
+    if [ "$mode" = "stream" ]; then
+        sleep 2
+    fi
+
+    # shellcheck disable=SC2086
+    "$PYTHON" "$BENCH/loadgen.py" --port "$PORT" --lapi "$LAPI" \
+        --scenario "$scenario" --duration "$DURATION" \
+        --concurrency "$CONCURRENCY" --bans "$BANS" \
+        --label "$mode/$cache" "$@" $LOADGEN_ARGS
+
+    stop_httpd
+    if [ -n "${KEEP:-}" ]; then
+        cp "$WORK/httpd.conf" "$WORK/httpd-$scenario-$mode-$cache.conf"
+        cp "$WORK/error.log" "$WORK/error-$scenario-$mode-$cache.log" \
+            2>/dev/null || true
+    fi
+}
+
+# shellcheck disable=SC2086
+"$PYTHON" "$BENCH/mock_lapi.py" --listen "127.0.0.1:$LAPI_PORT" \
+    --bans "$BANS" $LAPI_ARGS &
+LAPI_PID=$!
+wait_for "$LAPI/_stats"
+
+header=--header
+for scenario in $SCENARIOS; do
+
+    run "$scenario" off none $header \
+        --save-baseline "$WORK/baseline-$scenario.json"
+    header=
+
+    for mode in $MODES; do
+        if [ "$mode" = "stream" ]; then
+            caches=store
+        else
+            caches=$CACHES
+        fi
+        for cache in $caches; do
+            run "$scenario" "$mode" "$cache" --metrics "$METRICS" \
+                --baseline "$WORK/baseline-$scenario.json"
+        done
+    done
+
+done
@@ -35,6 +35,11 @@
  * Alternatively, the CrowdsecLocation directive can specify
  * an URL to redirect to on block.
  *
+ * Unless an ErrorDocument is given for the status, blocked requests are
+ * answered with a response rendered ahead of time, and so cost little
+ * during a flood. A CrowdsecLocation with no variables is likewise worked
+ * out once, when the configuration is read.
+ *
  *  Author: Graham Leggett
  *
  * Basic configuration:
@@ -62,6 +67,111 @@
  * CrowdsecCache shmcb
  * CrowdsecCacheTimeout 60
  *
+ * The native cache needs no socache module. It holds a given number of
+ * entries in shared memory, 65536 by default, in small sets each with a
+ * lock of its own. Readers take no lock, and writes wait on each other
+ * only within a set, rather than being dropped while another child holds
+ * the lock on the whole cache. Entries are evicted with CLOCK:
+ *
+ * CrowdsecCache native:262144
+ *
+ * Each child may keep a small cache of its own in front of CrowdsecCache,
+ * so that repeat requests from a client are answered without a lock or a
+ * round trip to the shared cache. Entries are kept for no longer than
+ * CrowdsecCacheL1Timeout, after which changes made elsewhere are seen:
+ *
+ * CrowdsecCacheL1 4096
+ * CrowdsecCacheL1Timeout 1
+ *
+ * The verdict on a client is remembered on its connection, so that the
+ * requests that follow on a keep-alive or HTTP/2 connection need no
+ * lookup at all. It is remembered for CrowdsecConnectionCache, one second
+ * unless given, and in stream mode is forgotten as soon as the decisions
+ * change. Only verdicts found in the cache or decision store are kept:
+ *
+ * CrowdsecConnectionCache 5
+ *
+ * Addresses with a decision are cached until the decision expires, and
+ * addresses without a decision for CrowdsecCacheTimeout. Either may be
+ * overridden:
+ *
+ * CrowdsecCacheAllowTimeout 300
+ * CrowdsecCacheBanTimeout 3600
+ *
+ * Entries may be kept for CrowdsecCacheStale seconds beyond their expiry.
+ * Should the crowdsec service then fail to answer, the expired verdict is
+ * served in place of CrowdsecFallback, and the "crowdsec-stale" note is
+ * set to the status the service gave. For a few seconds after a failure,
+ * expired verdicts are served without trying the service at all:
+ *
+ * CrowdsecCacheStale 600
+ *
+ * With the builtin client on a threaded MPM, an entry hit within
+ * CrowdsecCacheRefresh seconds of its expiry is served as is, and looked
+ * up again in the background, so that busy addresses are never missed:
+ *
+ * CrowdsecCacheRefresh 10
+ *
+ * Concurrent requests from an address that is not yet cached share a
+ * single lookup, waiting up to CrowdsecCoalesceTimeout for the result:
+ *
+ * CrowdsecCoalesceTimeout 5
+ *
+ * A request cannot be suspended while the access checker runs, so each
+ * request waiting on the crowdsec service holds a worker thread. To stop
+ * a slow crowdsec service from taking every thread of a child, at most
+ * CrowdsecMaxLookups requests per child wait on a lookup at once, and the
+ * fallback applies at once to requests needing another. Requests waiting
+ * on a lookup already in progress for the same address, in this child or
+ * another, count as well. This defaults to half the threads of each
+ * child. Stream mode never waits on the crowdsec service.
+ *
+ * CrowdsecMaxLookups 32
+ *
+ * Once CrowdsecCircuitBreaker lookups in a row have failed, the circuit
+ * opens. From then on, all children skip the crowdsec service and apply
+ * the fallback at once. Every CrowdsecCircuitRetry seconds a single
+ * lookup is let through, and the circuit closes again once a lookup
+ * succeeds:
+ *
+ * CrowdsecCircuitBreaker 5
+ * CrowdsecCircuitRetry 5
+ *
+ * Requests from CrowdsecTrustedNetworks, such as health checks and
+ * internal traffic, are let through before the cache or the crowdsec
+ * service are consulted:
+ *
+ * CrowdsecTrustedNetworks 127.0.0.1 ::1 10.0.0.0/8
+ *
+ * In stream mode, connections from addresses with a ban decision may be
+ * dropped as they are accepted, before the TLS handshake and before any
+ * request is read. The address checked is that of the peer, not one given
+ * by mod_remoteip, and the settings are those of the server the
+ * connection arrived at, the first virtual host for the address and port.
+ * Other decisions, such as captcha, are left to each request:
+ *
+ * CrowdsecConnectionFilter on
+ *
+ * Throttle decisions block like any other unless CrowdsecThrottle is
+ * given, in which case addresses with a throttle decision are held to so
+ * many requests a second, with bursts of up to the second number, the
+ * rate unless given. Requests beyond are turned away with 429 Too Many
+ * Requests and a Retry-After, without a lookup. The rate is kept in
+ * shared memory and is shared by all children:
+ *
+ * CrowdsecThrottle 5 20
+ *
+ * Counters of cache hits and misses, lookups and their latency, fallbacks,
+ * verdicts and the state of the decision store are kept in shared memory.
+ * They are added to the mod_status page, and reported by the
+ * crowdsec-metrics handler in the Prometheus text format, or as JSON when
+ * asked for with ?json:
+ *
+ * <Location /crowdsec-metrics>
+ *   SetHandler crowdsec-metrics
+ *   Require local
+ * </Location>
+ *
  * <Location />
  *   Crowdsec on
  * </Location>
@@ -85,6 +195,97 @@
  *   Crowdsec on
  *   CrowdsecLocation https://somewhere.example.com/blocked.html?ip=%{REMOTE_ADDR}
  * </Location>
+ *
+ * Stream mode:
+ *
+ * In stream mode the decisions are pulled in the background from
+ * /v1/decisions/stream by a watchdog, and requests are checked against
+ * a decision store without contacting the crowdsec service. The store
+ * lives in shared memory and is shared by all children, one of which
+ * keeps it up to date. Stream mode requires mod_watchdog, and a plain
+ * http CrowdsecURL.
+ *
+ * Both Ip and Range scoped decisions are pulled. A range decision covers
+ * every address within it, found by a longest prefix match. A cuckoo
+ * filter over both is kept alongside, so that most addresses without a
+ * decision are turned away after probing a couple of buckets.
+ *
+ * When built with libmaxminddb, Country and AS scoped decisions are also
+ * pulled and matched against the given GeoIP databases:
+ *
+ * CrowdsecGeoDatabase /usr/share/GeoIP/GeoLite2-Country.mmdb \
+ *                     /usr/share/GeoIP/GeoLite2-ASN.mmdb
+ *
+ * <IfModule !watchdog_module>
+ *   LoadModule watchdog_module modules/mod_watchdog.so
+ * </IfModule>
+ *
+ * CrowdsecURL http://localhost:8080
+ * CrowdsecAPIKey [...]
+ * CrowdsecMode stream
+ * CrowdsecStreamInterval 10
+ *
+ * With CrowdsecStreamSnapshot, the decisions are saved to a file at most
+ * once a minute as they change, and when the updating child stops. On
+ * restart the file is loaded into the store before any child starts, so
+ * that requests are checked against the decisions at once. The file may
+ * lag behind the service, so the first pull still fetches the full set,
+ * which replaces the loaded decisions once it is in.
+ *
+ * CrowdsecStreamSnapshot /var/cache/apache2/crowdsec.snapshot
+ *
+ * The store holds CrowdsecDecisionStoreSize decisions on IPv4 addresses,
+ * and a quarter as many on IPv6 addresses, in a fixed amount of memory
+ * worked out at startup. Once a table is full, a new decision takes the
+ * place of one less worth keeping: a decision from the community
+ * blocklist or a subscribed list before a local one, a throttle or a
+ * captcha before a ban, and the one ending soonest first.
+ *
+ * The crowdsec service keeps one stream position per API key, so servers
+ * in stream mode with the same CrowdsecURL and CrowdsecAPIKey share a
+ * single store and a single pull. They must then agree on the store size,
+ * the pull interval, the GeoIP databases and the snapshot file.
+ *
+ * CrowdsecDecisionStoreSize 1000000
+ *
+ * Builtin client:
+ *
+ * In live mode, lookups are made through mod_proxy by default. The builtin
+ * client instead keeps a pool of kept alive connections in each child to
+ * a plain http CrowdsecURL, and needs no mod_proxy or <Proxy> section.
+ *
+ * CrowdsecURL http://localhost:8080
+ * CrowdsecAPIKey [...]
+ * CrowdsecClient builtin
+ * CrowdsecConnectTimeout 1
+ * CrowdsecTimeout 5
+ *
+ * The crowdsec service takes one address per lookup. Rather than opening
+ * more connections as lookups pile up, the builtin client on a threaded
+ * MPM can gather the lookups arriving in each child within
+ * CrowdsecBatchWindow, and send them pipelined over a single connection,
+ * waking all of the waiting requests together once the answers are in:
+ *
+ * CrowdsecBatchWindow 2ms
+ *
+ * Several crowdsec services may be given to CrowdsecURL. Each lookup goes
+ * to whichever answering service has the fewest lookups in progress
+ * across all children. Once CROWDSEC_ENDPOINT_FAILURES lookups in a row to
+ * a service have failed it is left out, and probed again every
+ * CrowdsecCircuitRetry seconds, while a lookup that got no answer is tried
+ * once more on another service. Stream mode keeps to one service for as
+ * long as it answers, and pulls the full set of decisions again when it
+ * has to move.
+ *
+ * CrowdsecURL http://lapi1:8080 http://lapi2:8080
+ *
+ * With the builtin client, CrowdsecHedge sends a lookup that has not been
+ * answered within the given time to a second service as well, and takes
+ * whichever answer comes first. The time must be shorter than
+ * CrowdsecTimeout, which bounds both. Given as a percentile, the time is
+ * taken from the latency of recent lookups:
+ *
+ * CrowdsecHedge 95%
  */
 
 #include "httpd.h"
@@ -96,15 +297,581 @@
 #include "ap_expr.h"
 #include "ap_socache.h"
 #include "util_mutex.h"
+#include "ap_mpm.h"
+#include "mod_watchdog.h"
+#include "mod_status.h"
 
 #include <apr_strings.h>
+#include <apr_lib.h>
+#include <apr_hash.h>
+#include <apr_uri.h>
+#include <apr_network_io.h>
+#include <apr_shm.h>
+#include <apr_atomic.h>
+
+#if APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#include <apr_reslist.h>
+#include <apr_thread_pool.h>
+#endif
+
+#if APR_HAVE_ARPA_INET_H
+#include <arpa/inet.h>
+#endif
+#if APR_HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#if APR_HAVE_SIGNAL_H
+#include <signal.h>
+#endif
+#if APR_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_MAXMINDDB
+#include <maxminddb.h>
+#endif
 
 module AP_MODULE_DECLARE_DATA crowdsec_module;
 
+typedef enum {
+    CROWDSEC_CLIENT_PROXY,
+    CROWDSEC_CLIENT_BUILTIN
+} crowdsec_client;
+
+typedef enum {
+    CROWDSEC_MODE_LIVE,
+    CROWDSEC_MODE_STREAM
+} crowdsec_mode;
+
+/* decision types, in order of increasing severity */
+typedef enum {
+    CROWDSEC_DECISION_NONE,
+    CROWDSEC_DECISION_THROTTLE,
+    CROWDSEC_DECISION_CAPTCHA,
+    CROWDSEC_DECISION_OTHER,
+    CROWDSEC_DECISION_BAN
+} crowdsec_decision_type;
+
+/* where a decision came from */
+typedef enum {
+    CROWDSEC_ORIGIN_OTHER,
+    CROWDSEC_ORIGIN_CROWDSEC,
+    CROWDSEC_ORIGIN_CSCLI,
+    CROWDSEC_ORIGIN_CAPI,
+    CROWDSEC_ORIGIN_LISTS
+} crowdsec_origin;
+
+#define CROWDSEC_VERDICT_VERSION 2
+
+/* an address family byte, then four or sixteen address bytes */
+#define CROWDSEC_CACHE_KEY_LEN 17
+
+/* a lookup of this address is in progress in another child */
+#define CROWDSEC_VERDICT_PENDING 1
+
+/* the entry is being refreshed ahead of its expiry */
+#define CROWDSEC_VERDICT_REFRESH 2
+
+/*
+ * The verdict on an ip address, as kept in the cache.
+ *
+ * This is a small fixed size record rather than the response from the
+ * crowdsec service, so that the cache holds as many addresses as possible.
+ */
+typedef struct
+{
+    /* CROWDSEC_VERDICT_VERSION, entries of any other version are ignored */
+    apr_byte_t version;
+    /* the decision type, CROWDSEC_DECISION_NONE if the address is allowed */
+    apr_byte_t type;
+    /* where the decision came from */
+    apr_byte_t origin;
+    /* CROWDSEC_VERDICT_PENDING, CROWDSEC_VERDICT_REFRESH, or zero */
+    apr_byte_t flags;
+    /* the id of the decision, zero if none */
+    apr_uint32_t id;
+    /* when the decision expires, zero if not known */
+    apr_time_t until;
+    /* when the cache entry expires, set as it is written to the cache */
+    apr_time_t expiry;
+} crowdsec_verdict_t;
+
+/* long enough for any address in text, an IPv6 scope included */
+#define CROWDSEC_MEMO_IP_LEN 64
+
+/*
+ * The last verdict reached on a connection, so that the requests that
+ * follow from the same client on a keep-alive or HTTP/2 connection need
+ * no lookup at all.
+ *
+ * HTTP/2 streams are served by several threads at once, each on its own
+ * secondary connection, and share the memo of the master connection. A
+ * writer takes the memo by making the sequence number odd, and gives up
+ * should another writer hold it; readers take no lock, and retry should
+ * the sequence number move under them.
+ */
+typedef struct
+{
+    volatile apr_uint32_t seq;
+    /* the server the verdict was reached for */
+    const void *sconf;
+    /* the generation of the decision store, in stream mode */
+    apr_uint32_t generation;
+    /* when the memo expires */
+    apr_time_t expiry;
+    crowdsec_verdict_t verdict;
+    /* the address of the client, as r->useragent_ip */
+    char ip[CROWDSEC_MEMO_IP_LEN];
+} crowdsec_memo_t;
+
+#define CROWDSEC_IPV4 4
+#define CROWDSEC_IPV6 6
+
+/* an ip address in binary form */
+typedef struct
+{
+    /* CROWDSEC_IPV4 or CROWDSEC_IPV6 */
+    apr_byte_t family;
+    /* the address in network byte order, ipv4 uses the first four bytes */
+    apr_byte_t addr[16];
+} crowdsec_ip_t;
+
+/*
+ * A trusted network, compiled to the masked address and the mask, each
+ * as two words over the sixteen bytes of crowdsec_ip_t, so that an
+ * address is matched with four ands and compares.
+ */
+typedef struct
+{
+    apr_uint64_t net[2];
+    apr_uint64_t mask[2];
+    /* CROWDSEC_IPV4 or CROWDSEC_IPV6 */
+    apr_byte_t family;
+    /* the prefix length */
+    apr_byte_t bits;
+} crowdsec_trusted_t;
+
+#define CROWDSEC_SLOT_EMPTY 0
+#define CROWDSEC_SLOT_USED 1
+#define CROWDSEC_SLOT_DELETED 2
+
+/* no slot, the table is full */
+#define CROWDSEC_SLOT_NONE APR_UINT32_MAX
+
+#define CROWDSEC_CONN_BUFSIZE 8192
+
+/* receives the body of a response from the crowdsec service */
+typedef apr_status_t (crowdsec_body_fn) (void *baton, const char *data,
+                                         apr_size_t len);
+
+/* a connection to the crowdsec service, kept alive between requests */
+typedef struct
+{
+    /* the CrowdsecURL the connection is to, or NULL if not yet chosen */
+    struct crowdsec_endpoint_t *endpoint;
+    /* the socket and address live here, cleared when the socket closes */
+    apr_pool_t *pool;
+    /* the socket, or NULL if not connected */
+    apr_socket_t *sock;
+    /* requests made over the socket so far */
+    apr_uint32_t requests;
+    /* data read but not yet consumed */
+    apr_size_t pos;
+    apr_size_t len;
+    char buf[CROWDSEC_CONN_BUFSIZE];
+} crowdsec_conn_t;
+
+/* the state of one of the CrowdsecURLs, shared by all children */
+typedef struct
+{
+    /* lookups in progress, across all children */
+    volatile apr_uint32_t outstanding;
+    /* number of lookups in a row that failed */
+    volatile apr_uint32_t failures;
+    /* when the endpoint was marked down or last probed, in seconds */
+    volatile apr_uint32_t probed;
+} crowdsec_endpoint_state_t;
+
+/* one of the CrowdsecURLs */
+typedef struct crowdsec_endpoint_t
+{
+    const char *url;
+    /* the parsed url, for the builtin client */
+    apr_uri_t uri;
+    /* the state in shared memory */
+    crowdsec_endpoint_state_t *state;
+#if APR_HAS_THREADS
+    /* kept alive connections for the builtin client */
+    apr_reslist_t *conns;
+#endif
+    /* the kept alive connection when the child is not threaded */
+    crowdsec_conn_t *conn;
+} crowdsec_endpoint_t;
+
+/*
+ * A decision on a single address held in the decision store. The address
+ * itself is kept apart, so that probing the table only touches the
+ * addresses and their states.
+ */
+typedef struct
+{
+    /* when the decision expires, in seconds since the snapshot epoch */
+    apr_uint32_t expiry;
+    /* the id of the decision */
+    apr_uint32_t id;
+    /* the decision type */
+    apr_byte_t type;
+    /* where the decision came from */
+    apr_byte_t origin;
+    /* another live decision on the address was set aside for this one */
+    apr_byte_t shadows;
+} crowdsec_entry_t;
+
+/* the tables of decisions on single addresses, one per address family */
+#define CROWDSEC_TABLE_IPV4 0
+#define CROWDSEC_TABLE_IPV6 1
+#define CROWDSEC_TABLES 2
+
+/*
+ * An open addressed hash table of the decisions on the addresses of one
+ * family, laid out as parallel arrays: the packed addresses, four or
+ * sixteen bytes each, a state byte per slot, and the decisions.
+ */
+typedef struct
+{
+    /* the addresses, in network byte order */
+    unsigned char *keys;
+    /* empty, used, or deleted */
+    apr_byte_t *states;
+    crowdsec_entry_t *entries;
+    /* number of slots, always a power of two */
+    apr_uint32_t size;
+    /* number of decisions held at most, no more than half the slots */
+    apr_uint32_t max;
+    /* four or sixteen */
+    apr_uint32_t key_len;
+} crowdsec_table_t;
+
+/* a decision on a range of addresses held in the decision store */
+typedef struct
+{
+    /* the network address of the range */
+    crowdsec_ip_t ip;
+    /* the prefix length of the range */
+    apr_byte_t bits;
+    /* empty, used, or deleted */
+    apr_byte_t state;
+    /* the decision type */
+    apr_byte_t type;
+    /* where the decision came from */
+    apr_byte_t origin;
+    /* another live decision on the range was set aside for this one */
+    apr_byte_t shadows;
+    /* the id of the decision */
+    apr_uint32_t id;
+    /* the trie node the range hangs off */
+    apr_uint32_t node;
+    /* when the decision expires, in seconds since the snapshot epoch */
+    apr_uint32_t expiry;
+} crowdsec_range_t;
+
+/*
+ * A node of the binary trie over range prefixes, one level per bit.
+ *
+ * Nodes refer to each other by index rather than by pointer, as the
+ * shared memory may be mapped at a different address in each child.
+ * Nodes 0 and 1 are the roots for IPv4 and IPv6, so an index of zero
+ * means no child.
+ */
+typedef struct
+{
+    apr_uint32_t child[2];
+    /* the index of the range ending at this node, plus one, or zero */
+    apr_uint32_t range;
+} crowdsec_node_t;
+
+#define CROWDSEC_NODE_ROOTS 2
+
+/* fingerprints per bucket of the prefilter, filling one 64 bit word */
+#define CROWDSEC_FILTER_WAYS 4
+
+/* a bucket of the prefilter, a zero fingerprint is an empty entry */
+typedef struct
+{
+    apr_uint16_t fp[CROWDSEC_FILTER_WAYS];
+} crowdsec_bucket_t;
+
+/* the state of the prefilter, kept in the snapshot header */
+typedef struct
+{
+    /* an entry was lost, so the filter cannot be trusted until rebuilt */
+    apr_uint32_t overflow;
+    /* number of entries of each prefix length, for IPv4 and IPv6 */
+    apr_uint32_t prefixes[2][129];
+    /* the prefix lengths with entries, one bit each */
+    apr_uint32_t lengths[2][5];
+} crowdsec_filter_hdr_t;
+
+#define CROWDSEC_SCOPE_COUNTRY 1
+#define CROWDSEC_SCOPE_AS 2
+
+/* a decision on a whole country or autonomous system */
+typedef struct
+{
+    /* when the decision expires, in seconds since the snapshot epoch */
+    apr_uint32_t expiry;
+    /* the AS number, or the two letter country code packed into 16 bits */
+    apr_uint32_t value;
+    /* country or AS */
+    apr_byte_t scope;
+    /* empty, used, or deleted */
+    apr_byte_t state;
+    /* the decision type */
+    apr_byte_t type;
+    /* where the decision came from */
+    apr_byte_t origin;
+    /* another live decision on the value was set aside for this one */
+    apr_byte_t shadows;
+    /* the id of the decision */
+    apr_uint32_t id;
+} crowdsec_scoped_t;
+
+/* the start of each snapshot */
+typedef struct
+{
+    /* odd while the snapshot is being written */
+    volatile apr_uint32_t seq;
+    /* number of slots in use, in each table */
+    apr_uint32_t used[CROWDSEC_TABLES];
+    /* number of slots deleted, in each table */
+    apr_uint32_t deleted[CROWDSEC_TABLES];
+    /* number of ranges in use */
+    apr_uint32_t ranges_used;
+    /* number of ranges deleted, whose trie nodes are not reclaimed */
+    apr_uint32_t ranges_deleted;
+    /* number of ranges ever handed out since the trie was last built */
+    apr_uint32_t ranges_top;
+    /* number of trie nodes handed out, including the roots */
+    apr_uint32_t nodes_top;
+    /* number of country and AS decisions in use */
+    apr_uint32_t scoped_used;
+    /* number of country and AS entries handed out */
+    apr_uint32_t scoped_top;
+    /* time of the last successful pull, zero if never */
+    apr_time_t updated;
+    /* the time expiry offsets count from, in whole seconds */
+    apr_time_t epoch;
+    /* the state of the prefilter */
+    crowdsec_filter_hdr_t filter;
+} crowdsec_snapshot_hdr_t;
+
+/*
+ * A snapshot of the decisions. Decisions on individual addresses are kept
+ * in an open addressed hash table for each address family, and decisions
+ * on ranges in a trie that is searched for the longest matching prefix.
+ * Expiry times are kept as 32 bit offsets in seconds from the epoch of
+ * the snapshot, which is carried over as the snapshot is copied.
+ *
+ * Both are fronted by a cuckoo filter holding a fingerprint of each
+ * address and range. Unlike a bloom filter, entries can be removed again
+ * as decisions are deleted or expire, so the filter need only be rebuilt
+ * when the table or the trie are.
+ */
+typedef struct
+{
+    /* the header at the start of the snapshot */
+    crowdsec_snapshot_hdr_t *hdr;
+    /* the IPv4 and IPv6 tables following the header */
+    crowdsec_table_t tables[CROWDSEC_TABLES];
+    /* the ranges following the tables */
+    crowdsec_range_t *ranges;
+    /* the trie following the ranges */
+    crowdsec_node_t *nodes;
+    /* the country and AS decisions following the trie */
+    crowdsec_scoped_t *scoped;
+    /* the prefilter following the country and AS decisions */
+    crowdsec_bucket_t *filter;
+    /* number of ranges */
+    apr_uint32_t max_ranges;
+    /* number of trie nodes */
+    apr_uint32_t max_nodes;
+    /* number of country and AS decisions */
+    apr_uint32_t max_scoped;
+    /* number of prefilter buckets, always a power of two */
+    apr_uint32_t filter_size;
+    /* decisions applied or expired by this process since last counted */
+    apr_uint32_t changes;
+    /* decisions evicted to make room, and dropped for want of it */
+    apr_uint32_t evicted;
+    apr_uint32_t dropped;
+    /* a decision set aside may have been uncovered, pull them all again */
+    int resync;
+} crowdsec_snapshot_t;
+
+/*
+ * The start of the snapshot file. The file holds the snapshot header and
+ * the parts of the snapshot in use, laid out as they are in the store, so
+ * that loading it is a plain read. A file written by a build with another
+ * layout is recognised by the sizes here, and ignored.
+ */
+typedef struct
+{
+    apr_uint32_t magic;
+    apr_uint32_t version;
+    /* the sizes of the snapshot */
+    apr_uint32_t v4_size;
+    apr_uint32_t v6_size;
+    apr_uint32_t max_ranges;
+    apr_uint32_t max_nodes;
+    apr_uint32_t max_scoped;
+    apr_uint32_t filter_size;
+    /* the sizes of each record */
+    apr_uint32_t hdr_len;
+    apr_uint32_t entry_len;
+    apr_uint32_t range_len;
+    apr_uint32_t node_len;
+    apr_uint32_t scoped_len;
+    apr_uint32_t bucket_len;
+} crowdsec_snapfile_t;
+
+/* the start of the shared memory segment */
+typedef struct
+{
+    /* the snapshot readers should use */
+    volatile apr_uint32_t active;
+    /* the next pull must fetch the full set of decisions */
+    volatile apr_uint32_t resync;
+    /* bumped once a snapshot with changes is published */
+    volatile apr_uint32_t generation;
+} crowdsec_store_hdr_t;
+
+/* the state of the circuit breaker, shared by all children */
+typedef struct
+{
+    /* number of lookups in a row that failed */
+    volatile apr_uint32_t failures;
+    /* when the circuit opened or was last probed, in seconds */
+    volatile apr_uint32_t probed;
+} crowdsec_breaker_t;
+
+/*
+ * The rate of an address with a throttle decision, shared by all children.
+ *
+ * The rate is kept with the generic cell rate algorithm, as the time at
+ * which the next request is due, in microseconds as they wrap at 32 bits.
+ * Slots are found by the hash of the address alone. A slot found holding
+ * another address is taken over once that address has gone idle, and
+ * until then lets the request through, which errs on the side of the
+ * client.
+ */
+typedef struct
+{
+    /* the hash of the address in the slot */
+    volatile apr_uint32_t key;
+    /* when the next request is due */
+    volatile apr_uint32_t tat;
+} crowdsec_throttle_t;
+
+/* upper bounds of the lookup latency histogram buckets, in microseconds */
+static const apr_interval_time_t crowdsec_latency_bounds[] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000
+};
+
+#define CROWDSEC_LATENCY_BUCKETS \
+    (sizeof(crowdsec_latency_bounds) / sizeof(crowdsec_latency_bounds[0]))
+
+/*
+ * Counters in shared memory, shared by all children and all servers.
+ *
+ * Each is bumped with a single atomic add where the event happens, and
+ * left to wrap at 32 bits, which anything scraping them takes as a reset.
+ */
+typedef struct
+{
+    /* requests checked against the decisions */
+    volatile apr_uint32_t requests;
+    /* requests let through from CrowdsecTrustedNetworks */
+    volatile apr_uint32_t trusted;
+    /* connections dropped by CrowdsecConnectionFilter */
+    volatile apr_uint32_t connections_dropped;
+    /* verdicts remembered on the connection */
+    volatile apr_uint32_t connection_hits;
+    /* verdicts found in the per child cache */
+    volatile apr_uint32_t l1_hits;
+    /* verdicts found in the cache */
+    volatile apr_uint32_t cache_hits;
+    /* verdicts not found in the cache */
+    volatile apr_uint32_t cache_misses;
+    /* verdicts written to the cache */
+    volatile apr_uint32_t cache_stores;
+    /* cache writes dropped as the mutex was busy */
+    volatile apr_uint32_t cache_busy;
+    /* cache reads and writes that failed */
+    volatile apr_uint32_t cache_errors;
+    /* lookups made by requests to the crowdsec service */
+    volatile apr_uint32_t lookups;
+    /* lookups within each latency bucket, and beyond the last */
+    volatile apr_uint32_t latency[CROWDSEC_LATENCY_BUCKETS + 1];
+    /* total time spent in lookups, in milliseconds */
+    volatile apr_uint32_t latency_ms;
+    /* times CrowdsecFallback applied */
+    volatile apr_uint32_t fallbacks;
+    /* expired verdicts served in place of CrowdsecFallback */
+    volatile apr_uint32_t stale;
+    /* lookups sent to a second endpoint as the first was slow */
+    volatile apr_uint32_t hedges;
+    /* hedged lookups answered first by the second endpoint */
+    volatile apr_uint32_t hedge_wins;
+    /* requests turned away for going over CrowdsecThrottle */
+    volatile apr_uint32_t throttled;
+    /* pulls of the decisions in stream mode */
+    volatile apr_uint32_t pulls;
+    /* pulls of the decisions that failed */
+    volatile apr_uint32_t pull_failures;
+    /* decisions evicted from the full decision store to make room */
+    volatile apr_uint32_t store_evicted;
+    /* decisions dropped as the decision store was full */
+    volatile apr_uint32_t store_dropped;
+    /* verdicts reached, by decision type */
+    volatile apr_uint32_t verdicts[CROWDSEC_DECISION_BAN + 1];
+} crowdsec_metrics_t;
+
+/*
+ * The decision store used in stream mode.
+ *
+ * The decisions live in shared memory created in post_config, so that all
+ * children share one copy. A single child updates the store, as elected by
+ * a singleton watchdog.
+ *
+ * Readers take no lock. The store holds two snapshots, and the updater
+ * builds the next snapshot alongside the active one, and then publishes
+ * it by swapping the active index. Each snapshot carries a sequence
+ * number that is odd while it is being written, so that a reader that
+ * races with the updater notices and tries again.
+ */
+typedef struct
+{
+    /* the shared memory segment */
+    apr_shm_t *shm;
+    /* the header at the start of the segment */
+    crowdsec_store_hdr_t *hdr;
+    /* the two snapshots following the header */
+    crowdsec_snapshot_t snap[2];
+} crowdsec_store_t;
+
 typedef struct
 {
-    /* the url of the crowdsec service */
+    /* the url of the crowdsec service, the first of the CrowdsecURLs */
     const char *url;
+    /* all of the CrowdsecURLs, as strings */
+    apr_array_header_t *urls;
+    /* the CrowdsecURLs, of crowdsec_endpoint_t, set up in post_config */
+    apr_array_header_t *endpoints;
+    /* where each child starts looking for the least busy endpoint */
+    volatile apr_uint32_t endpoint_next;
     /* the API key of the crowdsec service */
     const char *key;
     /* shared obect cache mutex */
@@ -115,6 +882,92 @@ typedef struct
     ap_socache_instance_t *cache_instance;
     /* shared object cache timeout */
     apr_interval_time_t cache_timeout;
+    /* shared object cache timeout for addresses without a decision */
+    apr_interval_time_t cache_allow_timeout;
+    /* upper limit on the cache timeout for addresses with a decision */
+    apr_interval_time_t cache_ban_timeout;
+    /* refresh cache entries hit this close to their expiry */
+    apr_interval_time_t cache_refresh;
+    /* how long to keep cache entries beyond their expiry */
+    apr_interval_time_t cache_stale;
+    /* entries in the per child cache, zero for none */
+    int l1_size;
+    /* how long the per child cache keeps entries */
+    apr_interval_time_t l1_timeout;
+    /* the per child cache in front of the shared cache */
+    struct crowdsec_l1_t *l1;
+    /* how long a verdict is remembered on the connection, zero for not */
+    apr_interval_time_t conn_cache_timeout;
+    /* the shared decision store in stream mode */
+    crowdsec_store_t *store;
+    /* how often to pull decisions in stream mode */
+    apr_interval_time_t stream_interval;
+    /* the file the decisions are saved to in stream mode, or NULL */
+    const char *stream_snapshot;
+    /* IPv4 address decisions the store holds at most */
+    int store_size;
+    /* decisions have changed since the file was last saved */
+    int stream_snapshot_dirty;
+    /* when the file was last saved */
+    apr_time_t stream_snapshot_saved;
+    /* how long to wait for a lookup already in progress */
+    apr_interval_time_t coalesce_timeout;
+    /* how long to wait to connect to the crowdsec service */
+    apr_interval_time_t connect_timeout;
+    /* how long to wait for the crowdsec service to respond */
+    apr_interval_time_t timeout;
+    /* most requests per child waiting on a lookup at once, zero for any */
+    int max_lookups;
+    /* requests in this child waiting on a lookup */
+    volatile apr_uint32_t lookups;
+    /* when a lookup in this child last failed, in seconds */
+    volatile apr_uint32_t failed;
+    /* the circuit breaker in shared memory, or NULL if disabled */
+    crowdsec_breaker_t *breaker;
+    /* failed lookups in a row that open the circuit, zero never */
+    int breaker_failures;
+    /* how often to let a lookup through while the circuit is open */
+    apr_interval_time_t breaker_retry;
+    /* the connection used by the watchdog in stream mode */
+    crowdsec_conn_t *stream_conn;
+    /* send a second lookup elsewhere after this long, zero for never */
+    apr_interval_time_t hedge;
+    /* or after this percentile of the lookup latency, zero for none */
+    int hedge_percentile;
+    /* the mod_proxy subrequest, or the builtin client */
+    crowdsec_client client;
+    /* paths of the GeoIP databases */
+    apr_array_header_t *geo_files;
+    /* networks never looked up, of crowdsec_trusted_t, or NULL */
+    apr_array_header_t *trusted;
+    /* drop connections from banned addresses as they are accepted */
+    int conn_filter;
+    /* requests a second allowed on a throttle decision, zero to block */
+    int throttle_rate;
+    /* requests allowed at once on a throttle decision */
+    int throttle_burst;
+#ifdef HAVE_MAXMINDDB
+    /* the GeoIP databases, mapped in post_config */
+    apr_array_header_t *geo;
+#endif
+#if APR_HAS_THREADS
+    /* lookups in progress in this child, keyed on the cache key */
+    apr_hash_t *flights;
+    /* protects flights */
+    apr_thread_mutex_t *flight_mutex;
+    /* finished lookups ready to be reused */
+    struct crowdsec_flight_t *flight_free;
+    /* the pool of the child, for new lookups */
+    apr_pool_t *flight_pool;
+    /* the threads refreshing cache entries in the background */
+    apr_thread_pool_t *refresh_pool;
+    /* the dispatcher sending lookups in batches */
+    struct crowdsec_batch_t *batch;
+#endif
+    /* how long to gather lookups into a batch, zero for no batches */
+    apr_interval_time_t batch_window;
+    /* live or stream mode */
+    crowdsec_mode mode;
     /* the url was explicitly set */
     unsigned int url_set:1;
     /* the key was explicitly set */
@@ -123,8 +976,123 @@ typedef struct
     unsigned int cache_provider_set:1;
     /* the timeout was explicitly set */
     unsigned int cache_timeout_set:1;
+    /* the allow timeout was explicitly set */
+    unsigned int cache_allow_timeout_set:1;
+    /* the ban timeout was explicitly set */
+    unsigned int cache_ban_timeout_set:1;
+    /* the refresh window was explicitly set */
+    unsigned int cache_refresh_set:1;
+    /* the stale timeout was explicitly set */
+    unsigned int cache_stale_set:1;
+    /* the per child cache size was explicitly set */
+    unsigned int l1_size_set:1;
+    /* the per child cache timeout was explicitly set */
+    unsigned int l1_timeout_set:1;
+    /* the connection cache timeout was explicitly set */
+    unsigned int conn_cache_timeout_set:1;
+    /* the mode was explicitly set */
+    unsigned int mode_set:1;
+    /* the stream interval was explicitly set */
+    unsigned int stream_interval_set:1;
+    /* the stream snapshot was explicitly set */
+    unsigned int stream_snapshot_set:1;
+    /* the store size was explicitly set */
+    unsigned int store_size_set:1;
+    /* the coalesce timeout was explicitly set */
+    unsigned int coalesce_timeout_set:1;
+    /* the connect timeout was explicitly set */
+    unsigned int connect_timeout_set:1;
+    /* the timeout was explicitly set */
+    unsigned int timeout_set:1;
+    /* the client was explicitly set */
+    unsigned int client_set:1;
+    /* the lookup limit was explicitly set */
+    unsigned int max_lookups_set:1;
+    /* the breaker failures were explicitly set */
+    unsigned int breaker_failures_set:1;
+    /* the breaker retry was explicitly set */
+    unsigned int breaker_retry_set:1;
+    /* the batch window was explicitly set */
+    unsigned int batch_window_set:1;
+    /* the GeoIP databases were explicitly set */
+    unsigned int geo_files_set:1;
+    /* the trusted networks were explicitly set */
+    unsigned int trusted_set:1;
+    /* the connection filter was explicitly set */
+    unsigned int conn_filter_set:1;
+    /* the throttle was explicitly set */
+    unsigned int throttle_set:1;
+    /* the hedge was explicitly set */
+    unsigned int hedge_set:1;
 } crowdsec_server_rec;
 
+#if APR_HAS_THREADS
+/* a lookup in progress, that other requests for the same address wait on */
+typedef struct crowdsec_flight_t
+{
+    struct crowdsec_flight_t *next;
+    /* signalled when the lookup is done */
+    apr_thread_cond_t *cond;
+    /* the result of the lookup */
+    crowdsec_verdict_t verdict;
+    /* the number of requests waiting */
+    int waiters;
+    /* the lookup is done */
+    int done;
+    /* the lookup gave a verdict */
+    int ok;
+    unsigned int keylen;
+    unsigned char key[CROWDSEC_CACHE_KEY_LEN];
+} crowdsec_flight_t;
+
+/*
+ * A lookup waiting to go out in the next batch. Jobs belong to the
+ * dispatcher, so that one given up on by its request can still be
+ * written to by the batch carrying it.
+ */
+typedef struct crowdsec_job_t
+{
+    struct crowdsec_job_t *next;
+    /* the address to look up */
+    char ip[CROWDSEC_MEMO_IP_LEN];
+    /* the verdict, copied out by the request */
+    crowdsec_verdict_t verdict;
+    /* OK, or the status CrowdsecFallback should be applied with */
+    int status;
+    /* the batch carrying the lookup is done */
+    int done;
+    /* the request gave up waiting, the dispatcher frees the job */
+    int abandoned;
+} crowdsec_job_t;
+
+/* the dispatcher of a child, sending lookups in batches */
+typedef struct crowdsec_batch_t
+{
+    server_rec *s;
+    /* the dispatcher thread */
+    apr_thread_t *thread;
+    /* protects everything below */
+    apr_thread_mutex_t *mutex;
+    /* signalled when lookups are queued */
+    apr_thread_cond_t *wake;
+    /* broadcast when a batch is done */
+    apr_thread_cond_t *done;
+    /* the lookups queued for the next batch */
+    crowdsec_job_t *head;
+    crowdsec_job_t *tail;
+    int queued;
+    /* jobs free for reuse, and the pool new ones come from */
+    crowdsec_job_t *free;
+    apr_pool_t *jobs;
+    /* the child is going away */
+    int stop;
+    /* the connection the batches are sent over */
+    crowdsec_conn_t *conn;
+    /* cleared after each batch */
+    apr_pool_t *pool;
+} crowdsec_batch_t;
+#endif
+
 typedef enum {
     CROWDSEC_FAIL,
     CROWDSEC_BLOCK,
@@ -139,10 +1107,12 @@ typedef enum {
 
 typedef struct
 {
-    /* the response from the crowdsec service is stored here */
-    const char *response;
     /* the location to redirect to on block */
     ap_expr_info_t *location;
+    /* the location, if the expression refers to no variables */
+    const char *location_str;
+    /* the response redirecting there, if the location is a fixed url */
+    const char *location_body;
     /* enable was explicitly set */
     unsigned int enable:1;
     /* crowdsec fallback behaviour */
@@ -159,12 +1129,240 @@ typedef struct
     unsigned int blockedhttpcode_set:1;
 } crowdsec_config_rec;
 
+
 #define CROWDSEC_CACHE_TIMEOUT_DEFAULT 60
 
-#define MAX_VAL_LEN 256
+#define CROWDSEC_STREAM_INTERVAL_DEFAULT 10
+
+#define CROWDSEC_COALESCE_TIMEOUT_DEFAULT 5
+
+/* how often to look for a lookup in another child to finish */
+#define CROWDSEC_COALESCE_POLL apr_time_from_msec(20)
+
+/* lookups sent in a single batch at most */
+#define CROWDSEC_BATCH_MAX 32
+
+#define CROWDSEC_BREAKER_FAILURES_DEFAULT 5
+
+/* failed lookups in a row after which one of several CrowdsecURLs is
+ * skipped, and endpoints tried for one lookup */
+#define CROWDSEC_ENDPOINT_FAILURES 3
+#define CROWDSEC_ENDPOINT_TRIES 2
+
+/* lookups seen before CrowdsecHedge by percentile starts to hedge */
+#define CROWDSEC_HEDGE_SAMPLES 100
+#define CROWDSEC_BREAKER_RETRY_DEFAULT 5
+
+/* serve expired verdicts without a lookup this long after a failure */
+#define CROWDSEC_STALE_RETRY 5
+
+/* threads per child refreshing cache entries in the background */
+#define CROWDSEC_REFRESH_THREADS 2
+
+/* refreshes waiting per child, beyond which no more are scheduled */
+#define CROWDSEC_REFRESH_QUEUE 64
+
+#define CROWDSEC_STREAM_TIMEOUT apr_time_from_sec(30)
+
+/* save the decisions to the snapshot file at most this often */
+#define CROWDSEC_SNAPSHOT_INTERVAL apr_time_from_sec(60)
+
+#define CROWDSEC_SNAPSHOT_MAGIC 0x43534453      /* "CSDS" */
+#define CROWDSEC_SNAPSHOT_VERSION 3
+
+#define CROWDSEC_CONNECT_TIMEOUT_DEFAULT 1
+
+#define CROWDSEC_TIMEOUT_DEFAULT 5
+
+/* close kept alive connections idle for longer than this */
+#define CROWDSEC_CONN_TTL apr_time_from_sec(30)
+
+#define CROWDSEC_WATCHDOG_NAME "_crowdsec_"
+
+/* IPv4 address decisions unless given, the tables are kept half full */
+#define CROWDSEC_STORE_SIZE_DEFAULT (128 * 1024)
+#define CROWDSEC_STORE_SIZE_MIN 1024
+#define CROWDSEC_STORE_SIZE_MAX (16 * 1024 * 1024)
+
+/* IPv6 address decisions are rarer, and get a quarter of the room */
+#define CROWDSEC_STORE_IPV6_SHARE 4
+
+/* decisions sampled for the one least worth keeping in a full table */
+#define CROWDSEC_STORE_EVICT_SAMPLES 8
+
+/* range decisions per snapshot, and the trie nodes to index them */
+#define CROWDSEC_STORE_RANGES (32 * 1024)
+#define CROWDSEC_STORE_NODES (256 * 1024)
+
+/* country and AS decisions per snapshot */
+#define CROWDSEC_STORE_SCOPED 1024
+
+/* prefilter entries per bucket at most, with every decision and range */
+#define CROWDSEC_STORE_FILTER_LOAD 3
+
+/* give up on inserting into the prefilter after this many evictions */
+#define CROWDSEC_FILTER_KICKS 500
+
+/* entries in the native cache unless given, in sets of so many ways */
+#define CROWDSEC_NATIVE_ENTRIES (64 * 1024)
+#define CROWDSEC_NATIVE_ENTRIES_MAX (64 * 1024 * 1024)
+#define CROWDSEC_NATIVE_WAYS 8
+
+/* spins on a busy set of the native cache between backing off */
+#define CROWDSEC_NATIVE_SPINS 1000
+#define CROWDSEC_NATIVE_BACKOFF apr_time_from_msec(1)
+
+/* back offs with no progress, after which a write is given up */
+#define CROWDSEC_NATIVE_WAITS 10
+
+/* tries at a consistent read, before a busy set counts as a miss */
+#define CROWDSEC_NATIVE_READS 64
+
+/* shards of the per child cache in threaded children, and ways per set */
+#define CROWDSEC_L1_SHARDS 16
+#define CROWDSEC_L1_WAYS 4
+
+#define CROWDSEC_L1_TIMEOUT_DEFAULT 1
+
+#define CROWDSEC_CONN_CACHE_TIMEOUT_DEFAULT 1
+
+/* tries at a consistent read of the verdict remembered on a connection */
+#define CROWDSEC_MEMO_READS 4
+
+/* slots of the throttle, and tries at updating a busy slot */
+#define CROWDSEC_THROTTLE_SLOTS (64 * 1024)
+#define CROWDSEC_THROTTLE_TRIES 8
+
+/* the most requests a second, and the longest a burst may span */
+#define CROWDSEC_THROTTLE_RATE_MAX 1000
+#define CROWDSEC_THROTTLE_SPAN 0x7fffffff
+
+/* the start and end of a response to a blocked request */
+#define CROWDSEC_BLOCK_HEAD(title, heading) \
+    DOCTYPE_HTML_2_0 \
+    "<html><head>\n<title>" title "</title>\n</head><body>\n" \
+    "<h1>" heading "</h1>\n"
+#define CROWDSEC_BLOCK_TAIL "</body></html>\n"
+
+/*
+ * Readers of the decision store need their loads ordered against the
+ * sequence number, without writing to any shared cache line.
+ */
+#if defined(__ATOMIC_ACQ_REL)
+#define crowdsec_barrier() __atomic_thread_fence(__ATOMIC_ACQ_REL)
+#elif defined(__GNUC__)
+#define crowdsec_barrier() __sync_synchronize()
+#else
+#define crowdsec_barrier() apr_atomic_read32(&crowdsec_fence)
+static volatile apr_uint32_t crowdsec_fence;
+#endif
 
 static const char *const crowdsec_id = "crowdsec";
 
+static const char *const crowdsec_store_id = "crowdsec-store";
+
+static const char *const crowdsec_breaker_id = "crowdsec-breaker";
+
+static const char *const crowdsec_endpoints_id = "crowdsec-endpoints";
+
+static const char *const crowdsec_native_id = "crowdsec-cache";
+
+static const char *const crowdsec_metrics_id = "crowdsec-metrics";
+
+static const char *const crowdsec_throttle_id = "crowdsec-throttle";
+
+static const char *const crowdsec_metrics_handler = "crowdsec-metrics";
+
+/* the counters, once created in post_config */
+static crowdsec_metrics_t *crowdsec_metrics;
+
+/* some server remembers verdicts on its connections */
+static int crowdsec_conn_cache;
+
+/* the throttle slots, once created in post_config */
+static crowdsec_throttle_t *crowdsec_throttles;
+
+#define crowdsec_count(field) \
+    do { \
+        if (crowdsec_metrics) { \
+            apr_atomic_inc32(&crowdsec_metrics->field); \
+        } \
+    } while (0)
+
+/* the counters reported as is, in the order reported */
+static const struct
+{
+    const char *name;
+    const char *title;
+    const char *help;
+    apr_size_t offset;
+} crowdsec_counters[] = {
+    { "requests", "Requests",
+      "Requests checked against the decisions.",
+      APR_OFFSETOF(crowdsec_metrics_t, requests) },
+    { "trusted", "Trusted",
+      "Requests let through from CrowdsecTrustedNetworks.",
+      APR_OFFSETOF(crowdsec_metrics_t, trusted) },
+    { "connections_dropped", "ConnectionsDropped",
+      "Connections dropped by CrowdsecConnectionFilter.",
+      APR_OFFSETOF(crowdsec_metrics_t, connections_dropped) },
+    { "connection_hits", "ConnectionHits",
+      "Verdicts remembered on the connection.",
+      APR_OFFSETOF(crowdsec_metrics_t, connection_hits) },
+    { "l1_hits", "L1Hits",
+      "Verdicts found in the per child cache.",
+      APR_OFFSETOF(crowdsec_metrics_t, l1_hits) },
+    { "cache_hits", "CacheHits",
+      "Verdicts found in the cache.",
+      APR_OFFSETOF(crowdsec_metrics_t, cache_hits) },
+    { "cache_misses", "CacheMisses",
+      "Verdicts not found in the cache.",
+      APR_OFFSETOF(crowdsec_metrics_t, cache_misses) },
+    { "cache_stores", "CacheStores",
+      "Verdicts written to the cache.",
+      APR_OFFSETOF(crowdsec_metrics_t, cache_stores) },
+    { "cache_busy", "CacheBusy",
+      "Cache writes dropped as the mutex was busy.",
+      APR_OFFSETOF(crowdsec_metrics_t, cache_busy) },
+    { "cache_errors", "CacheErrors",
+      "Cache reads and writes that failed.",
+      APR_OFFSETOF(crowdsec_metrics_t, cache_errors) },
+    { "fallbacks", "Fallbacks",
+      "Times CrowdsecFallback applied.",
+      APR_OFFSETOF(crowdsec_metrics_t, fallbacks) },
+    { "stale", "Stale",
+      "Expired verdicts served in place of CrowdsecFallback.",
+      APR_OFFSETOF(crowdsec_metrics_t, stale) },
+    { "hedges", "Hedges",
+      "Lookups sent to a second endpoint as the first was slow.",
+      APR_OFFSETOF(crowdsec_metrics_t, hedges) },
+    { "hedge_wins", "HedgeWins",
+      "Hedged lookups answered first by the second endpoint.",
+      APR_OFFSETOF(crowdsec_metrics_t, hedge_wins) },
+    { "throttled", "Throttled",
+      "Requests turned away for going over CrowdsecThrottle.",
+      APR_OFFSETOF(crowdsec_metrics_t, throttled) },
+    { "pulls", "Pulls",
+      "Pulls of the decisions in stream mode.",
+      APR_OFFSETOF(crowdsec_metrics_t, pulls) },
+    { "pull_failures", "PullFailures",
+      "Pulls of the decisions in stream mode that failed.",
+      APR_OFFSETOF(crowdsec_metrics_t, pull_failures) },
+    { "store_evicted", "StoreEvicted",
+      "Decisions evicted from the full decision store to make room.",
+      APR_OFFSETOF(crowdsec_metrics_t, store_evicted) },
+    { "store_dropped", "StoreDropped",
+      "Decisions dropped as the decision store was full.",
+      APR_OFFSETOF(crowdsec_metrics_t, store_dropped) },
+};
+
+#define CROWDSEC_COUNTERS \
+    (sizeof(crowdsec_counters) / sizeof(crowdsec_counters[0]))
+
+static const char *const crowdsec_decision_names[] = {
+    "none", "throttle", "captcha", "other", "ban"
+};
+
 static apr_status_t cleanup_lock(void *data)
 {
     server_rec *s = data;
@@ -180,6 +1378,14 @@ static apr_status_t cleanup_lock(void *data)
     return APR_SUCCESS;
 }
 
+#ifdef HAVE_MAXMINDDB
+static apr_status_t cleanup_mmdb(void *data)
+{
+    MMDB_close(data);
+    return APR_SUCCESS;
+}
+#endif
+
 static apr_status_t cleanup_cache(void *data)
 {
     server_rec *s = data;
@@ -197,752 +1403,8276 @@ static apr_status_t cleanup_cache(void *data)
 }
 
 /*
- * The socache_shmcb module has an arbitrary restriction
- * that keys cannot be less than 4 bytes. Localhost can
- * be 3 bytes (::1), pad if necessary.
+ * Create shared memory for all children. Anonymous shared memory is
+ * inherited by the children, and where there is none we fall back to a
+ * file in the runtime directory.
  */
-static const char *crowdsec_cache_key(request_rec * r, apr_size_t * len)
+static apr_status_t crowdsec_shm_create(apr_shm_t ** shm, apr_size_t size,
+                                        const char *id, apr_pool_t * pconf,
+                                        apr_pool_t * ptmp, server_rec * s)
 {
+    apr_status_t status;
 
-    const char *key = r->useragent_ip;
+    status = apr_shm_create(shm, size, NULL, pconf);
+    if (APR_STATUS_IS_ENOTIMPL(status)) {
+        const char *fname = ap_runtime_dir_relative(pconf,
+                apr_psprintf(ptmp, "%s.%s.%d", id,
+                             s->server_hostname ? s->server_hostname : "",
+                             s->port));
 
-    apr_size_t slen = strlen(key);
+        apr_shm_remove(fname, pconf);
+        status = apr_shm_create(shm, size, fname, pconf);
+    }
 
-    if (slen < 4) {
+    return status;
+}
 
-        char *padded;
+/* an entry of the native cache */
+typedef struct
+{
+    /* when the entry expires, zero if empty */
+    apr_time_t expiry;
+    apr_byte_t keylen;
+    /* set when hit, and cleared as the clock hand passes */
+    volatile apr_byte_t ref;
+    apr_uint16_t datalen;
+    unsigned char key[CROWDSEC_CACHE_KEY_LEN];
+    unsigned char data[sizeof(crowdsec_verdict_t)];
+} crowdsec_native_entry_t;
+
+/* a set of entries of the native cache, sharing a lock */
+typedef struct
+{
+    /* odd while a writer holds the set */
+    volatile apr_uint32_t seq;
+    /* the pid of the writer holding the set, taken before seq, or zero */
+    volatile apr_uint32_t owner;
+    /* the way the clock hand points at */
+    apr_uint32_t hand;
+    crowdsec_native_entry_t ways[CROWDSEC_NATIVE_WAYS];
+} crowdsec_native_set_t;
 
-        padded = apr_pcalloc(r->pool, 5);
-        memset(padded, ' ', 4);
-        memcpy(padded, r->useragent_ip, slen);
+/*
+ * The native cache, selected with CrowdsecCache native.
+ *
+ * A set associative table of fixed size entries in shared memory. Each
+ * address hashes to a set of a few ways, and each set has a sequence
+ * number of its own, which a writer makes odd while it holds the set.
+ * Writers wait for one another on the same set only, and a write is
+ * only dropped should the set stay busy for long. Readers take no lock
+ * at all, trying again should a writer have been at work meanwhile.
+ *
+ * When a set is full, the CLOCK algorithm picks an entry to evict,
+ * sparing entries hit since the hand last passed them.
+ */
+struct ap_socache_instance_t
+{
+    /* number of sets, a power of two */
+    apr_uint32_t sets;
+    apr_shm_t *shm;
+    crowdsec_native_set_t *set;
+};
 
-        *len = 4;
-        return padded;
+static const char *crowdsec_native_create(ap_socache_instance_t ** instance,
+                                          const char *arg, apr_pool_t * tmp,
+                                          apr_pool_t * p)
+{
+    ap_socache_instance_t *inst;
+    apr_int64_t entries = CROWDSEC_NATIVE_ENTRIES;
+    apr_uint32_t sets = 1;
+
+    if (arg && *arg) {
+        char *end;
+
+        entries = apr_strtoi64(arg, &end, 10);
+        if (*end || entries < 1 || entries > CROWDSEC_NATIVE_ENTRIES_MAX) {
+            return apr_psprintf(tmp, "native cache size '%s' must be a "
+                                "number of entries between 1 and %d", arg,
+                                CROWDSEC_NATIVE_ENTRIES_MAX);
+        }
     }
-    else {
-        *len = slen;
-        return key;
+
+    while ((apr_int64_t) sets * CROWDSEC_NATIVE_WAYS < entries) {
+        sets <<= 1;
     }
-}
 
-static const char *crowdsec_from_cache(request_rec * r)
-{
+    inst = apr_pcalloc(p, sizeof(ap_socache_instance_t));
+    inst->sets = sets;
 
-    const char *key;
-    apr_size_t keylen;
+    *instance = inst;
 
-    unsigned char val[MAX_VAL_LEN];
-    unsigned int vallen = MAX_VAL_LEN - 1;
-
-    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
-        ap_get_module_config(r->server->module_config,
-                             &crowdsec_module);
-
-    const char *response = NULL;
+    return NULL;
+}
 
+static apr_status_t crowdsec_native_init(ap_socache_instance_t * inst,
+                                         const char *cname,
+                                         const struct ap_socache_hints *hints,
+                                         server_rec * s, apr_pool_t * p)
+{
+    apr_size_t size = inst->sets * sizeof(crowdsec_native_set_t);
     apr_status_t status;
 
-    if (!sconf->cache_provider) {
-        return NULL;
+    /* servers inheriting the cache share the one segment */
+    if (inst->shm) {
+        return APR_SUCCESS;
     }
 
-    key = crowdsec_cache_key(r, &keylen);
-
-    status = sconf->cache_provider->retrieve(sconf->cache_instance, r->server,
-                                             (unsigned char *) key, keylen,
-                                             val, &vallen, r->pool);
-
-    if (APR_STATUS_IS_NOTFOUND(status)) {
-        /* not found - just return */
-        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                      "crowdsec: no response found in cache for %s",
-                      r->useragent_ip);
-        return NULL;
-    }
-    else if (status == APR_SUCCESS) {
-        /* OK, we got a value */
-        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                      "crowdsec: response found in cache for %s",
-                      r->useragent_ip);
-    }
-    else {
-        /* error: give up and pass the buck */
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
-                      "crowdsec: error while retrieving cache response for %s",
-                      r->useragent_ip);
-        return NULL;
+    status = crowdsec_shm_create(&inst->shm, size, crowdsec_native_id, p, p,
+                                 s);
+    if (status != APR_SUCCESS) {
+        return status;
     }
 
-    response = apr_pstrmemdup(r->pool, (char *) val, vallen);
+    inst->set = apr_shm_baseaddr_get(inst->shm);
+    memset(inst->set, 0, size);
 
-    return response;
+    return APR_SUCCESS;
 }
 
-static void crowdsec_to_cache(request_rec * r, const char *response)
+static void crowdsec_native_destroy(ap_socache_instance_t * inst,
+                                    server_rec * s)
 {
+    /* the segment goes with the pool it was created in */
+}
 
-    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
-        ap_get_module_config(r->server->module_config,
-                             &crowdsec_module);
-
-    apr_time_t expiry;
-
-    const char *key;
-    apr_size_t keylen;
-
-    apr_status_t status;
+/*
+ * Hash a cache key, FNV-1a with a final mix so that every bit counts.
+ */
+static apr_uint32_t crowdsec_cache_hash(const unsigned char *id,
+                                        unsigned int idlen)
+{
+    apr_uint32_t h = 2166136261U;
+    unsigned int i;
 
-    if (!sconf->cache_mutex) {
-        return;
+    for (i = 0; i < idlen; i++) {
+        h = (h ^ id[i]) * 16777619U;
     }
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
 
-    status = apr_global_mutex_trylock(sconf->cache_mutex);
+    return h;
+}
 
-    if (APR_STATUS_IS_EBUSY(status)) {
-        /* don't wait around; just abandon it */
-        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, status, r,
-                      "crowdsec: result for %s not written to cache (mutex busy)",
-                      r->useragent_ip);
-        return;
-    }
-    else if (status != APR_SUCCESS) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
-                      "crowdsec: result for %s not written to cache (failed to lock cache mutex)",
-                      r->useragent_ip);
-        return;
-    }
+static crowdsec_native_set_t *crowdsec_native_set(ap_socache_instance_t *
+                                                  inst,
+                                                  const unsigned char *id,
+                                                  unsigned int idlen)
+{
+    return &inst->set[crowdsec_cache_hash(id, idlen) & (inst->sets - 1)];
+}
+
+static apr_uint32_t crowdsec_native_pid(void)
+{
+#if APR_HAVE_UNISTD_H
+    return (apr_uint32_t) getpid();
+#else
+    /* never taken for dead, but still tells a held set from a free one */
+    return 1;
+#endif
+}
 
+/*
+ * Whether the process with the given pid is gone. A writer that is
+ * merely slow, say preempted, is never taken for dead.
+ */
+static int crowdsec_native_dead(apr_uint32_t pid)
+{
+#if APR_HAVE_SIGNAL_H && APR_HAVE_UNISTD_H
+    return pid && kill((pid_t) pid, 0) == -1 && errno == ESRCH;
+#else
+    return 0;
+#endif
+}
 
-    key = crowdsec_cache_key(r, &keylen);
+/*
+ * Take the set for writing, returning zero if it cannot be had. A writer
+ * is only ever held up by another writer on the same set, briefly. The
+ * owner is claimed first, and only then is the sequence number made odd,
+ * so that a set is never held without the pid of its writer. Should the
+ * owner stay the same for long, the write is given up, as the cache may
+ * always miss: the set is only taken over if the writer holding it has
+ * died.
+ */
+static apr_uint32_t crowdsec_native_lock(crowdsec_native_set_t * set)
+{
+    apr_uint32_t seq, owner, last = apr_atomic_read32(&set->owner);
+    apr_uint32_t pid = crowdsec_native_pid();
+    int spins = 0, waits = 0;
 
-    expiry = apr_time_now() + sconf->cache_timeout;
+    for (;;) {
 
-    /* store it */
-    status = sconf->cache_provider->store(sconf->cache_instance, r->server,
-                                          (unsigned char *) key, keylen,
-                                          expiry, (unsigned char *) response,
-                                          strlen(response), r->pool);
+        owner = apr_atomic_read32(&set->owner);
 
-    if (status == APR_SUCCESS) {
-        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                      "crowdsec: result for %s written to cache", r->useragent_ip);
-    }
-    else {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
-                      "crowdsec: result for %s not written to cache",
-                      r->useragent_ip);
-    }
+        if (!owner && apr_atomic_cas32(&set->owner, pid, 0) == 0) {
+            /* the set is ours, the sequence number even */
+            seq = apr_atomic_read32(&set->seq) + 1;
+            apr_atomic_set32(&set->seq, seq);
+            crowdsec_barrier();
+            return seq;
+        }
 
-    /* We're done with the mutex */
-    status = apr_global_mutex_unlock(sconf->cache_mutex);
+        if (owner != last) {
+            last = owner;
+            waits = 0;
+        }
 
-    if (status != APR_SUCCESS) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
-                      "crowdsec: failed to release mutex");
-    }
+        if (++spins < CROWDSEC_NATIVE_SPINS) {
+            continue;
+        }
+        spins = 0;
 
-}
+        if (++waits > CROWDSEC_NATIVE_WAITS) {
 
-static int crowdsec_proxy(request_rec * r, const char **response)
-{
+            /* only one of the writers waiting may take over */
+            if (!crowdsec_native_dead(owner) ||
+                apr_atomic_cas32(&set->owner, pid, owner) != owner) {
+                return 0;
+            }
 
-    request_rec *rr;
-    int status;
+            seq = apr_atomic_read32(&set->seq);
+            if (!(seq & 1)) {
+                /* died before writing, or after, nothing is torn */
+                apr_atomic_set32(&set->seq, ++seq);
+                crowdsec_barrier();
+                return seq;
+            }
 
-    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
-        ap_get_module_config(r->server->module_config,
-                             &crowdsec_module);
+            /* the dead writer may have left an entry torn */
+            memset(set->ways, 0, sizeof(set->ways));
+            set->hand = 0;
 
-    crowdsec_config_rec *rrconf;
+            return seq;
+        }
 
-    /*
-     * Using mod_proxy, we connect to the crowdsec API.
-     *
-     * To do this, we create a subrequest, and then disassociate
-     * the subrequest from the main request so that no part of
-     * the crowdsec response ends up in the main response.
-     *
-     * We then replace the input filter stack with a null filter
-     * so that no attempt is made to read from the main request,
-     * and finally we replace the output filter stack with a
-     * filter that reads and parses the response from the API.
-     */
+        apr_sleep(CROWDSEC_NATIVE_BACKOFF);
+    }
+}
 
-    const char *target = apr_pstrcat(r->pool, sconf->url,
-                                     "/v1/decisions?ip=",
-                                     ap_escape_urlencoded(r->pool,
-                                                          r->useragent_ip),
-                                     NULL);
+static void crowdsec_native_unlock(crowdsec_native_set_t * set,
+                                   apr_uint32_t seq)
+{
+    crowdsec_barrier();
+    apr_atomic_set32(&set->seq, seq + 1);
+    apr_atomic_set32(&set->owner, 0);
+}
 
-    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
-                  "crowdsec: looking up IP '%s' at url: %s",
-                  r->useragent_ip, target);
+static crowdsec_native_entry_t *crowdsec_native_find(crowdsec_native_set_t *
+                                                     set,
+                                                     const unsigned char *id,
+                                                     unsigned int idlen)
+{
+    int i;
 
-    /* create a proxy request */
-    rr = ap_sub_req_method_uri("GET", r->uri, r, NULL);
+    for (i = 0; i < CROWDSEC_NATIVE_WAYS; i++) {
+        crowdsec_native_entry_t *e = &set->ways[i];
 
-    if (rr->status != HTTP_OK) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_SUCCESS, r,
-                      "crowdsec: service '%s' returned %d, request rejected: %s",
-                      target, rr->status, r->uri);
-        return rr->status;
+        if (e->expiry && e->keylen == idlen && !memcmp(e->key, id, idlen)) {
+            return e;
+        }
     }
 
-    /* disassociate the subrequest from the main request */
-    rr->main = NULL;
-    rr->output_filters = NULL;
-    ap_add_output_filter("CROWDSEC", NULL, rr, r->connection);
+    return NULL;
+}
 
-    /* Make sure that proxy cannot touch our main request body */
-    rr->input_filters = NULL;
-    ap_add_input_filter("CROWDSEC_NULL", NULL, rr, r->connection);
+static apr_status_t crowdsec_native_store(ap_socache_instance_t * inst,
+                                          server_rec * s,
+                                          const unsigned char *id,
+                                          unsigned int idlen,
+                                          apr_time_t expiry,
+                                          unsigned char *data,
+                                          unsigned int datalen,
+                                          apr_pool_t * pool)
+{
+    crowdsec_native_set_t *set;
+    crowdsec_native_entry_t *e;
+    apr_time_t now = apr_time_now();
+    apr_uint32_t seq;
+    int i;
+
+    if (idlen > CROWDSEC_CACHE_KEY_LEN ||
+        datalen > sizeof(((crowdsec_native_entry_t *) 0)->data)) {
+        return APR_ENOSPC;
+    }
 
-    /* headers and trailers */
-    rr->headers_in = apr_table_make(r->pool, 2);
-    rr->trailers_in = apr_table_make(r->pool, 2);
-    rr->headers_out = apr_table_make(r->pool, 2);
-    rr->trailers_out = apr_table_make(r->pool, 2);
+    set = crowdsec_native_set(inst, id, idlen);
 
-    /* emulate the function of proxy_detect so that a remote proxy request
-     * will be attempted */
-    rr->proxyreq = PROXYREQ_REVERSE;
-    rr->uri = rr->unparsed_uri;
-    rr->filename = apr_pstrcat(rr->pool, "proxy:", target, NULL);
-    rr->handler = "proxy-server";
+    seq = crowdsec_native_lock(set);
+    if (!seq) {
+        /* the set is busy, the cache is best effort */
+        return APR_EAGAIN;
+    }
 
-    /* make sure we don't recurse */
-    rrconf = (crowdsec_config_rec *)
-        ap_get_module_config(rr->per_dir_config, &crowdsec_module);
+    e = crowdsec_native_find(set, id, idlen);
 
-    if (sconf->key) {
-        apr_table_setn(rr->headers_in, "X-Api-Key", sconf->key);
+    /* an empty or expired way, else the first the clock hand spares */
+    for (i = 0; !e && i < CROWDSEC_NATIVE_WAYS; i++) {
+        if (set->ways[i].expiry <= now) {
+            e = &set->ways[i];
+        }
     }
+    while (!e) {
+        crowdsec_native_entry_t *way = &set->ways[set->hand];
 
-    apr_table_setn(rr->headers_in, "User-Agent", ap_get_server_description());
-
-    status = ap_run_sub_req(rr);
+        set->hand = (set->hand + 1) % CROWDSEC_NATIVE_WAYS;
 
-    if (HTTP_NOT_FOUND == status) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_SUCCESS, r,
-                      "crowdsec: we received a 404 Not Found when speaking "
-                      "to the crowdsec service '%s', you might be pointing at "
-                      "something that isn't a crowdsec service, or the "
-                      "mod_proxy_http module has not been installed, request "
-                      "rejected: %s", target, r->uri);
-        return HTTP_INTERNAL_SERVER_ERROR;
+        if (way->ref) {
+            way->ref = 0;
+        }
+        else {
+            e = way;
+        }
     }
 
-    else if ((status)) {
+    e->expiry = expiry;
+    e->keylen = (apr_byte_t) idlen;
+    e->ref = 0;
+    e->datalen = (apr_uint16_t) datalen;
+    memcpy(e->key, id, idlen);
+    memcpy(e->data, data, datalen);
 
-        crowdsec_config_rec *conf = (crowdsec_config_rec *)
-            ap_get_module_config(r->per_dir_config,
-                                 &crowdsec_module);
+    crowdsec_native_unlock(set, seq);
 
-        switch (conf->fallback) {
-        case CROWDSEC_FAIL: {
+    return APR_SUCCESS;
+}
 
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_SUCCESS, r,
-                          "crowdsec: crowdsec service '%s' returned status %d, "
-                          "request failed: %s", target, status, r->uri);
+static apr_status_t crowdsec_native_retrieve(ap_socache_instance_t * inst,
+                                             server_rec * s,
+                                             const unsigned char *id,
+                                             unsigned int idlen,
+                                             unsigned char *data,
+                                             unsigned int *datalen,
+                                             apr_pool_t * pool)
+{
+    crowdsec_native_set_t *set = crowdsec_native_set(inst, id, idlen);
+    int tries;
 
-            apr_table_setn(r->notes, "error-notes",
-                           "Could not verify the request against the threat intelligence "
-                           "service, the request has been rejected.");
+    for (tries = 0; tries < CROWDSEC_NATIVE_READS; tries++) {
 
-            /* Allow "error-notes" string to be printed by ap_send_error_response() */
-            apr_table_setn(r->notes, "verbose-error-to", "*");
+        crowdsec_native_entry_t *e;
+        apr_uint32_t seq = apr_atomic_read32(&set->seq);
+        apr_time_t expiry = 0;
+        unsigned int len = 0;
 
-            return HTTP_INTERNAL_SERVER_ERROR;
+        if (seq & 1) {
+            continue;
+        }
+        crowdsec_barrier();
+
+        e = crowdsec_native_find(set, id, idlen);
+        if (e) {
+            expiry = e->expiry;
+            len = e->datalen;
+            if (len <= *datalen) {
+                memcpy(data, e->data, len);
+            }
         }
-        case CROWDSEC_BLOCK: {
 
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_SUCCESS, r,
-                          "crowdsec: crowdsec service '%s' returned status %d, "
-                          "request blocked: %s", target, status, r->uri);
+        crowdsec_barrier();
+        if (apr_atomic_read32(&set->seq) != seq) {
+            continue;
+        }
 
-            *response = apr_psprintf(r->pool,
-                                     "[{\"error\":\"'%s' returned %d\"}]",
-                                     target, status);
+        if (!e || expiry <= apr_time_now()) {
+            return APR_NOTFOUND;
+        }
+        if (len > *datalen) {
+            return APR_ENOSPC;
+        }
 
-            return OK;
+        /* spare the entry from eviction, without dirtying the line twice */
+        if (!e->ref) {
+            e->ref = 1;
         }
-        case CROWDSEC_ALLOW: {
 
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_SUCCESS, r,
-                          "crowdsec: crowdsec service '%s' returned status %d, "
-                          "request accepted anyway: %s", target, status, r->uri);
+        *datalen = len;
 
-            *response = "null";
+        return APR_SUCCESS;
+    }
 
-            return OK;
-        }
-        }
+    /* a writer is holding the set, or died doing so */
+    return APR_NOTFOUND;
+}
+
+static apr_status_t crowdsec_native_remove(ap_socache_instance_t * inst,
+                                           server_rec * s,
+                                           const unsigned char *id,
+                                           unsigned int idlen,
+                                           apr_pool_t * pool)
+{
+    crowdsec_native_set_t *set = crowdsec_native_set(inst, id, idlen);
+    crowdsec_native_entry_t *e;
+    apr_uint32_t seq;
 
+    seq = crowdsec_native_lock(set);
+    if (!seq) {
+        return APR_EAGAIN;
     }
 
-    if (!rrconf->response) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_SUCCESS, r,
-                      "crowdsec: response from crowdsec service '%s' was not recorded, "
-                      "request rejected: %s", target, r->uri);
-        return HTTP_INTERNAL_SERVER_ERROR;
+    e = crowdsec_native_find(set, id, idlen);
+    if (e) {
+        e->expiry = 0;
+        e->keylen = 0;
     }
 
-    *response = rrconf->response;
+    crowdsec_native_unlock(set, seq);
 
-    return OK;
+    return e ? APR_SUCCESS : APR_NOTFOUND;
 }
 
-static int crowdsec_query(request_rec * r)
+static void crowdsec_native_status(ap_socache_instance_t * inst,
+                                   request_rec * r, int flags)
 {
+    if (flags & AP_STATUS_SHORT) {
+        ap_rprintf(r, "CacheType: native\n"
+                   "CacheEntries: %u\n",
+                   inst->sets * CROWDSEC_NATIVE_WAYS);
+    }
+    else {
+        ap_rprintf(r, "cache type: <b>native</b>, entries: <b>%u</b>, "
+                   "sets: <b>%u</b><br>",
+                   inst->sets * CROWDSEC_NATIVE_WAYS, inst->sets);
+    }
+}
 
-    const char *response;
-    int status;
+static apr_status_t crowdsec_native_iterate(ap_socache_instance_t * inst,
+                                            server_rec * s, void *userctx,
+                                            ap_socache_iterator_t * iterator,
+                                            apr_pool_t * pool)
+{
+    return APR_ENOTIMPL;
+}
 
-    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
-        ap_get_module_config(r->server->module_config,
-                             &crowdsec_module);
+static const ap_socache_provider_t crowdsec_native_cache = {
+    "native",
+    0,
+    crowdsec_native_create,
+    crowdsec_native_init,
+    crowdsec_native_destroy,
+    crowdsec_native_store,
+    crowdsec_native_retrieve,
+    crowdsec_native_remove,
+    crowdsec_native_status,
+    crowdsec_native_iterate
+};
 
-    crowdsec_config_rec *conf = (crowdsec_config_rec *)
-        ap_get_module_config(r->per_dir_config,
-                             &crowdsec_module);
+/*
+ * Parse the textual form of an ip address.
+ */
+static int crowdsec_ip_parse(const char *str, apr_size_t len,
+                             crowdsec_ip_t * ip)
+{
+    char buf[64];
 
-    if (r->main || !sconf || !sconf->url) {
-        return DECLINED;
+    if (len >= sizeof(buf)) {
+        return 0;
     }
 
-    response = crowdsec_from_cache(r);
+    memcpy(buf, str, len);
+    buf[len] = 0;
 
-    if (!response) {
+    memset(ip, 0, sizeof(crowdsec_ip_t));
 
-        status = crowdsec_proxy(r, &response);
+    if (inet_pton(AF_INET, buf, ip->addr) == 1) {
+        ip->family = CROWDSEC_IPV4;
+        return 1;
+    }
+#if APR_HAVE_IPV6
+    if (inet_pton(AF_INET6, buf, ip->addr) == 1) {
+        ip->family = CROWDSEC_IPV6;
+        return 1;
+    }
+#endif
 
-        if ((status) != OK) {
-            return status;
-        }
+    return 0;
+}
 
-        crowdsec_to_cache(r, response);
+/*
+ * Parse a range in CIDR notation, such as 192.0.2.0/24 or 2001:db8::/32,
+ * clearing any host bits. A bare address is a range of one.
+ */
+static int crowdsec_prefix_parse(const char *str, apr_size_t len,
+                                 crowdsec_ip_t * ip, apr_byte_t * bits)
+{
+    const char *slash = memchr(str, '/', len);
+    int max, prefix, i;
 
+    if (!crowdsec_ip_parse(str, slash ? (apr_size_t) (slash - str) : len, ip)) {
+        return 0;
     }
 
-    /* parse response of crowdsec request here */
+    max = ip->family == CROWDSEC_IPV4 ? 32 : 128;
+    prefix = max;
 
-    if (!strcmp("null", response)) {
-        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
-                      "crowdsec: ip address '%s' not blocked, "
-                      "request accepted: %s", r->useragent_ip, r->uri);
-        return OK;
+    if (slash) {
+        const char *p = slash + 1, *end = str + len;
+
+        if (p == end || end - p > 3) {
+            return 0;
+        }
+        for (prefix = 0; p < end; p++) {
+            if (*p < '0' || *p > '9') {
+                return 0;
+            }
+            prefix = prefix * 10 + (*p - '0');
+        }
+        if (prefix > max) {
+            return 0;
+        }
     }
 
-    else if (conf->location) {
+    for (i = prefix; i < max; i++) {
+        ip->addr[i >> 3] &= ~(0x80 >> (i & 7));
+    }
 
-        const char *location;
-        const char *err;
+    *bits = (apr_byte_t) prefix;
 
-        err = NULL;
-        location = ap_expr_str_exec(r, conf->location, &err);
-        if (err) {
-            ap_log_rerror(
-                    APLOG_MARK, APLOG_ERR, 0, r,
-                                       "crowdsec: CrowdsecLocation: can't "
-                    "evaluate location expression: %s", err);
-            return HTTP_INTERNAL_SERVER_ERROR;
-        }
+    return 1;
+}
 
-        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
-                      "crowdsec: ip address '%s' lookup returned %s, "
-                      "request redirected to '%s': %s",
-                      r->useragent_ip, response, location, r->uri);
+/*
+ * Convert a socket address to binary form, treating ipv4 mapped ipv6
+ * addresses as ipv4.
+ */
+static int crowdsec_ip_from_addr(const apr_sockaddr_t * sa,
+                                 crowdsec_ip_t * ip)
+{
+    static const apr_byte_t mapped[12] =
+        { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
 
-        ap_custom_response(r, conf->blockedhttpcode, location);
-        return conf->blockedhttpcode;
+    memset(ip, 0, sizeof(crowdsec_ip_t));
+
+    if (!sa) {
+        return 0;
     }
 
-    else {
-        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
-                      "crowdsec: ip address '%s' lookup returned %s, "
-                      "request rejected: %s",
-                      r->useragent_ip, response, r->uri);
-        return conf->blockedhttpcode;
+    if (sa->family == APR_INET) {
+        ip->family = CROWDSEC_IPV4;
+        memcpy(ip->addr, sa->ipaddr_ptr, 4);
+        return 1;
+    }
+#if APR_HAVE_IPV6
+    if (sa->family == APR_INET6) {
+        if (!memcmp(sa->ipaddr_ptr, mapped, sizeof(mapped))) {
+            ip->family = CROWDSEC_IPV4;
+            memcpy(ip->addr, (const apr_byte_t *)sa->ipaddr_ptr + 12, 4);
+        }
+        else {
+            ip->family = CROWDSEC_IPV6;
+            memcpy(ip->addr, sa->ipaddr_ptr, 16);
+        }
+        return 1;
     }
+#endif
 
+    return 0;
 }
 
-static int crowdsec_check_access(request_rec * r)
+static apr_uint32_t crowdsec_ip_hash(const crowdsec_ip_t * ip)
 {
-    /* make sure we don't recurse */
-    crowdsec_config_rec *conf = (crowdsec_config_rec *)
-        ap_get_module_config(r->per_dir_config,
-                             &crowdsec_module);
+    /* FNV-1a */
+    apr_uint32_t hash = 2166136261U;
+    int i, len = ip->family == CROWDSEC_IPV4 ? 4 : 16;
 
-    int status;
+    hash = (hash ^ ip->family) * 16777619U;
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ ip->addr[i]) * 16777619U;
+    }
 
-    if (r->main || !conf->enable) {
-        return DECLINED;
+    return hash;
+}
+
+/* an entry of the per child cache */
+typedef struct
+{
+    /* when the entry expires from this cache, zero if empty */
+    apr_time_t expiry;
+    /* the clock of the shard when last used, the lowest is evicted */
+    apr_uint32_t used;
+    apr_byte_t keylen;
+    unsigned char key[CROWDSEC_CACHE_KEY_LEN];
+    crowdsec_verdict_t verdict;
+} crowdsec_l1_entry_t;
+
+/* a shard of the per child cache, with a lock of its own */
+typedef struct
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    apr_uint32_t clock;
+    crowdsec_l1_entry_t *ways;
+} crowdsec_l1_shard_t;
+
+/*
+ * The per child cache, set with CrowdsecCacheL1, kept in front of the
+ * shared cache so that repeat requests from a client never leave the
+ * child.
+ *
+ * Verdicts read from the shared cache, or written to it by this child,
+ * are kept for at most CrowdsecCacheL1Timeout, so that changes made by
+ * other children are seen soon enough. Lookups in progress and expired
+ * verdicts are never kept, and are always read from the shared cache.
+ *
+ * The cache is split into shards by address, each guarded by a mutex,
+ * so that worker threads seldom meet. Within a shard, an address maps
+ * to a set of a few ways, and the least recently used way is evicted.
+ */
+typedef struct crowdsec_l1_t
+{
+    /* number of shards, a power of two */
+    apr_uint32_t shards;
+    /* number of sets in each shard, a power of two */
+    apr_uint32_t sets;
+    /* the longest an entry is kept */
+    apr_interval_time_t timeout;
+    crowdsec_l1_shard_t *shard;
+} crowdsec_l1_t;
+
+static crowdsec_l1_t *crowdsec_l1_create(apr_pool_t * pchild,
+                                         apr_uint32_t entries, int threaded,
+                                         apr_interval_time_t timeout)
+{
+    crowdsec_l1_t *l1 = apr_pcalloc(pchild, sizeof(crowdsec_l1_t));
+    apr_uint32_t i;
+
+    l1->shards = threaded ? CROWDSEC_L1_SHARDS : 1;
+    l1->sets = 1;
+    while (l1->shards * l1->sets * CROWDSEC_L1_WAYS < entries) {
+        l1->sets <<= 1;
     }
+    l1->timeout = timeout;
 
-    if ((status = crowdsec_query(r)) == OK) {
-        return DECLINED;
+    l1->shard = apr_pcalloc(pchild, l1->shards * sizeof(crowdsec_l1_shard_t));
+
+    for (i = 0; i < l1->shards; i++) {
+        crowdsec_l1_shard_t *shard = &l1->shard[i];
+
+#if APR_HAS_THREADS
+        if (threaded &&
+            apr_thread_mutex_create(&shard->mutex, APR_THREAD_MUTEX_DEFAULT,
+                                    pchild) != APR_SUCCESS) {
+            return NULL;
+        }
+#endif
+
+        shard->ways = apr_pcalloc(pchild, l1->sets * CROWDSEC_L1_WAYS *
+                                  sizeof(crowdsec_l1_entry_t));
     }
 
-    return status;
+    return l1;
 }
 
-/**
- * CROWDSEC filter: Soak up the response from the API.
+/*
+ * Find the set of ways the key belongs to, and lock its shard.
+ */
+static crowdsec_l1_entry_t *crowdsec_l1_lock(crowdsec_l1_t * l1,
+                                             const unsigned char *key,
+                                             unsigned int keylen,
+                                             crowdsec_l1_shard_t ** shard)
+{
+    apr_uint32_t h = crowdsec_cache_hash(key, keylen);
+
+    *shard = &l1->shard[(h >> 24) & (l1->shards - 1)];
+
+#if APR_HAS_THREADS
+    if ((*shard)->mutex) {
+        apr_thread_mutex_lock((*shard)->mutex);
+    }
+#endif
+
+    return &(*shard)->ways[(h & (l1->sets - 1)) * CROWDSEC_L1_WAYS];
+}
+
+static void crowdsec_l1_unlock(crowdsec_l1_shard_t * shard)
+{
+#if APR_HAS_THREADS
+    if (shard->mutex) {
+        apr_thread_mutex_unlock(shard->mutex);
+    }
+#endif
+}
+
+static crowdsec_l1_entry_t *crowdsec_l1_find(crowdsec_l1_entry_t * ways,
+                                             const unsigned char *key,
+                                             unsigned int keylen)
+{
+    int i;
+
+    for (i = 0; i < CROWDSEC_L1_WAYS; i++) {
+        if (ways[i].expiry && ways[i].keylen == keylen &&
+            !memcmp(ways[i].key, key, keylen)) {
+            return &ways[i];
+        }
+    }
+
+    return NULL;
+}
+
+static int crowdsec_l1_get(crowdsec_l1_t * l1, const unsigned char *key,
+                           unsigned int keylen, apr_time_t now,
+                           crowdsec_verdict_t * verdict)
+{
+    crowdsec_l1_shard_t *shard;
+    crowdsec_l1_entry_t *ways, *e;
+    int found = 0;
+
+    ways = crowdsec_l1_lock(l1, key, keylen, &shard);
+
+    e = crowdsec_l1_find(ways, key, keylen);
+    if (e && e->expiry > now) {
+        *verdict = e->verdict;
+        e->used = ++shard->clock;
+        found = 1;
+    }
+
+    crowdsec_l1_unlock(shard);
+
+    return found;
+}
+
+/*
+ * Keep the verdict, or forget the key if the verdict is not one to keep.
+ */
+static void crowdsec_l1_put(crowdsec_l1_t * l1, const unsigned char *key,
+                            unsigned int keylen, apr_time_t now,
+                            const crowdsec_verdict_t * verdict)
+{
+    crowdsec_l1_shard_t *shard;
+    crowdsec_l1_entry_t *ways, *e;
+    apr_time_t expiry = now + l1->timeout;
+    int i;
+
+    if (verdict && verdict->expiry < expiry) {
+        expiry = verdict->expiry;
+    }
+    if (verdict && (verdict->flags & CROWDSEC_VERDICT_PENDING)) {
+        verdict = NULL;
+    }
+
+    ways = crowdsec_l1_lock(l1, key, keylen, &shard);
+
+    e = crowdsec_l1_find(ways, key, keylen);
+
+    if (!verdict || expiry <= now) {
+        if (e) {
+            e->expiry = 0;
+        }
+        crowdsec_l1_unlock(shard);
+        return;
+    }
+
+    for (i = 0; !e && i < CROWDSEC_L1_WAYS; i++) {
+        if (ways[i].expiry <= now) {
+            e = &ways[i];
+        }
+    }
+    if (!e) {
+        e = &ways[0];
+        for (i = 1; i < CROWDSEC_L1_WAYS; i++) {
+            /* as a difference, so that the clock may wrap */
+            if ((apr_int32_t) (ways[i].used - e->used) < 0) {
+                e = &ways[i];
+            }
+        }
+    }
+
+    e->expiry = expiry;
+    e->used = ++shard->clock;
+    e->keylen = (apr_byte_t) keylen;
+    memcpy(e->key, key, keylen);
+    e->verdict = *verdict;
+
+    crowdsec_l1_unlock(shard);
+}
+
+/*
+ * The cache is keyed on the binary form of the client address, preceded
+ * by the address family: five bytes for ipv4, seventeen for ipv6. This
+ * is never shorter than the four byte minimum the socache_shmcb module
+ * insists on, and different textual forms of the same address share an
+ * entry.
  *
- * Set the response aside to be accessible to the
- * crowdsec_query above.
+ * Returns the length of the key, or zero if the address has no binary
+ * form.
  */
-static apr_status_t crowdsec_out_filter(ap_filter_t * f,
-                                        apr_bucket_brigade * bb)
+static unsigned int crowdsec_cache_key(request_rec * r,
+                                       unsigned char *key)
 {
 
-    crowdsec_config_rec *conf = (crowdsec_config_rec *)
-        ap_get_module_config(f->r->per_dir_config,
+    crowdsec_ip_t ip;
+
+    if (!crowdsec_ip_from_addr(r->useragent_addr, &ip)) {
+        return 0;
+    }
+
+    key[0] = ip.family;
+
+    if (ip.family == CROWDSEC_IPV4) {
+        memcpy(key + 1, ip.addr, 4);
+        return 5;
+    }
+    else {
+        memcpy(key + 1, ip.addr, 16);
+        return 17;
+    }
+}
+
+static int crowdsec_from_cache(request_rec * r, crowdsec_verdict_t * verdict)
+{
+
+    unsigned char key[CROWDSEC_CACHE_KEY_LEN];
+    unsigned int keylen;
+
+    unsigned int vallen = sizeof(crowdsec_verdict_t);
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(r->server->module_config,
                              &crowdsec_module);
-    char *response;
 
-    apr_off_t len;
-    apr_size_t size;
+    apr_status_t status;
 
-    apr_brigade_length(bb, 1, &len);
-    size = (apr_size_t) len;
-    response = apr_palloc(f->r->pool, size + 1);
-    apr_brigade_flatten(bb, response, &size);
-    response[len] = 0;
+    if (!sconf->cache_provider) {
+        return 0;
+    }
 
-    conf->response = response;
+    keylen = crowdsec_cache_key(r, key);
+    if (!keylen) {
+        return 0;
+    }
 
-    apr_brigade_cleanup(bb);
+    if (sconf->l1 &&
+        crowdsec_l1_get(sconf->l1, key, keylen, r->request_time, verdict)) {
+        crowdsec_count(l1_hits);
+        return 1;
+    }
 
-    return OK;
+    status = sconf->cache_provider->retrieve(sconf->cache_instance, r->server,
+                                             key, keylen,
+                                             (unsigned char *) verdict,
+                                             &vallen, r->pool);
+
+    if (APR_STATUS_IS_NOTFOUND(status)) {
+        /* not found - just return */
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                      "crowdsec: no response found in cache for %s",
+                      r->useragent_ip);
+        crowdsec_count(cache_misses);
+        return 0;
+    }
+    else if (status == APR_SUCCESS) {
+        /* OK, we got a value */
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                      "crowdsec: response found in cache for %s",
+                      r->useragent_ip);
+    }
+    else {
+        /* error: give up and pass the buck */
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "crowdsec: error while retrieving cache response for %s",
+                      r->useragent_ip);
+        crowdsec_count(cache_errors);
+        return 0;
+    }
+
+    if (vallen != sizeof(crowdsec_verdict_t) ||
+        verdict->version != CROWDSEC_VERDICT_VERSION ||
+        verdict->type > CROWDSEC_DECISION_BAN) {
+        /* not one of ours, treat as a miss */
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                      "crowdsec: unrecognised cache entry for %s ignored",
+                      r->useragent_ip);
+        crowdsec_count(cache_misses);
+        return 0;
+    }
+
+    crowdsec_count(cache_hits);
+
+    if (sconf->l1) {
+        crowdsec_l1_put(sconf->l1, key, keylen, r->request_time, verdict);
+    }
+
+    return 1;
 }
 
-/**
- * Cap the input filter stack, returning nothing.
+/*
+ * Write the verdict on the given cache key to the cache. Verdicts read
+ * from the cache and written back, such as entries being refreshed, keep
+ * the expiry they already had.
  */
-static apr_status_t null_in_filter(ap_filter_t * f, apr_bucket_brigade * bb,
-                                   ap_input_mode_t mode,
-                                   apr_read_type_e block, apr_off_t readbytes)
+static void crowdsec_cache_store(server_rec * s, apr_pool_t * p,
+                                 const unsigned char *key,
+                                 unsigned int keylen, const char *ip,
+                                 const crowdsec_verdict_t * verdict)
 {
-    apr_bucket *e;
 
-    /* all the null filter does is insert an EOS, and then return success. */
-    e = apr_bucket_eos_create(f->c->bucket_alloc);
-    APR_BRIGADE_INSERT_TAIL(bb, e);
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(s->module_config,
+                             &crowdsec_module);
+
+    crowdsec_verdict_t entry = *verdict;
+    apr_time_t now, until;
+
+    apr_status_t status;
+
+    if (!sconf->cache_provider) {
+        return;
+    }
+
+    now = apr_time_now();
+
+    if (verdict->expiry) {
+        /* keep to the expiry already in the cache */
+    }
+    else if (verdict->flags & CROWDSEC_VERDICT_PENDING) {
+        entry.expiry = now + sconf->coalesce_timeout;
+    }
+    else if (verdict->type == CROWDSEC_DECISION_NONE) {
+        entry.expiry = now + (sconf->cache_allow_timeout_set ?
+                sconf->cache_allow_timeout : sconf->cache_timeout);
+    }
+    else if (verdict->until) {
+        /* never cache a decision for longer than it lasts */
+        entry.expiry = verdict->until;
+        if (sconf->cache_ban_timeout_set &&
+            entry.expiry > now + sconf->cache_ban_timeout) {
+            entry.expiry = now + sconf->cache_ban_timeout;
+        }
+    }
+    else {
+        /* no duration known, this is a fallback verdict */
+        entry.expiry = now + sconf->cache_timeout;
+    }
+
+    if (sconf->l1) {
+        /* kept here even should the shared cache drop it */
+        crowdsec_l1_put(sconf->l1, key, keylen, now, &entry);
+    }
+
+    /* a marker is never served stale, it goes with its lookup */
+    until = entry.expiry;
+    if (!(entry.flags & CROWDSEC_VERDICT_PENDING)) {
+        until += sconf->cache_stale;
+    }
+
+    if (until <= now) {
+        return;
+    }
+
+    status = sconf->cache_mutex ?
+        apr_global_mutex_trylock(sconf->cache_mutex) : APR_SUCCESS;
+
+    if (APR_STATUS_IS_EBUSY(status)) {
+        /* don't wait around; just abandon it */
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, status, s,
+                     "crowdsec: result for %s not written to cache (mutex busy)",
+                     ip);
+        crowdsec_count(cache_busy);
+        return;
+    }
+    else if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                     "crowdsec: result for %s not written to cache (failed to lock cache mutex)",
+                     ip);
+        crowdsec_count(cache_errors);
+        return;
+    }
+
+    /* store it */
+    status = sconf->cache_provider->store(sconf->cache_instance, s,
+                                          key, keylen, until,
+                                          (unsigned char *) &entry,
+                                          sizeof(crowdsec_verdict_t), p);
+
+    if (status == APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                     "crowdsec: result for %s written to cache", ip);
+        crowdsec_count(cache_stores);
+    }
+    else {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                     "crowdsec: result for %s not written to cache", ip);
+        crowdsec_count(cache_errors);
+    }
+
+    /* We're done with the mutex */
+    status = sconf->cache_mutex ?
+        apr_global_mutex_unlock(sconf->cache_mutex) : APR_SUCCESS;
+
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                     "crowdsec: failed to release mutex");
+    }
 
-    return APR_SUCCESS;
 }
 
-static void *create_crowdsec_dir_config(apr_pool_t * p, char *d)
+static void crowdsec_to_cache(request_rec * r,
+                              const crowdsec_verdict_t * verdict)
 {
-    crowdsec_config_rec *conf = apr_pcalloc(p, sizeof(crowdsec_config_rec));
 
-    return conf;
+    unsigned char key[CROWDSEC_CACHE_KEY_LEN];
+    unsigned int keylen;
+
+    keylen = crowdsec_cache_key(r, key);
+    if (!keylen) {
+        return;
+    }
+
+    crowdsec_cache_store(r->server, r->pool, key, keylen, r->useragent_ip,
+                         verdict);
+
 }
 
-static void *merge_crowdsec_dir_config(apr_pool_t * p, void *basev,
-                                       void *addv)
+/*
+ * Parse a duration as returned by the crowdsec service, such as
+ * "3h59m58.123456789s". Durations may be negative once expired.
+ */
+static apr_interval_time_t crowdsec_parse_duration(const char *str,
+                                                   apr_size_t len)
 {
-    crowdsec_config_rec *new = (crowdsec_config_rec *) apr_pcalloc(p,
-                                                                   sizeof
-                                                                   (crowdsec_config_rec));
-    crowdsec_config_rec *add = (crowdsec_config_rec *) addv;
-    crowdsec_config_rec *base = (crowdsec_config_rec *) basev;
+    const char *end = str + len;
+    apr_interval_time_t total = 0;
+    int negative = 0;
 
-    new->enable = (add->enable_set == 0) ? base->enable : add->enable;
-    new->enable_set = add->enable_set || base->enable_set;
+    if (str < end && *str == '-') {
+        negative = 1;
+        str++;
+    }
 
-    new->fallback = (add->fallback_set == 0) ? base->fallback : add->fallback;
-    new->fallback_set = add->fallback_set || base->fallback_set;
+    while (str < end) {
 
-    new->location = (add->location_set == 0) ? base->location : add->location;
-    new->location_set = add->location_set || base->location_set;
+        double value = 0, scale = 1;
+        int fraction = 0, digits = 0;
 
-    new->blockedhttpcode = (add->blockedhttpcode_set == 0) ? base->blockedhttpcode : add->blockedhttpcode;
-    new->blockedhttpcode_set = add->blockedhttpcode_set || base->blockedhttpcode_set;
+        while (str < end && ((*str >= '0' && *str <= '9') || *str == '.')) {
+            if (*str == '.') {
+                fraction = 1;
+            }
+            else if (fraction) {
+                scale /= 10;
+                value += (*str - '0') * scale;
+            }
+            else {
+                value = value * 10 + (*str - '0');
+            }
+            digits++;
+            str++;
+        }
 
-    return new;
+        if (!digits) {
+            return 0;
+        }
+
+        if (str + 1 < end && str[0] == 'n' && str[1] == 's') {
+            value /= 1000;
+            str += 2;
+        }
+        else if (str + 1 < end && (str[0] == 'u' || str[0] == 'm')
+                 && str[1] == 's') {
+            value *= (str[0] == 'u') ? 1 : 1000;
+            str += 2;
+        }
+        else if (str + 2 < end && !memcmp(str, "\xc2\xb5s", 3)) {
+            str += 3;
+        }
+        else if (str < end && *str == 's') {
+            value *= APR_USEC_PER_SEC;
+            str++;
+        }
+        else if (str < end && *str == 'm') {
+            value *= 60 * APR_USEC_PER_SEC;
+            str++;
+        }
+        else if (str < end && *str == 'h') {
+            value *= 3600 * APR_USEC_PER_SEC;
+            str++;
+        }
+        else {
+            return 0;
+        }
+
+        total += (apr_interval_time_t) value;
+    }
+
+    return negative ? -total : total;
+}
+
+/* a decision as found in a response from the crowdsec service */
+typedef struct
+{
+    const char *scope;
+    apr_size_t scope_len;
+    const char *value;
+    apr_size_t value_len;
+    const char *type;
+    apr_size_t type_len;
+    const char *duration;
+    apr_size_t duration_len;
+    const char *origin;
+    apr_size_t origin_len;
+    apr_int64_t id;
+} crowdsec_json_decision;
+
+typedef void (crowdsec_decision_fn) (void *baton, int deleted,
+                                     const crowdsec_json_decision * d);
+
+#define CROWDSEC_JSON_MAX_DEPTH 32
+
+/* longest string kept for each field, longer values are ignored */
+#define CROWDSEC_JSON_KEY_LEN 16
+#define CROWDSEC_JSON_FIELD_LEN 64
+
+/* the fields of a decision that we keep */
+typedef enum {
+    CROWDSEC_FIELD_NONE = -1,
+    CROWDSEC_FIELD_SCOPE,
+    CROWDSEC_FIELD_VALUE,
+    CROWDSEC_FIELD_TYPE,
+    CROWDSEC_FIELD_DURATION,
+    CROWDSEC_FIELD_ORIGIN,
+    CROWDSEC_FIELD_COUNT
+} crowdsec_json_field;
+
+/* what the parser expects next */
+typedef enum {
+    CROWDSEC_JSON_VALUE,
+    CROWDSEC_JSON_VALUE_OR_END,
+    CROWDSEC_JSON_KEY,
+    CROWDSEC_JSON_KEY_OR_END,
+    CROWDSEC_JSON_COLON,
+    CROWDSEC_JSON_AFTER,
+    CROWDSEC_JSON_STRING,
+    CROWDSEC_JSON_ESCAPE,
+    CROWDSEC_JSON_UNICODE,
+    CROWDSEC_JSON_LITERAL,
+    CROWDSEC_JSON_DONE,
+    CROWDSEC_JSON_ERROR
+} crowdsec_json_state;
+
+/*
+ * An incremental parser for the responses from the crowdsec service.
+ *
+ * The response may be fed in pieces of any size, such as one bucket or
+ * one read at a time, and decisions are passed to the callback as soon
+ * as each one is complete. Nothing is allocated, and no document is
+ * built; only the fields of a decision we need are kept, in fixed size
+ * buffers within the parser.
+ */
+typedef struct
+{
+    crowdsec_decision_fn *fn;
+    void *baton;
+    crowdsec_json_state state;
+    /* the depth at which decision objects are found */
+    int ddepth;
+    /* the current depth, and a bit per depth set for objects */
+    int depth;
+    apr_uint32_t objects;
+    /* in a string: the string is a key */
+    unsigned int in_key:1;
+    /* in a string: the string was too long to keep */
+    unsigned int truncated:1;
+    /* the decisions being parsed are deletions, or -1 to ignore them */
+    int section;
+    /* the field the current string belongs to */
+    crowdsec_json_field field;
+    /* the pending \u escape */
+    int unicode;
+    int unicode_len;
+    /* the current key or literal */
+    char key[CROWDSEC_JSON_KEY_LEN];
+    apr_size_t key_len;
+    char literal[24];
+    apr_size_t literal_len;
+    /* the decision being parsed */
+    crowdsec_json_decision d;
+    char fields[CROWDSEC_FIELD_COUNT][CROWDSEC_JSON_FIELD_LEN];
+    apr_size_t field_len[CROWDSEC_FIELD_COUNT];
+} crowdsec_json;
+
+/* the response from the crowdsec service, as soaked up by the filter */
+typedef struct
+{
+    /* the response is parsed as it passes through the filter */
+    crowdsec_json js;
+    /* bytes seen so far */
+    apr_size_t len;
+    /* the end of the body was seen */
+    unsigned int eos:1;
+    /* the body could not be parsed */
+    unsigned int invalid:1;
+} crowdsec_capture_t;
+
+static int crowdsec_json_is(const char *str, apr_size_t len, const char *what)
+{
+    return strlen(what) == len && !memcmp(str, what, len);
+}
+
+/*
+ * Start parsing a response. A stream response is of the form
+ * {"new":[...],"deleted":[...]}, and a live response is either null or an
+ * array of decisions.
+ */
+static void crowdsec_json_init(crowdsec_json * js, int stream,
+                               crowdsec_decision_fn *fn, void *baton)
+{
+    memset(js, 0, sizeof(crowdsec_json));
+    js->fn = fn;
+    js->baton = baton;
+    js->state = CROWDSEC_JSON_VALUE;
+    js->ddepth = stream ? 3 : 2;
+    js->section = stream ? -1 : 0;
+    js->field = CROWDSEC_FIELD_NONE;
+}
+
+static int crowdsec_json_in_object(const crowdsec_json * js)
+{
+    return (js->objects >> js->depth) & 1;
+}
+
+/* a value has ended, work out what comes next */
+static void crowdsec_json_after(crowdsec_json * js)
+{
+    js->state = js->depth ? CROWDSEC_JSON_AFTER : CROWDSEC_JSON_DONE;
+}
+
+static void crowdsec_json_open(crowdsec_json * js, int object)
+{
+    if (!js->depth && object != (js->ddepth == 3)) {
+        /* not the response we were expecting */
+        js->state = CROWDSEC_JSON_ERROR;
+        return;
+    }
+
+    if (js->depth + 1 >= CROWDSEC_JSON_MAX_DEPTH) {
+        js->state = CROWDSEC_JSON_ERROR;
+        return;
+    }
+
+    js->depth++;
+    if (object) {
+        js->objects |= (apr_uint32_t) 1 << js->depth;
+        js->state = CROWDSEC_JSON_KEY_OR_END;
+    }
+    else {
+        js->objects &= ~((apr_uint32_t) 1 << js->depth);
+        js->state = CROWDSEC_JSON_VALUE_OR_END;
+    }
+
+    if (object && js->depth == js->ddepth) {
+        memset(&js->d, 0, sizeof(crowdsec_json_decision));
+        memset(js->field_len, 0, sizeof(js->field_len));
+    }
+}
+
+static void crowdsec_json_close(crowdsec_json * js, int object)
+{
+    if (!js->depth || crowdsec_json_in_object(js) != object) {
+        js->state = CROWDSEC_JSON_ERROR;
+        return;
+    }
+
+    if (object && js->depth == js->ddepth && js->section >= 0) {
+
+        crowdsec_json_decision *d = &js->d;
+
+#define CROWDSEC_JSON_SET(f, name) \
+        if (js->field_len[f]) { \
+            d->name = js->fields[f]; \
+            d->name ## _len = js->field_len[f]; \
+        }
+        CROWDSEC_JSON_SET(CROWDSEC_FIELD_SCOPE, scope)
+        CROWDSEC_JSON_SET(CROWDSEC_FIELD_VALUE, value)
+        CROWDSEC_JSON_SET(CROWDSEC_FIELD_TYPE, type)
+        CROWDSEC_JSON_SET(CROWDSEC_FIELD_DURATION, duration)
+        CROWDSEC_JSON_SET(CROWDSEC_FIELD_ORIGIN, origin)
+#undef CROWDSEC_JSON_SET
+
+        js->fn(js->baton, js->section, d);
+    }
+
+    if (js->depth == 1 && js->ddepth == 3) {
+        js->section = -1;
+    }
+
+    js->depth--;
+    crowdsec_json_after(js);
+}
+
+/* a key has ended */
+static void crowdsec_json_key(crowdsec_json * js)
+{
+    js->state = CROWDSEC_JSON_COLON;
+
+    if (js->truncated) {
+        js->key_len = 0;
+    }
+
+    if (js->depth == 1 && js->ddepth == 3) {
+        if (crowdsec_json_is(js->key, js->key_len, "new")) {
+            js->section = 0;
+        }
+        else if (crowdsec_json_is(js->key, js->key_len, "deleted")) {
+            js->section = 1;
+        }
+        else {
+            js->section = -1;
+        }
+    }
+}
+
+/* a string value is starting, work out where it should go */
+static void crowdsec_json_field_start(crowdsec_json * js)
+{
+    js->field = CROWDSEC_FIELD_NONE;
+
+    if (js->depth != js->ddepth || !crowdsec_json_in_object(js)) {
+        return;
+    }
+
+    if (crowdsec_json_is(js->key, js->key_len, "scope")) {
+        js->field = CROWDSEC_FIELD_SCOPE;
+    }
+    else if (crowdsec_json_is(js->key, js->key_len, "value")) {
+        js->field = CROWDSEC_FIELD_VALUE;
+    }
+    else if (crowdsec_json_is(js->key, js->key_len, "type")) {
+        js->field = CROWDSEC_FIELD_TYPE;
+    }
+    else if (crowdsec_json_is(js->key, js->key_len, "duration")) {
+        js->field = CROWDSEC_FIELD_DURATION;
+    }
+    else if (crowdsec_json_is(js->key, js->key_len, "origin")) {
+        js->field = CROWDSEC_FIELD_ORIGIN;
+    }
+
+    if (js->field != CROWDSEC_FIELD_NONE) {
+        js->field_len[js->field] = 0;
+    }
+}
+
+/* add a decoded character to the current key or field */
+static void crowdsec_json_char(crowdsec_json * js, char c)
+{
+    if (js->in_key) {
+        if (js->key_len < CROWDSEC_JSON_KEY_LEN) {
+            js->key[js->key_len++] = c;
+        }
+        else {
+            js->truncated = 1;
+        }
+    }
+    else if (js->field != CROWDSEC_FIELD_NONE) {
+        if (js->field_len[js->field] < CROWDSEC_JSON_FIELD_LEN) {
+            js->fields[js->field][js->field_len[js->field]++] = c;
+        }
+        else {
+            js->truncated = 1;
+        }
+    }
+}
+
+/* a string has ended */
+static void crowdsec_json_string_end(crowdsec_json * js)
+{
+    if (js->in_key) {
+        crowdsec_json_key(js);
+        return;
+    }
+
+    if (js->field != CROWDSEC_FIELD_NONE && js->truncated) {
+        /* too long to be anything we understand */
+        js->field_len[js->field] = 0;
+    }
+    js->field = CROWDSEC_FIELD_NONE;
+
+    crowdsec_json_after(js);
+}
+
+/* a number, true, false or null has ended */
+static void crowdsec_json_literal_end(crowdsec_json * js)
+{
+    const char *lit = js->literal;
+    apr_size_t len = js->literal_len;
+
+    if (!js->depth && (js->ddepth == 3 ||
+                       !crowdsec_json_is(lit, len, "null"))) {
+        /* only a live response may be a bare null */
+        js->state = CROWDSEC_JSON_ERROR;
+        return;
+    }
+
+    if (crowdsec_json_is(lit, len, "null") ||
+        crowdsec_json_is(lit, len, "true") ||
+        crowdsec_json_is(lit, len, "false")) {
+        /* nothing to keep */
+    }
+    else if (len && len < sizeof(js->literal) &&
+             ((*lit >= '0' && *lit <= '9') || *lit == '-')) {
+        if (js->depth == js->ddepth && crowdsec_json_in_object(js) &&
+            crowdsec_json_is(js->key, js->key_len, "id")) {
+            apr_size_t i;
+
+            js->d.id = 0;
+            for (i = 0; i < len && lit[i] >= '0' && lit[i] <= '9'; i++) {
+                js->d.id = js->d.id * 10 + (lit[i] - '0');
+            }
+        }
+    }
+    else {
+        js->state = CROWDSEC_JSON_ERROR;
+        return;
+    }
+
+    crowdsec_json_after(js);
+}
+
+/*
+ * Feed the next piece of the response to the parser. Returns zero if the
+ * response is not valid.
+ */
+static int crowdsec_json_feed(crowdsec_json * js, const char *buf,
+                              apr_size_t len)
+{
+    const char *end = buf + len;
+
+    while (buf < end) {
+
+        char c = *buf;
+
+        switch (js->state) {
+
+        case CROWDSEC_JSON_STRING:
+            /* the common case, copy runs of plain characters */
+            while (c != '"' && c != '\\') {
+                crowdsec_json_char(js, c);
+                if (++buf == end) {
+                    return 1;
+                }
+                c = *buf;
+            }
+            if (c == '"') {
+                crowdsec_json_string_end(js);
+            }
+            else {
+                js->state = CROWDSEC_JSON_ESCAPE;
+            }
+            break;
+
+        case CROWDSEC_JSON_ESCAPE:
+            js->state = CROWDSEC_JSON_STRING;
+            switch (c) {
+            case 'b':
+                crowdsec_json_char(js, '\b');
+                break;
+            case 'f':
+                crowdsec_json_char(js, '\f');
+                break;
+            case 'n':
+                crowdsec_json_char(js, '\n');
+                break;
+            case 'r':
+                crowdsec_json_char(js, '\r');
+                break;
+            case 't':
+                crowdsec_json_char(js, '\t');
+                break;
+            case 'u':
+                js->state = CROWDSEC_JSON_UNICODE;
+                js->unicode = 0;
+                js->unicode_len = 0;
+                break;
+            default:
+                crowdsec_json_char(js, c);
+                break;
+            }
+            break;
+
+        case CROWDSEC_JSON_UNICODE:
+            if (!apr_isxdigit(c)) {
+                js->state = CROWDSEC_JSON_ERROR;
+                break;
+            }
+            js->unicode = js->unicode * 16 +
+                (apr_isdigit(c) ? c - '0' : (apr_tolower(c) - 'a' + 10));
+            if (++js->unicode_len == 4) {
+                /* none of the fields we keep are anything but ascii */
+                crowdsec_json_char(js, js->unicode < 0x80 ?
+                                   (char) js->unicode : '?');
+                js->state = CROWDSEC_JSON_STRING;
+            }
+            break;
+
+        case CROWDSEC_JSON_LITERAL:
+            if (apr_isalnum(c) || c == '-' || c == '+' || c == '.') {
+                if (js->literal_len < sizeof(js->literal)) {
+                    js->literal[js->literal_len++] = c;
+                }
+                else {
+                    js->state = CROWDSEC_JSON_ERROR;
+                }
+                break;
+            }
+            crowdsec_json_literal_end(js);
+            /* look at this character again */
+            continue;
+
+        default:
+
+            if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+                break;
+            }
+
+            switch (js->state) {
+
+            case CROWDSEC_JSON_VALUE_OR_END:
+                if (c == ']') {
+                    crowdsec_json_close(js, 0);
+                    break;
+                }
+                /* fall through */
+            case CROWDSEC_JSON_VALUE:
+                if (c == '{') {
+                    crowdsec_json_open(js, 1);
+                }
+                else if (c == '[') {
+                    crowdsec_json_open(js, 0);
+                }
+                else if (c == '"') {
+                    if (!js->depth) {
+                        js->state = CROWDSEC_JSON_ERROR;
+                        break;
+                    }
+                    js->state = CROWDSEC_JSON_STRING;
+                    js->in_key = 0;
+                    js->truncated = 0;
+                    crowdsec_json_field_start(js);
+                }
+                else if (apr_isalnum(c) || c == '-') {
+                    js->state = CROWDSEC_JSON_LITERAL;
+                    js->literal[0] = c;
+                    js->literal_len = 1;
+                }
+                else {
+                    js->state = CROWDSEC_JSON_ERROR;
+                }
+                break;
+
+            case CROWDSEC_JSON_KEY_OR_END:
+                if (c == '}') {
+                    crowdsec_json_close(js, 1);
+                    break;
+                }
+                /* fall through */
+            case CROWDSEC_JSON_KEY:
+                if (c == '"') {
+                    js->state = CROWDSEC_JSON_STRING;
+                    js->in_key = 1;
+                    js->truncated = 0;
+                    js->key_len = 0;
+                }
+                else {
+                    js->state = CROWDSEC_JSON_ERROR;
+                }
+                break;
+
+            case CROWDSEC_JSON_COLON:
+                js->state = c == ':' ? CROWDSEC_JSON_VALUE :
+                    CROWDSEC_JSON_ERROR;
+                break;
+
+            case CROWDSEC_JSON_AFTER:
+                if (c == ',') {
+                    js->state = crowdsec_json_in_object(js) ?
+                        CROWDSEC_JSON_KEY : CROWDSEC_JSON_VALUE;
+                }
+                else if (c == '}' || c == ']') {
+                    crowdsec_json_close(js, c == '}');
+                }
+                else {
+                    js->state = CROWDSEC_JSON_ERROR;
+                }
+                break;
+
+            default:
+                /* nothing may follow the end of the response */
+                js->state = CROWDSEC_JSON_ERROR;
+                break;
+            }
+
+        }
+
+        if (js->state == CROWDSEC_JSON_ERROR) {
+            return 0;
+        }
+
+        buf++;
+    }
+
+    return js->state != CROWDSEC_JSON_ERROR;
+}
+
+/*
+ * The response is complete. Returns zero if it was not a complete and
+ * valid response of the expected shape.
+ */
+static int crowdsec_json_finish(crowdsec_json * js)
+{
+    if (js->state == CROWDSEC_JSON_LITERAL && !js->depth) {
+        crowdsec_json_literal_end(js);
+    }
+
+    return js->state == CROWDSEC_JSON_DONE;
+}
+
+/*
+ * Feed a response body to the parser as it arrives.
+ */
+static apr_status_t crowdsec_json_body(void *baton, const char *data,
+                                       apr_size_t len)
+{
+    return crowdsec_json_feed(baton, data, len) ? APR_SUCCESS : APR_EGENERAL;
+}
+
+static apr_byte_t crowdsec_decision_parse(const char *type, apr_size_t len)
+{
+    if (!type || crowdsec_json_is(type, len, "ban")) {
+        return CROWDSEC_DECISION_BAN;
+    }
+    else if (crowdsec_json_is(type, len, "captcha")) {
+        return CROWDSEC_DECISION_CAPTCHA;
+    }
+    else if (crowdsec_json_is(type, len, "throttle")) {
+        return CROWDSEC_DECISION_THROTTLE;
+    }
+
+    return CROWDSEC_DECISION_OTHER;
+}
+
+static apr_byte_t crowdsec_origin_parse(const char *origin, apr_size_t len)
+{
+    if (!origin) {
+        return CROWDSEC_ORIGIN_OTHER;
+    }
+    else if (crowdsec_json_is(origin, len, "crowdsec")) {
+        return CROWDSEC_ORIGIN_CROWDSEC;
+    }
+    else if (crowdsec_json_is(origin, len, "cscli")) {
+        return CROWDSEC_ORIGIN_CSCLI;
+    }
+    else if (crowdsec_json_is(origin, len, "CAPI")) {
+        return CROWDSEC_ORIGIN_CAPI;
+    }
+    else if (crowdsec_json_is(origin, len, "lists")) {
+        return CROWDSEC_ORIGIN_LISTS;
+    }
+
+    return CROWDSEC_ORIGIN_OTHER;
+}
+
+/*
+ * Fold a decision from a /v1/decisions response into the verdict, keeping
+ * the most severe decision.
+ *
+ * The service only answers with decisions still active. A decision whose
+ * duration is missing or cannot be made sense of is applied all the
+ * same, with no known end, and is cached for CrowdsecCacheTimeout.
+ */
+static void crowdsec_verdict_apply(void *baton, int deleted,
+                                   const crowdsec_json_decision * jd)
+{
+    crowdsec_verdict_t *verdict = baton;
+    apr_interval_time_t duration;
+    apr_byte_t type;
+
+    duration = crowdsec_parse_duration(jd->duration, jd->duration_len);
+
+    type = crowdsec_decision_parse(jd->type, jd->type_len);
+
+    if (type > verdict->type) {
+        verdict->type = type;
+        verdict->origin = crowdsec_origin_parse(jd->origin, jd->origin_len);
+        verdict->id = (apr_uint32_t) jd->id;
+        verdict->until = duration > 0 ? apr_time_now() + duration : 0;
+    }
+}
+
+static crowdsec_conn_t *crowdsec_conn_create(apr_pool_t * p)
+{
+    crowdsec_conn_t *conn = apr_pcalloc(p, sizeof(crowdsec_conn_t));
+
+    if (apr_pool_create(&conn->pool, p) != APR_SUCCESS) {
+        return NULL;
+    }
+
+    return conn;
+}
+
+/*
+ * Close the connection to the crowdsec service, if open. The connection
+ * may be opened again.
+ */
+static void crowdsec_conn_close(crowdsec_conn_t * conn)
+{
+    if (conn->sock) {
+        apr_socket_close(conn->sock);
+        conn->sock = NULL;
+    }
+    apr_pool_clear(conn->pool);
+    conn->pos = conn->len = 0;
+    conn->requests = 0;
+}
+
+static apr_status_t crowdsec_conn_open(server_rec * s, crowdsec_conn_t * conn,
+                                       apr_interval_time_t timeout)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(s->module_config,
+                             &crowdsec_module);
+
+    apr_sockaddr_t *sa;
+    apr_status_t status;
+
+    status = apr_sockaddr_info_get(&sa, conn->endpoint->uri.hostname,
+                                   APR_UNSPEC, conn->endpoint->uri.port, 0,
+                                   conn->pool);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    status = apr_socket_create(&conn->sock, sa->family, SOCK_STREAM,
+                               APR_PROTO_TCP, conn->pool);
+    if (status != APR_SUCCESS) {
+        conn->sock = NULL;
+        return status;
+    }
+
+    apr_socket_opt_set(conn->sock, APR_TCP_NODELAY, 1);
+    apr_socket_timeout_set(conn->sock, sconf->connect_timeout);
+
+    status = apr_socket_connect(conn->sock, sa);
+    if (status != APR_SUCCESS) {
+        crowdsec_conn_close(conn);
+        return status;
+    }
+
+    apr_socket_timeout_set(conn->sock, timeout);
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Read one line of the response head, without the line ending. The line
+ * lives in the connection buffer until the next read.
+ */
+static apr_status_t crowdsec_conn_line(crowdsec_conn_t * conn, char **line)
+{
+    for (;;) {
+        char *nl = memchr(conn->buf + conn->pos, '\n', conn->len - conn->pos);
+        apr_size_t n;
+        apr_status_t status;
+
+        if (nl) {
+            *line = conn->buf + conn->pos;
+            conn->pos = nl - conn->buf + 1;
+            if (nl > *line && nl[-1] == '\r') {
+                nl--;
+            }
+            *nl = 0;
+            return APR_SUCCESS;
+        }
+
+        if (conn->pos) {
+            memmove(conn->buf, conn->buf + conn->pos, conn->len - conn->pos);
+            conn->len -= conn->pos;
+            conn->pos = 0;
+        }
+
+        if (conn->len == sizeof(conn->buf)) {
+            return APR_ENOSPC;
+        }
+
+        n = sizeof(conn->buf) - conn->len;
+        status = apr_socket_recv(conn->sock, conn->buf + conn->len, &n);
+        conn->len += n;
+
+        if (status != APR_SUCCESS && !n) {
+            return status;
+        }
+    }
+}
+
+/*
+ * Pass len bytes of the response body to the callback, or everything up to
+ * the end of the connection if len is zero. The body is passed on straight
+ * from the connection buffer as it is read, and is never held in full.
+ */
+static apr_status_t crowdsec_conn_body(crowdsec_conn_t * conn, apr_size_t len,
+                                       crowdsec_body_fn *fn, void *baton)
+{
+    int to_eof = !len;
+
+    while (to_eof || len) {
+        apr_size_t n = conn->len - conn->pos;
+        apr_status_t status;
+
+        if (!n) {
+            conn->pos = 0;
+            n = sizeof(conn->buf);
+            status = apr_socket_recv(conn->sock, conn->buf, &n);
+            conn->len = n;
+
+            if (status != APR_SUCCESS && !n) {
+                if (APR_STATUS_IS_EOF(status)) {
+                    return to_eof ? APR_SUCCESS : APR_EGENERAL;
+                }
+                return status;
+            }
+        }
+
+        if (!to_eof && n > len) {
+            n = len;
+        }
+
+        if (fn) {
+            status = fn(baton, conn->buf + conn->pos, n);
+            if (status != APR_SUCCESS) {
+                return status;
+            }
+        }
+
+        conn->pos += n;
+        if (!to_eof) {
+            len -= n;
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Build a GET request for the given path at the endpoint.
+ */
+static const char *crowdsec_http_request(server_rec * s, apr_pool_t * p,
+                                         const crowdsec_endpoint_t * ep,
+                                         const char *path)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(s->module_config,
+                             &crowdsec_module);
+
+    return apr_pstrcat(p, "GET ", ep->uri.path ? ep->uri.path : "",
+                       path, " HTTP/1.1\r\n"
+                       "Host: ", ep->uri.hostinfo, "\r\n"
+                       "User-Agent: ", ap_get_server_description(), "\r\n",
+                       sconf->key ? "X-Api-Key: " : "",
+                       sconf->key ? sconf->key : "",
+                       sconf->key ? "\r\n" : "",
+                       "\r\n", NULL);
+}
+
+static apr_status_t crowdsec_http_send(crowdsec_conn_t * conn,
+                                       const char *req, apr_size_t reqlen)
+{
+    apr_size_t sent, n;
+    apr_status_t status = APR_SUCCESS;
+
+    for (sent = 0; sent < reqlen; sent += n) {
+        n = reqlen - sent;
+        status = apr_socket_send(conn->sock, req + sent, &n);
+        if (status != APR_SUCCESS) {
+            break;
+        }
+    }
+
+    return status;
+}
+
+/*
+ * Send the request over the connection, opened first if need be. The
+ * connection is closed on failure.
+ */
+static apr_status_t crowdsec_http_start(server_rec * s,
+                                        crowdsec_conn_t * conn,
+                                        apr_interval_time_t timeout,
+                                        const char *req, apr_size_t reqlen)
+{
+    apr_status_t status;
+
+    if (!conn->sock) {
+        status = crowdsec_conn_open(s, conn, timeout);
+        if (status != APR_SUCCESS) {
+            return status;
+        }
+    }
+    else {
+        apr_socket_timeout_set(conn->sock, timeout);
+    }
+
+    status = crowdsec_http_send(conn, req, reqlen);
+    if (status != APR_SUCCESS) {
+        crowdsec_conn_close(conn);
+    }
+
+    return status;
+}
+
+/*
+ * Read the next response from the connection. If the status is 200 OK,
+ * the body is passed to the callback piece by piece as it arrives.
+ *
+ * The code is left at zero if not even the status line could be read.
+ * The connection is closed on failure, or if the service asked for it to
+ * be, and is otherwise ready for the next response.
+ */
+static apr_status_t crowdsec_http_response(crowdsec_conn_t * conn, int *code,
+                                           crowdsec_body_fn *fn, void *baton)
+{
+    char *line;
+    apr_off_t clen = -1;
+    int chunked = 0, close_after = 0;
+    apr_status_t status;
+
+    *code = 0;
+
+    status = crowdsec_conn_line(conn, &line);
+    if (status != APR_SUCCESS) {
+        crowdsec_conn_close(conn);
+        return status;
+    }
+
+    /* status line */
+    if (strncmp(line, "HTTP/1.", 7) || strlen(line) < 12) {
+        crowdsec_conn_close(conn);
+        return APR_EGENERAL;
+    }
+
+    close_after = line[7] == '0';
+    *code = atoi(line + 9);
+
+    /* headers */
+    for (;;) {
+        char *colon;
+
+        status = crowdsec_conn_line(conn, &line);
+        if (status != APR_SUCCESS) {
+            crowdsec_conn_close(conn);
+            return status;
+        }
+
+        if (!*line) {
+            break;
+        }
+
+        colon = strchr(line, ':');
+        if (!colon) {
+            continue;
+        }
+        *colon++ = 0;
+        while (*colon == ' ' || *colon == '\t') {
+            colon++;
+        }
+
+        if (!strcasecmp(line, "Content-Length")) {
+            clen = apr_atoi64(colon);
+        }
+        else if (!strcasecmp(line, "Transfer-Encoding")) {
+            chunked = ap_strcasestr(colon, "chunked") != NULL;
+        }
+        else if (!strcasecmp(line, "Connection")) {
+            if (ap_strcasestr(colon, "close")) {
+                close_after = 1;
+            }
+            else if (ap_strcasestr(colon, "keep-alive")) {
+                close_after = 0;
+            }
+        }
+    }
+
+    /* body, anything but a 200 OK is read and thrown away */
+    if (*code != HTTP_OK) {
+        fn = NULL;
+    }
+
+    if (chunked) {
+        for (;;) {
+            apr_size_t chunk;
+
+            status = crowdsec_conn_line(conn, &line);
+            if (status != APR_SUCCESS) {
+                break;
+            }
+
+            chunk = (apr_size_t) apr_strtoi64(line, NULL, 16);
+            if (!chunk) {
+                /* skip any trailers */
+                do {
+                    status = crowdsec_conn_line(conn, &line);
+                } while (status == APR_SUCCESS && *line);
+                break;
+            }
+
+            status = crowdsec_conn_body(conn, chunk, fn, baton);
+            if (status == APR_SUCCESS) {
+                status = crowdsec_conn_line(conn, &line);
+            }
+            if (status != APR_SUCCESS) {
+                break;
+            }
+        }
+    }
+    else if (clen > 0) {
+        status = crowdsec_conn_body(conn, (apr_size_t) clen, fn, baton);
+    }
+    else if (clen < 0 && *code != HTTP_NO_CONTENT &&
+             *code != HTTP_NOT_MODIFIED) {
+        /* delimited by the connection closing */
+        close_after = 1;
+        status = crowdsec_conn_body(conn, 0, fn, baton);
+    }
+
+    if (status != APR_SUCCESS || close_after) {
+        crowdsec_conn_close(conn);
+    }
+    else {
+        conn->requests++;
+    }
+
+    return status;
+}
+
+/*
+ * Make a GET request directly to the crowdsec service, over a kept alive
+ * connection where possible. If the service responds with 200 OK, the body
+ * is passed to the callback piece by piece as it arrives.
+ *
+ * Used by the watchdog in stream mode, where there is no request available
+ * to make a subrequest from, and in live mode when CrowdsecClient is set
+ * to builtin. A kept alive connection that turns out to have been closed
+ * by the service is reopened and the request is tried once more.
+ */
+static apr_status_t crowdsec_http_get(server_rec * s, crowdsec_conn_t * conn,
+                                      apr_pool_t * p,
+                                      apr_interval_time_t timeout,
+                                      const char *path, int *code,
+                                      crowdsec_body_fn *fn, void *baton)
+{
+
+    const char *req;
+    apr_size_t reqlen;
+    int attempt;
+
+    req = crowdsec_http_request(s, p, conn->endpoint, path);
+    reqlen = strlen(req);
+
+    for (attempt = 0;; attempt++) {
+
+        int reused = conn->sock && conn->requests > 0;
+        apr_status_t status;
+
+        *code = 0;
+
+        status = crowdsec_http_start(s, conn, timeout, req, reqlen);
+        if (status == APR_SUCCESS) {
+            status = crowdsec_http_response(conn, code, fn, baton);
+        }
+
+        if (status != APR_SUCCESS && !*code && reused && !attempt) {
+            /* the service closed the idle connection, try again */
+            continue;
+        }
+
+        return status;
+    }
+}
+
+/*
+ * Pack an expiry time into seconds since the epoch of the snapshot,
+ * rounded up so that a decision never ends early.
+ */
+static apr_uint32_t crowdsec_expiry_pack(const crowdsec_snapshot_hdr_t * hdr,
+                                         apr_time_t t)
+{
+    apr_time_t offset = t - hdr->epoch;
+
+    if (offset <= 0) {
+        return 0;
+    }
+
+    offset = (offset + APR_USEC_PER_SEC - 1) / APR_USEC_PER_SEC;
+
+    return offset > APR_UINT32_MAX ? APR_UINT32_MAX : (apr_uint32_t) offset;
+}
+
+static apr_time_t crowdsec_expiry_time(const crowdsec_snapshot_hdr_t * hdr,
+                                       apr_uint32_t expiry)
+{
+    return hdr->epoch + apr_time_from_sec((apr_time_t) expiry);
+}
+
+/* the decisions on single addresses, of both families */
+static apr_uint32_t crowdsec_snapshot_used(const crowdsec_snapshot_hdr_t *
+                                           hdr)
+{
+    return hdr->used[CROWDSEC_TABLE_IPV4] + hdr->used[CROWDSEC_TABLE_IPV6];
+}
+
+static crowdsec_table_t *crowdsec_snapshot_table(crowdsec_snapshot_t * snap,
+                                                 const crowdsec_ip_t * ip)
+{
+    return &snap->tables[ip->family == CROWDSEC_IPV4 ?
+                         CROWDSEC_TABLE_IPV4 : CROWDSEC_TABLE_IPV6];
+}
+
+/*
+ * Find the slot for the given ip address. If the address is not present,
+ * return the slot it should be inserted into. Returns CROWDSEC_SLOT_NONE
+ * if the table is full.
+ */
+static apr_uint32_t crowdsec_table_find(const crowdsec_table_t * table,
+                                        const crowdsec_ip_t * ip)
+{
+    apr_uint32_t mask = table->size - 1;
+    apr_uint32_t i = crowdsec_ip_hash(ip) & mask;
+    apr_uint32_t probes;
+    apr_uint32_t insert = CROWDSEC_SLOT_NONE;
+
+    for (probes = 0; probes <= mask; probes++, i = (i + 1) & mask) {
+
+        apr_byte_t state = table->states[i];
+
+        if (state == CROWDSEC_SLOT_EMPTY) {
+            return insert != CROWDSEC_SLOT_NONE ? insert : i;
+        }
+        else if (state == CROWDSEC_SLOT_DELETED) {
+            if (insert == CROWDSEC_SLOT_NONE) {
+                insert = i;
+            }
+        }
+        else if (!memcmp(table->keys + (apr_size_t) i * table->key_len,
+                         ip->addr, table->key_len)) {
+            return i;
+        }
+
+    }
+
+    return insert;
+}
+
+/*
+ * Rebuild the address held in the given slot.
+ */
+static void crowdsec_table_ip(const crowdsec_table_t * table, apr_uint32_t i,
+                              crowdsec_ip_t * ip)
+{
+    memset(ip, 0, sizeof(crowdsec_ip_t));
+    ip->family = table->key_len == 4 ? CROWDSEC_IPV4 : CROWDSEC_IPV6;
+    memcpy(ip->addr, table->keys + (apr_size_t) i * table->key_len,
+           table->key_len);
+}
+
+static int crowdsec_ip_bit(const crowdsec_ip_t * ip, int bit)
+{
+    return (ip->addr[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+/*
+ * Hash the network address of the prefix, ignoring the host bits.
+ */
+static apr_uint64_t crowdsec_filter_hash(const crowdsec_ip_t * ip, int bits)
+{
+    /* FNV-1a, then mixed so that the low and high bits both spread */
+    apr_uint64_t hash = APR_UINT64_C(14695981039346656037);
+    int i, len = (bits + 7) >> 3;
+
+    hash = (hash ^ ip->family) * APR_UINT64_C(1099511628211);
+    hash = (hash ^ bits) * APR_UINT64_C(1099511628211);
+    for (i = 0; i < len; i++) {
+        unsigned char b = ip->addr[i];
+
+        if (i == len - 1 && (bits & 7)) {
+            b &= 0xff << (8 - (bits & 7));
+        }
+        hash = (hash ^ b) * APR_UINT64_C(1099511628211);
+    }
+
+    hash ^= hash >> 33;
+    hash *= APR_UINT64_C(0xff51afd7ed558ccd);
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+static apr_uint16_t crowdsec_filter_fp(apr_uint64_t hash)
+{
+    apr_uint16_t fp = (apr_uint16_t) (hash >> 48);
+
+    return fp ? fp : 1;
+}
+
+/*
+ * The other bucket a fingerprint may live in. Applied twice, this gives
+ * back the bucket we started with.
+ */
+static apr_uint32_t crowdsec_filter_alt(apr_uint32_t i, apr_uint16_t fp,
+                                        apr_uint32_t mask)
+{
+    return (i ^ (fp * 0x5bd1e995U)) & mask;
+}
+
+static int crowdsec_filter_put(crowdsec_bucket_t * bucket, apr_uint16_t fp)
+{
+    int w;
+
+    for (w = 0; w < CROWDSEC_FILTER_WAYS; w++) {
+        if (!bucket->fp[w]) {
+            bucket->fp[w] = fp;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int crowdsec_filter_has(const crowdsec_bucket_t * bucket,
+                               apr_uint16_t fp)
+{
+    return bucket->fp[0] == fp || bucket->fp[1] == fp ||
+        bucket->fp[2] == fp || bucket->fp[3] == fp;
+}
+
+/*
+ * Add a prefix to the prefilter. Should the filter be too full to take
+ * it, the filter is marked as overflowed and lookups bypass it until it
+ * is next rebuilt.
+ */
+static void crowdsec_filter_add(crowdsec_snapshot_t * snap,
+                                const crowdsec_ip_t * ip, int bits)
+{
+    crowdsec_filter_hdr_t *filter = &snap->hdr->filter;
+    apr_uint32_t mask = snap->filter_size - 1, i;
+    apr_uint64_t hash;
+    apr_uint16_t fp;
+    int kick, family = ip->family == CROWDSEC_IPV4 ? 0 : 1;
+
+    if (!filter->prefixes[family][bits]++) {
+        filter->lengths[family][bits >> 5] |= 1U << (bits & 31);
+    }
+
+    if (filter->overflow) {
+        return;
+    }
+
+    hash = crowdsec_filter_hash(ip, bits);
+    fp = crowdsec_filter_fp(hash);
+    i = (apr_uint32_t) hash & mask;
+
+    if (crowdsec_filter_put(&snap->filter[i], fp)) {
+        return;
+    }
+    i = crowdsec_filter_alt(i, fp, mask);
+    if (crowdsec_filter_put(&snap->filter[i], fp)) {
+        return;
+    }
+
+    /* both buckets are full, move fingerprints on to their other bucket */
+    for (kick = 0; kick < CROWDSEC_FILTER_KICKS; kick++) {
+        apr_uint16_t *victim =
+            &snap->filter[i].fp[(fp ^ kick) & (CROWDSEC_FILTER_WAYS - 1)];
+        apr_uint16_t evicted = *victim;
+
+        *victim = fp;
+        fp = evicted;
+        i = crowdsec_filter_alt(i, fp, mask);
+        if (crowdsec_filter_put(&snap->filter[i], fp)) {
+            return;
+        }
+    }
+
+    filter->overflow = 1;
+}
+
+static void crowdsec_filter_remove(crowdsec_snapshot_t * snap,
+                                   const crowdsec_ip_t * ip, int bits)
+{
+    crowdsec_filter_hdr_t *filter = &snap->hdr->filter;
+    apr_uint32_t mask = snap->filter_size - 1, i, j;
+    apr_uint64_t hash;
+    apr_uint16_t fp;
+    int w, family = ip->family == CROWDSEC_IPV4 ? 0 : 1;
+
+    if (!--filter->prefixes[family][bits]) {
+        filter->lengths[family][bits >> 5] &= ~(1U << (bits & 31));
+    }
+
+    /* a lost entry may share its fingerprint with this one, leave it be */
+    if (filter->overflow) {
+        return;
+    }
+
+    hash = crowdsec_filter_hash(ip, bits);
+    fp = crowdsec_filter_fp(hash);
+    i = (apr_uint32_t) hash & mask;
+    j = crowdsec_filter_alt(i, fp, mask);
+
+    for (w = 0; w < CROWDSEC_FILTER_WAYS; w++) {
+        if (snap->filter[i].fp[w] == fp) {
+            snap->filter[i].fp[w] = 0;
+            return;
+        }
+    }
+    for (w = 0; w < CROWDSEC_FILTER_WAYS; w++) {
+        if (snap->filter[j].fp[w] == fp) {
+            snap->filter[j].fp[w] = 0;
+            return;
+        }
+    }
+}
+
+/*
+ * Could the address have a decision on it, or on a range containing it?
+ * A zero answer is certain, so the table and the trie need not be looked
+ * at. The filter is probed once for each prefix length in use, which for
+ * the usual mix of addresses and a handful of range sizes is a few
+ * buckets.
+ *
+ * As with the trie, this may be called while the snapshot is written.
+ */
+static int crowdsec_filter_maybe(const crowdsec_snapshot_t * snap,
+                                 const crowdsec_ip_t * ip)
+{
+    const crowdsec_filter_hdr_t *filter = &snap->hdr->filter;
+    apr_uint32_t mask = snap->filter_size - 1;
+    int bits, family = ip->family == CROWDSEC_IPV4 ? 0 : 1;
+    int max = family ? 128 : 32;
+
+    if (filter->overflow) {
+        return 1;
+    }
+
+    for (bits = 0; bits <= max; bits++) {
+        apr_uint32_t lengths = filter->lengths[family][bits >> 5];
+        apr_uint64_t hash;
+        apr_uint32_t i;
+        apr_uint16_t fp;
+
+        if (!(lengths >> (bits & 31))) {
+            /* nothing more in this word */
+            bits |= 31;
+            continue;
+        }
+        if (!((lengths >> (bits & 31)) & 1)) {
+            continue;
+        }
+
+        hash = crowdsec_filter_hash(ip, bits);
+        fp = crowdsec_filter_fp(hash);
+        i = (apr_uint32_t) hash & mask;
+
+        if (crowdsec_filter_has(&snap->filter[i], fp) ||
+            crowdsec_filter_has(&snap->filter[crowdsec_filter_alt(i, fp,
+                                                                  mask)],
+                                fp)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Find the range with the given prefix, creating the trie nodes and the
+ * range if asked to. Returns NULL if not found, or if the snapshot is out
+ * of room.
+ */
+static crowdsec_range_t *crowdsec_snapshot_range(crowdsec_snapshot_t * snap,
+                                                 const crowdsec_ip_t * ip,
+                                                 apr_byte_t bits, int create)
+{
+    crowdsec_snapshot_hdr_t *hdr = snap->hdr;
+    crowdsec_range_t *range;
+    apr_uint32_t n = ip->family == CROWDSEC_IPV4 ? 0 : 1;
+    int bit;
+
+    for (bit = 0; bit < bits; bit++) {
+        int b = crowdsec_ip_bit(ip, bit);
+
+        if (!snap->nodes[n].child[b]) {
+            if (!create || hdr->nodes_top >= snap->max_nodes) {
+                return NULL;
+            }
+            memset(&snap->nodes[hdr->nodes_top], 0, sizeof(crowdsec_node_t));
+            snap->nodes[n].child[b] = hdr->nodes_top++;
+        }
+        n = snap->nodes[n].child[b];
+    }
+
+    if (snap->nodes[n].range) {
+        return &snap->ranges[snap->nodes[n].range - 1];
+    }
+
+    if (!create || hdr->ranges_top >= snap->max_ranges) {
+        return NULL;
+    }
+
+    range = &snap->ranges[hdr->ranges_top++];
+    memset(range, 0, sizeof(crowdsec_range_t));
+    range->ip = *ip;
+    range->bits = bits;
+    range->node = n;
+    snap->nodes[n].range = hdr->ranges_top;
+
+    return range;
+}
+
+static void crowdsec_table_remove(crowdsec_snapshot_t * snap,
+                                  crowdsec_table_t * table, apr_uint32_t i)
+{
+    apr_size_t t = table - snap->tables;
+    crowdsec_ip_t ip;
+
+    crowdsec_table_ip(table, i, &ip);
+
+    table->states[i] = CROWDSEC_SLOT_DELETED;
+    snap->hdr->used[t]--;
+    snap->hdr->deleted[t]++;
+    crowdsec_filter_remove(snap, &ip, table->key_len * 8);
+}
+
+/*
+ * How much a decision is worth keeping when the table is full: decisions
+ * made by the local engine over those from the community blocklist or
+ * subscribed lists, then bans over captchas and throttles, then those
+ * lasting longest.
+ */
+static apr_uint64_t crowdsec_entry_rank(const crowdsec_entry_t * entry)
+{
+    apr_uint64_t local = entry->origin != CROWDSEC_ORIGIN_CAPI &&
+        entry->origin != CROWDSEC_ORIGIN_LISTS;
+
+    return (local << 40) | ((apr_uint64_t) entry->type << 32) | entry->expiry;
+}
+
+/*
+ * The table is full. Sample a few decisions near where the address would
+ * go, and remove the one least worth keeping, if the new decision is worth
+ * more. Returns the slot freed, or CROWDSEC_SLOT_NONE to drop the new
+ * decision instead.
+ */
+static apr_uint32_t crowdsec_table_evict(crowdsec_snapshot_t * snap,
+                                         crowdsec_table_t * table,
+                                         const crowdsec_ip_t * ip,
+                                         const crowdsec_entry_t * entry)
+{
+    apr_uint32_t mask = table->size - 1;
+    apr_uint32_t i = (crowdsec_ip_hash(ip) * 0x9e3779b1U) & mask;
+    apr_uint32_t victim = CROWDSEC_SLOT_NONE;
+    apr_uint64_t lowest = crowdsec_entry_rank(entry);
+    apr_uint32_t probes, samples = 0;
+
+    for (probes = 0; probes <= mask && samples < CROWDSEC_STORE_EVICT_SAMPLES;
+         probes++, i = (i + 1) & mask) {
+
+        if (table->states[i] == CROWDSEC_SLOT_USED) {
+            apr_uint64_t rank = crowdsec_entry_rank(&table->entries[i]);
+
+            if (rank < lowest) {
+                lowest = rank;
+                victim = i;
+            }
+            samples++;
+        }
+
+    }
+
+    if (victim == CROWDSEC_SLOT_NONE) {
+        return CROWDSEC_SLOT_NONE;
+    }
+
+    crowdsec_table_remove(snap, table, victim);
+    snap->evicted++;
+
+    /* the freed slot leaves a tombstone, find where the address goes now */
+    return crowdsec_table_find(table, ip);
+}
+
+static void crowdsec_snapshot_range_remove(crowdsec_snapshot_t * snap,
+                                           crowdsec_range_t * range)
+{
+    range->state = CROWDSEC_SLOT_DELETED;
+    crowdsec_filter_remove(snap, &range->ip, range->bits);
+    snap->nodes[range->node].range = 0;
+    snap->hdr->ranges_used--;
+    snap->hdr->ranges_deleted++;
+}
+
+/*
+ * Find the most severe live range containing the address, preferring the
+ * longest prefix between ranges of equal severity.
+ *
+ * This may be called while the snapshot is being written; indexes are
+ * checked so that a torn read cannot stray outside the snapshot, and the
+ * caller checks the sequence number before believing the answer.
+ */
+static const crowdsec_range_t *crowdsec_snapshot_match(
+        const crowdsec_snapshot_t * snap, const crowdsec_ip_t * ip,
+        apr_time_t now)
+{
+    const crowdsec_range_t *best = NULL;
+    apr_uint32_t n = ip->family == CROWDSEC_IPV4 ? 0 : 1;
+    int bit, max = ip->family == CROWDSEC_IPV4 ? 32 : 128;
+
+    for (bit = 0;; bit++) {
+        apr_uint32_t r = snap->nodes[n].range;
+
+        if (r && r <= snap->max_ranges) {
+            const crowdsec_range_t *range = &snap->ranges[r - 1];
+
+            if (range->state == CROWDSEC_SLOT_USED &&
+                crowdsec_expiry_time(snap->hdr, range->expiry) > now &&
+                (!best || range->type >= best->type)) {
+                best = range;
+            }
+        }
+
+        if (bit == max) {
+            break;
+        }
+
+        n = snap->nodes[n].child[crowdsec_ip_bit(ip, bit)];
+        if (!n || n >= snap->max_nodes) {
+            break;
+        }
+    }
+
+    return best;
+}
+
+static void crowdsec_snapshot_clear_ranges(crowdsec_snapshot_t * snap)
+{
+    memset(snap->nodes, 0, CROWDSEC_NODE_ROOTS * sizeof(crowdsec_node_t));
+    snap->hdr->ranges_used = 0;
+    snap->hdr->ranges_deleted = 0;
+    snap->hdr->ranges_top = 0;
+    snap->hdr->nodes_top = CROWDSEC_NODE_ROOTS;
+}
+
+/*
+ * Parse the value of a Country or AS scoped decision.
+ */
+static int crowdsec_scoped_parse(const crowdsec_json_decision * jd,
+                                 apr_byte_t * scope, apr_uint32_t * value)
+{
+    const char *v = jd->value;
+    apr_size_t len = jd->value_len;
+
+    if (jd->scope_len == 7 && !ap_cstr_casecmpn(jd->scope, "country", 7)) {
+        if (len != 2 || !apr_isalpha(v[0]) || !apr_isalpha(v[1])) {
+            return 0;
+        }
+        *scope = CROWDSEC_SCOPE_COUNTRY;
+        *value = (apr_toupper(v[0]) << 8) | apr_toupper(v[1]);
+        return 1;
+    }
+
+    if (jd->scope_len == 2 && !ap_cstr_casecmpn(jd->scope, "as", 2)) {
+        apr_uint64_t asn = 0;
+
+        if (len > 2 && !ap_cstr_casecmpn(v, "as", 2)) {
+            v += 2;
+            len -= 2;
+        }
+        if (!len || len > 10) {
+            return 0;
+        }
+        while (len--) {
+            if (!apr_isdigit(*v)) {
+                return 0;
+            }
+            asn = asn * 10 + (*v++ - '0');
+        }
+        if (!asn || asn > APR_UINT32_MAX) {
+            return 0;
+        }
+        *scope = CROWDSEC_SCOPE_AS;
+        *value = (apr_uint32_t) asn;
+        return 1;
+    }
+
+    return 0;
+}
+
+static crowdsec_scoped_t *crowdsec_snapshot_scoped(crowdsec_snapshot_t * snap,
+                                                   apr_byte_t scope,
+                                                   apr_uint32_t value,
+                                                   int create)
+{
+    crowdsec_scoped_t *spare = NULL;
+    apr_uint32_t i;
+
+    for (i = 0; i < snap->hdr->scoped_top; i++) {
+        crowdsec_scoped_t *sc = &snap->scoped[i];
+
+        if (sc->state != CROWDSEC_SLOT_USED) {
+            if (!spare) {
+                spare = sc;
+            }
+        }
+        else if (sc->scope == scope && sc->value == value) {
+            return sc;
+        }
+    }
+
+    if (!create) {
+        return NULL;
+    }
+
+    if (!spare) {
+        if (snap->hdr->scoped_top >= snap->max_scoped) {
+            return NULL;
+        }
+        spare = &snap->scoped[snap->hdr->scoped_top++];
+    }
+
+    memset(spare, 0, sizeof(crowdsec_scoped_t));
+    spare->scope = scope;
+    spare->value = value;
+
+    return spare;
+}
+
+/*
+ * Find the most severe live decision on the given country or AS. The
+ * same care as crowdsec_snapshot_match applies.
+ */
+static const crowdsec_scoped_t *crowdsec_snapshot_scoped_match(
+        const crowdsec_snapshot_t * snap, apr_uint32_t country,
+        apr_uint32_t asn, apr_time_t now)
+{
+    const crowdsec_scoped_t *best = NULL;
+    apr_uint32_t i, top = snap->hdr->scoped_top;
+
+    if (top > snap->max_scoped) {
+        return NULL;
+    }
+
+    for (i = 0; i < top; i++) {
+        const crowdsec_scoped_t *sc = &snap->scoped[i];
+
+        if (sc->state == CROWDSEC_SLOT_USED &&
+            crowdsec_expiry_time(snap->hdr, sc->expiry) > now &&
+            ((sc->scope == CROWDSEC_SCOPE_COUNTRY && sc->value == country) ||
+             (sc->scope == CROWDSEC_SCOPE_AS && sc->value == asn)) &&
+            (!best || sc->type > best->type)) {
+            best = sc;
+        }
+    }
+
+    return best;
+}
+
+static void crowdsec_snapshot_clear_filter(crowdsec_snapshot_t * snap)
+{
+    memset(snap->filter, 0, snap->filter_size * sizeof(crowdsec_bucket_t));
+    memset(&snap->hdr->filter, 0, sizeof(crowdsec_filter_hdr_t));
+}
+
+static void crowdsec_snapshot_clear_table(crowdsec_snapshot_t * snap,
+                                          crowdsec_table_t * table)
+{
+    apr_size_t t = table - snap->tables;
+
+    memset(table->states, 0, table->size);
+    snap->hdr->used[t] = 0;
+    snap->hdr->deleted[t] = 0;
+}
+
+static void crowdsec_snapshot_clear(crowdsec_snapshot_t * snap)
+{
+    int t;
+
+    for (t = 0; t < CROWDSEC_TABLES; t++) {
+        crowdsec_snapshot_clear_table(snap, &snap->tables[t]);
+    }
+    snap->hdr->updated = 0;
+    snap->hdr->epoch = apr_time_from_sec(apr_time_sec(apr_time_now()));
+    crowdsec_snapshot_clear_ranges(snap);
+    snap->hdr->scoped_used = 0;
+    snap->hdr->scoped_top = 0;
+    crowdsec_snapshot_clear_filter(snap);
+}
+
+/*
+ * Refill the prefilter from the table and the trie.
+ */
+static void crowdsec_snapshot_rebuild_filter(crowdsec_snapshot_t * snap)
+{
+    apr_uint32_t i;
+    int t;
+
+    crowdsec_snapshot_clear_filter(snap);
+
+    for (t = 0; t < CROWDSEC_TABLES; t++) {
+        const crowdsec_table_t *table = &snap->tables[t];
+
+        for (i = 0; i < table->size; i++) {
+            if (table->states[i] == CROWDSEC_SLOT_USED) {
+                crowdsec_ip_t ip;
+
+                crowdsec_table_ip(table, i, &ip);
+                crowdsec_filter_add(snap, &ip, table->key_len * 8);
+            }
+        }
+    }
+
+    for (i = 0; i < snap->hdr->ranges_top; i++) {
+        const crowdsec_range_t *range = &snap->ranges[i];
+
+        if (range->state == CROWDSEC_SLOT_USED) {
+            crowdsec_filter_add(snap, &range->ip, range->bits);
+        }
+    }
+}
+
+/*
+ * Fill the next snapshot from the active one. Once too many slots of a
+ * table have been deleted the table is rebuilt rather than copied, so
+ * that lookups stay short.
+ */
+static void crowdsec_snapshot_copy(crowdsec_snapshot_t * next,
+                                   const crowdsec_snapshot_t * active)
+{
+    apr_uint32_t i;
+    int t, rebuilt = 0;
+
+    /* the expiry offsets are carried over as they are */
+    next->hdr->epoch = active->hdr->epoch;
+
+    for (t = 0; t < CROWDSEC_TABLES; t++) {
+        const crowdsec_table_t *from = &active->tables[t];
+        crowdsec_table_t *to = &next->tables[t];
+
+        if (active->hdr->deleted[t] > from->size / 4) {
+
+            crowdsec_snapshot_clear_table(next, to);
+            rebuilt = 1;
+
+            for (i = 0; i < from->size; i++) {
+                if (from->states[i] == CROWDSEC_SLOT_USED) {
+                    crowdsec_ip_t ip;
+                    apr_uint32_t j;
+
+                    crowdsec_table_ip(from, i, &ip);
+                    j = crowdsec_table_find(to, &ip);
+                    memcpy(to->keys + (apr_size_t) j * to->key_len,
+                           ip.addr, to->key_len);
+                    to->states[j] = CROWDSEC_SLOT_USED;
+                    to->entries[j] = from->entries[i];
+                    next->hdr->used[t]++;
+                }
+            }
+
+        }
+        else {
+
+            memcpy(to->keys, from->keys, (apr_size_t) from->size *
+                   from->key_len);
+            memcpy(to->states, from->states, from->size);
+            memcpy(to->entries, from->entries,
+                   from->size * sizeof(crowdsec_entry_t));
+            next->hdr->used[t] = active->hdr->used[t];
+            next->hdr->deleted[t] = active->hdr->deleted[t];
+
+        }
+    }
+
+    /* likewise the trie, once deleted ranges outnumber the live ones */
+    if (active->hdr->ranges_deleted > active->hdr->ranges_used ||
+        (active->hdr->ranges_deleted &&
+         active->hdr->nodes_top > active->max_nodes / 4 * 3)) {
+
+        crowdsec_snapshot_clear_ranges(next);
+        rebuilt = 1;
+
+        for (i = 0; i < active->hdr->ranges_top; i++) {
+            const crowdsec_range_t *from = &active->ranges[i];
+            crowdsec_range_t *to;
+
+            if (from->state != CROWDSEC_SLOT_USED) {
+                continue;
+            }
+
+            to = crowdsec_snapshot_range(next, &from->ip, from->bits, 1);
+            if (to) {
+                apr_uint32_t node = to->node;
+
+                *to = *from;
+                to->node = node;
+                next->hdr->ranges_used++;
+            }
+        }
+
+    }
+    else {
+
+        memcpy(next->ranges, active->ranges,
+               active->hdr->ranges_top * sizeof(crowdsec_range_t));
+        memcpy(next->nodes, active->nodes,
+               active->hdr->nodes_top * sizeof(crowdsec_node_t));
+        next->hdr->ranges_used = active->hdr->ranges_used;
+        next->hdr->ranges_deleted = active->hdr->ranges_deleted;
+        next->hdr->ranges_top = active->hdr->ranges_top;
+        next->hdr->nodes_top = active->hdr->nodes_top;
+
+    }
+
+    /* there are few country and AS decisions, always compact them */
+    next->hdr->scoped_used = next->hdr->scoped_top = 0;
+    for (i = 0; i < active->hdr->scoped_top; i++) {
+        if (active->scoped[i].state == CROWDSEC_SLOT_USED) {
+            next->scoped[next->hdr->scoped_top++] = active->scoped[i];
+            next->hdr->scoped_used++;
+        }
+    }
+
+    /* the prefilter follows the table and the trie */
+    if (rebuilt || active->hdr->filter.overflow) {
+        crowdsec_snapshot_rebuild_filter(next);
+    }
+    else {
+        memcpy(next->filter, active->filter,
+               active->filter_size * sizeof(crowdsec_bucket_t));
+        next->hdr->filter = active->hdr->filter;
+    }
+
+    next->hdr->updated = active->hdr->updated;
+}
+
+/*
+ * Remove expired decisions. A decision set aside for one that expired
+ * may outlive it, and is fetched again on the next pull.
+ */
+static void crowdsec_snapshot_expire(crowdsec_snapshot_t * snap,
+                                     apr_time_t now)
+{
+    apr_uint32_t i;
+    int t;
+
+    for (t = 0; t < CROWDSEC_TABLES; t++) {
+        crowdsec_table_t *table = &snap->tables[t];
+
+        for (i = 0; i < table->size; i++) {
+            if (table->states[i] == CROWDSEC_SLOT_USED &&
+                crowdsec_expiry_time(snap->hdr,
+                                     table->entries[i].expiry) <= now) {
+                snap->resync |= table->entries[i].shadows;
+                crowdsec_table_remove(snap, table, i);
+                snap->changes++;
+            }
+        }
+    }
+
+    for (i = 0; i < snap->hdr->ranges_top; i++) {
+        crowdsec_range_t *range = &snap->ranges[i];
+
+        if (range->state == CROWDSEC_SLOT_USED &&
+            crowdsec_expiry_time(snap->hdr, range->expiry) <= now) {
+            snap->resync |= range->shadows;
+            crowdsec_snapshot_range_remove(snap, range);
+            snap->changes++;
+        }
+    }
+
+    for (i = 0; i < snap->hdr->scoped_top; i++) {
+        crowdsec_scoped_t *sc = &snap->scoped[i];
+
+        if (sc->state == CROWDSEC_SLOT_USED &&
+            crowdsec_expiry_time(snap->hdr, sc->expiry) <= now) {
+            snap->resync |= sc->shadows;
+            sc->state = CROWDSEC_SLOT_DELETED;
+            snap->hdr->scoped_used--;
+            snap->changes++;
+        }
+    }
+}
+
+/*
+ * Whether a new decision should take the place of the one already held
+ * for the same address, range, country or AS: the more severe decision
+ * wins, then the one lasting longer. An update to the held decision
+ * always does, as does any decision once the held one has expired.
+ *
+ * The shadows flag of the held decision is passed in, and is set on the
+ * way out should two live decisions have met, for whichever is held.
+ */
+static int crowdsec_snapshot_replaces(const crowdsec_snapshot_hdr_t * hdr,
+                                      apr_byte_t type, apr_uint32_t expiry,
+                                      apr_uint32_t id, apr_byte_t held_type,
+                                      apr_uint32_t held_expiry,
+                                      apr_uint32_t held_id,
+                                      apr_byte_t * shadows, apr_time_t now)
+{
+    if (id == held_id) {
+        return 1;
+    }
+
+    if (crowdsec_expiry_time(hdr, held_expiry) <= now) {
+        return 1;
+    }
+
+    *shadows = 1;
+
+    if (type != held_type) {
+        return type > held_type;
+    }
+
+    return expiry > held_expiry;
+}
+
+/*
+ * Apply a single decision from the stream to the snapshot.
+ *
+ * Several decisions may be active on the same value, of which only the
+ * strongest is held. A deleted decision only removes the one held if
+ * the ids match, so that the end of a weaker decision does not lift a
+ * stronger one. Should the one held have set another aside, that other
+ * decision is not sent again, so the next pull fetches the full set.
+ */
+static void crowdsec_snapshot_apply(void *baton, int deleted,
+                                    const crowdsec_json_decision * jd)
+{
+    crowdsec_snapshot_t *snap = baton;
+    crowdsec_table_t *table;
+    crowdsec_entry_t entry;
+    crowdsec_ip_t ip;
+    apr_interval_time_t duration;
+    apr_time_t now = apr_time_now();
+    apr_uint32_t i, expiry, id = (apr_uint32_t) jd->id;
+    apr_byte_t type, shadows = 0;
+
+    if (!jd->value || !jd->scope) {
+        return;
+    }
+
+    snap->changes++;
+
+    if (jd->scope_len == 5 && !ap_cstr_casecmpn(jd->scope, "range", 5)) {
+
+        crowdsec_range_t *range;
+        apr_byte_t bits;
+
+        if (!crowdsec_prefix_parse(jd->value, jd->value_len, &ip, &bits)) {
+            return;
+        }
+
+        if (deleted) {
+            range = crowdsec_snapshot_range(snap, &ip, bits, 0);
+            if (range && range->state == CROWDSEC_SLOT_USED &&
+                range->id == id) {
+                snap->resync |= range->shadows;
+                crowdsec_snapshot_range_remove(snap, range);
+            }
+            return;
+        }
+
+        duration = crowdsec_parse_duration(jd->duration, jd->duration_len);
+        if (duration <= 0) {
+            return;
+        }
+
+        expiry = crowdsec_expiry_pack(snap->hdr, now + duration);
+        type = crowdsec_decision_parse(jd->type, jd->type_len);
+
+        range = crowdsec_snapshot_range(snap, &ip, bits, 1);
+        if (!range) {
+            snap->dropped++;
+            return;
+        }
+
+        if (range->state == CROWDSEC_SLOT_USED) {
+            shadows = range->shadows;
+            if (!crowdsec_snapshot_replaces(snap->hdr, type, expiry, id,
+                                            range->type, range->expiry,
+                                            range->id, &shadows, now)) {
+                range->shadows = shadows;
+                return;
+            }
+        }
+
+        if (range->state != CROWDSEC_SLOT_USED) {
+            snap->hdr->ranges_used++;
+            range->state = CROWDSEC_SLOT_USED;
+            crowdsec_filter_add(snap, &ip, bits);
+        }
+
+        range->expiry = expiry;
+        range->type = type;
+        range->origin = crowdsec_origin_parse(jd->origin, jd->origin_len);
+        range->id = id;
+        range->shadows = shadows;
+
+        return;
+    }
+
+    else {
+
+        crowdsec_scoped_t *sc;
+        apr_uint32_t value;
+        apr_byte_t scope;
+
+        if (crowdsec_scoped_parse(jd, &scope, &value)) {
+
+            sc = crowdsec_snapshot_scoped(snap, scope, value, !deleted);
+
+            if (deleted) {
+                if (sc && sc->state == CROWDSEC_SLOT_USED && sc->id == id) {
+                    snap->resync |= sc->shadows;
+                    sc->state = CROWDSEC_SLOT_DELETED;
+                    snap->hdr->scoped_used--;
+                }
+                return;
+            }
+
+            duration = crowdsec_parse_duration(jd->duration,
+                                               jd->duration_len);
+            if (duration <= 0) {
+                return;
+            }
+
+            if (!sc) {
+                snap->dropped++;
+                return;
+            }
+
+            expiry = crowdsec_expiry_pack(snap->hdr, now + duration);
+            type = crowdsec_decision_parse(jd->type, jd->type_len);
+
+            if (sc->state == CROWDSEC_SLOT_USED) {
+                shadows = sc->shadows;
+                if (!crowdsec_snapshot_replaces(snap->hdr, type, expiry, id,
+                                                sc->type, sc->expiry, sc->id,
+                                                &shadows, now)) {
+                    sc->shadows = shadows;
+                    return;
+                }
+            }
+
+            if (sc->state != CROWDSEC_SLOT_USED) {
+                snap->hdr->scoped_used++;
+                sc->state = CROWDSEC_SLOT_USED;
+            }
+
+            sc->expiry = expiry;
+            sc->type = type;
+            sc->origin = crowdsec_origin_parse(jd->origin, jd->origin_len);
+            sc->id = id;
+            sc->shadows = shadows;
+
+            return;
+        }
+
+    }
+
+    /* otherwise only decisions on individual addresses */
+    if (jd->scope_len != 2 || ap_cstr_casecmpn(jd->scope, "ip", 2) ||
+        !crowdsec_ip_parse(jd->value, jd->value_len, &ip)) {
+        return;
+    }
+
+    table = crowdsec_snapshot_table(snap, &ip);
+    i = crowdsec_table_find(table, &ip);
+
+    if (deleted) {
+        if (i != CROWDSEC_SLOT_NONE &&
+            table->states[i] == CROWDSEC_SLOT_USED &&
+            table->entries[i].id == id) {
+            snap->resync |= table->entries[i].shadows;
+            crowdsec_table_remove(snap, table, i);
+        }
+        return;
+    }
+
+    duration = crowdsec_parse_duration(jd->duration, jd->duration_len);
+    if (duration <= 0) {
+        return;
+    }
+
+    entry.expiry = crowdsec_expiry_pack(snap->hdr, now + duration);
+    entry.type = crowdsec_decision_parse(jd->type, jd->type_len);
+    entry.origin = crowdsec_origin_parse(jd->origin, jd->origin_len);
+    entry.id = id;
+    entry.shadows = 0;
+
+    if (i != CROWDSEC_SLOT_NONE && table->states[i] == CROWDSEC_SLOT_USED) {
+        crowdsec_entry_t *held = &table->entries[i];
+
+        entry.shadows = held->shadows;
+        if (!crowdsec_snapshot_replaces(snap->hdr, entry.type, entry.expiry,
+                                        entry.id, held->type, held->expiry,
+                                        held->id, &entry.shadows, now)) {
+            held->shadows = entry.shadows;
+            return;
+        }
+    }
+
+    if (i == CROWDSEC_SLOT_NONE || table->states[i] != CROWDSEC_SLOT_USED) {
+        apr_size_t t = table - snap->tables;
+
+        /* keep the table at most half full, making room if worth it */
+        if (snap->hdr->used[t] >= table->max || i == CROWDSEC_SLOT_NONE) {
+            i = crowdsec_table_evict(snap, table, &ip, &entry);
+            if (i == CROWDSEC_SLOT_NONE) {
+                snap->dropped++;
+                return;
+            }
+        }
+
+        if (table->states[i] == CROWDSEC_SLOT_DELETED) {
+            snap->hdr->deleted[t]--;
+        }
+        snap->hdr->used[t]++;
+
+        memcpy(table->keys + (apr_size_t) i * table->key_len, ip.addr,
+               table->key_len);
+        table->states[i] = CROWDSEC_SLOT_USED;
+        crowdsec_filter_add(snap, &ip, table->key_len * 8);
+    }
+
+    table->entries[i] = entry;
+}
+
+/*
+ * Mark the snapshot as being written. The sequence number is forced odd
+ * and moved on, even if an updater died halfway through a previous write.
+ */
+static apr_uint32_t crowdsec_snapshot_begin(crowdsec_snapshot_t * snap)
+{
+    apr_uint32_t seq = (apr_atomic_read32(&snap->hdr->seq) | 1) + 2;
+
+    apr_atomic_set32(&snap->hdr->seq, seq);
+    crowdsec_barrier();
+
+    return seq;
+}
+
+static void crowdsec_snapshot_end(crowdsec_snapshot_t * snap,
+                                  apr_uint32_t seq)
+{
+    crowdsec_barrier();
+    apr_atomic_set32(&snap->hdr->seq, seq + 1);
+}
+
+static void crowdsec_snapfile_init(crowdsec_snapfile_t * head,
+                                   const crowdsec_snapshot_t * snap)
+{
+    memset(head, 0, sizeof(crowdsec_snapfile_t));
+    head->magic = CROWDSEC_SNAPSHOT_MAGIC;
+    head->version = CROWDSEC_SNAPSHOT_VERSION;
+    head->v4_size = snap->tables[CROWDSEC_TABLE_IPV4].size;
+    head->v6_size = snap->tables[CROWDSEC_TABLE_IPV6].size;
+    head->max_ranges = snap->max_ranges;
+    head->max_nodes = snap->max_nodes;
+    head->max_scoped = snap->max_scoped;
+    head->filter_size = snap->filter_size;
+    head->hdr_len = sizeof(crowdsec_snapshot_hdr_t);
+    head->entry_len = sizeof(crowdsec_entry_t);
+    head->range_len = sizeof(crowdsec_range_t);
+    head->node_len = sizeof(crowdsec_node_t);
+    head->scoped_len = sizeof(crowdsec_scoped_t);
+    head->bucket_len = sizeof(crowdsec_bucket_t);
+}
+
+/*
+ * Write the addresses, states and decisions of each table.
+ */
+static apr_status_t crowdsec_snapfile_write_tables(apr_file_t * fd,
+        const crowdsec_snapshot_t * snap)
+{
+    apr_status_t status = APR_SUCCESS;
+    int t;
+
+    for (t = 0; t < CROWDSEC_TABLES && status == APR_SUCCESS; t++) {
+        const crowdsec_table_t *table = &snap->tables[t];
+
+        if ((status = apr_file_write_full(fd, table->keys,
+                                          (apr_size_t) table->size *
+                                          table->key_len,
+                                          NULL)) == APR_SUCCESS &&
+            (status = apr_file_write_full(fd, table->states, table->size,
+                                          NULL)) == APR_SUCCESS) {
+            status = apr_file_write_full(fd, table->entries,
+                                         table->size *
+                                         sizeof(crowdsec_entry_t), NULL);
+        }
+    }
+
+    return status;
+}
+
+static apr_status_t crowdsec_snapfile_read_tables(apr_file_t * fd,
+        crowdsec_snapshot_t * snap)
+{
+    apr_status_t status = APR_SUCCESS;
+    int t;
+
+    for (t = 0; t < CROWDSEC_TABLES && status == APR_SUCCESS; t++) {
+        crowdsec_table_t *table = &snap->tables[t];
+
+        if ((status = apr_file_read_full(fd, table->keys,
+                                         (apr_size_t) table->size *
+                                         table->key_len,
+                                         NULL)) == APR_SUCCESS &&
+            (status = apr_file_read_full(fd, table->states, table->size,
+                                         NULL)) == APR_SUCCESS) {
+            status = apr_file_read_full(fd, table->entries,
+                                        table->size *
+                                        sizeof(crowdsec_entry_t), NULL);
+        }
+    }
+
+    return status;
+}
+
+/*
+ * Save a published snapshot to the snapshot file.
+ *
+ * The file is written alongside and renamed into place, so that a child
+ * dying halfway never leaves a torn file behind.
+ */
+static apr_status_t crowdsec_snapshot_save(server_rec * s,
+                                           const crowdsec_snapshot_t * snap,
+                                           const char *fname, apr_pool_t * p)
+{
+    const char *tmp = apr_pstrcat(p, fname, ".tmp", NULL);
+    crowdsec_snapfile_t head;
+    crowdsec_snapshot_hdr_t hdr = *snap->hdr;
+    apr_file_t *fd;
+    apr_status_t status;
+
+    crowdsec_snapfile_init(&head, snap);
+    hdr.seq = 0;
+
+    status = apr_file_open(&fd, tmp, APR_FOPEN_WRITE | APR_FOPEN_CREATE |
+                           APR_FOPEN_TRUNCATE | APR_FOPEN_BUFFERED |
+                           APR_FOPEN_BINARY, APR_FPROT_OS_DEFAULT, p);
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                     "crowdsec: could not create snapshot file '%s'", tmp);
+        return status;
+    }
+
+    if ((status = apr_file_write_full(fd, &head, sizeof(head),
+                                      NULL)) == APR_SUCCESS &&
+        (status = apr_file_write_full(fd, &hdr, sizeof(hdr),
+                                      NULL)) == APR_SUCCESS &&
+        (status = crowdsec_snapfile_write_tables(fd, snap)) == APR_SUCCESS &&
+        (status = apr_file_write_full(fd, snap->ranges,
+                                      hdr.ranges_top *
+                                      sizeof(crowdsec_range_t),
+                                      NULL)) == APR_SUCCESS &&
+        (status = apr_file_write_full(fd, snap->nodes,
+                                      hdr.nodes_top *
+                                      sizeof(crowdsec_node_t),
+                                      NULL)) == APR_SUCCESS &&
+        (status = apr_file_write_full(fd, snap->scoped,
+                                      hdr.scoped_top *
+                                      sizeof(crowdsec_scoped_t),
+                                      NULL)) == APR_SUCCESS &&
+        (status = apr_file_write_full(fd, snap->filter,
+                                      snap->filter_size *
+                                      sizeof(crowdsec_bucket_t),
+                                      NULL)) == APR_SUCCESS) {
+        status = apr_file_flush(fd);
+    }
+
+    if (status == APR_SUCCESS) {
+        status = apr_file_close(fd);
+    }
+    else {
+        apr_file_close(fd);
+    }
+
+    if (status == APR_SUCCESS) {
+        status = apr_file_rename(tmp, fname, p);
+    }
+
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                     "crowdsec: could not write snapshot file '%s'", fname);
+        apr_file_remove(tmp, p);
+        return status;
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                 "crowdsec: saved %u address and %u range decisions to "
+                 "snapshot file '%s'", crowdsec_snapshot_used(&hdr),
+                 hdr.ranges_used, fname);
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Load a snapshot saved by crowdsec_snapshot_save into a snapshot not yet
+ * in use, so that requests are checked against the decisions we had
+ * before the restart while the first pull is under way.
+ *
+ * Returns zero if there is no usable file, leaving the snapshot empty.
+ */
+static int crowdsec_snapshot_load(server_rec * s, crowdsec_snapshot_t * snap,
+                                  const char *fname, apr_pool_t * p)
+{
+    crowdsec_snapfile_t head, want;
+    crowdsec_snapshot_hdr_t hdr;
+    apr_file_t *fd;
+    apr_status_t status;
+
+    status = apr_file_open(&fd, fname, APR_FOPEN_READ | APR_FOPEN_BUFFERED |
+                           APR_FOPEN_BINARY, APR_FPROT_OS_DEFAULT, p);
+    if (APR_STATUS_IS_ENOENT(status)) {
+        return 0;
+    }
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, status, s,
+                     "crowdsec: could not open snapshot file '%s', "
+                     "ignoring", fname);
+        return 0;
+    }
+
+    crowdsec_snapfile_init(&want, snap);
+
+    status = apr_file_read_full(fd, &head, sizeof(head), NULL);
+    if (status == APR_SUCCESS && memcmp(&head, &want, sizeof(head))) {
+        apr_file_close(fd);
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                     "crowdsec: snapshot file '%s' was written by another "
+                     "version or for another store size, ignoring", fname);
+        return 0;
+    }
+
+    if (status == APR_SUCCESS) {
+        status = apr_file_read_full(fd, &hdr, sizeof(hdr), NULL);
+    }
+
+    if (status == APR_SUCCESS &&
+        (hdr.used[CROWDSEC_TABLE_IPV4] >
+         snap->tables[CROWDSEC_TABLE_IPV4].max ||
+         hdr.used[CROWDSEC_TABLE_IPV6] >
+         snap->tables[CROWDSEC_TABLE_IPV6].max ||
+         hdr.ranges_top > snap->max_ranges ||
+         hdr.nodes_top < CROWDSEC_NODE_ROOTS ||
+         hdr.nodes_top > snap->max_nodes ||
+         hdr.scoped_top > snap->max_scoped || !hdr.updated)) {
+        status = APR_EGENERAL;
+    }
+
+    /* straight into the store, the layout is the same */
+    if ((status == APR_SUCCESS) &&
+        (status = crowdsec_snapfile_read_tables(fd, snap)) == APR_SUCCESS &&
+        (status = apr_file_read_full(fd, snap->ranges,
+                                     hdr.ranges_top *
+                                     sizeof(crowdsec_range_t),
+                                     NULL)) == APR_SUCCESS &&
+        (status = apr_file_read_full(fd, snap->nodes,
+                                     hdr.nodes_top *
+                                     sizeof(crowdsec_node_t),
+                                     NULL)) == APR_SUCCESS &&
+        (status = apr_file_read_full(fd, snap->scoped,
+                                     hdr.scoped_top *
+                                     sizeof(crowdsec_scoped_t),
+                                     NULL)) == APR_SUCCESS) {
+        status = apr_file_read_full(fd, snap->filter,
+                                    snap->filter_size *
+                                    sizeof(crowdsec_bucket_t), NULL);
+    }
+
+    apr_file_close(fd);
+
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, status, s,
+                     "crowdsec: snapshot file '%s' is truncated or corrupt, "
+                     "ignoring", fname);
+        crowdsec_snapshot_clear(snap);
+        return 0;
+    }
+
+    hdr.seq = 0;
+    *snap->hdr = hdr;
+
+    return 1;
+}
+
+static int crowdsec_geo_enabled(const crowdsec_server_rec * sconf)
+{
+#ifdef HAVE_MAXMINDDB
+    return sconf->geo && sconf->geo->nelts;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Find the country and the AS of the client address in the GeoIP
+ * databases. Either is left at zero if not known.
+ */
+static void crowdsec_geo_lookup(const crowdsec_server_rec * sconf,
+                                const apr_sockaddr_t * sa,
+                                apr_uint32_t * country, apr_uint32_t * asn)
+{
+#ifdef HAVE_MAXMINDDB
+    int i;
+
+    for (i = 0; i < sconf->geo->nelts; i++) {
+
+        MMDB_s *mmdb = &APR_ARRAY_IDX(sconf->geo, i, MMDB_s);
+        MMDB_lookup_result_s result;
+        MMDB_entry_data_s data;
+        int error;
+
+        result = MMDB_lookup_sockaddr(mmdb,
+                                      (const struct sockaddr *)
+                                      &sa->sa, &error);
+        if (error != MMDB_SUCCESS || !result.found_entry) {
+            continue;
+        }
+
+        if (!*country &&
+            MMDB_get_value(&result.entry, &data, "country", "iso_code",
+                           NULL) == MMDB_SUCCESS && data.has_data &&
+            data.type == MMDB_DATA_TYPE_UTF8_STRING && data.data_size == 2) {
+            *country = (apr_toupper(data.utf8_string[0]) << 8) |
+                apr_toupper(data.utf8_string[1]);
+        }
+
+        if (!*asn &&
+            MMDB_get_value(&result.entry, &data, "autonomous_system_number",
+                           NULL) == MMDB_SUCCESS && data.has_data &&
+            data.type == MMDB_DATA_TYPE_UINT32) {
+            *asn = data.uint32;
+        }
+
+    }
+#endif
+}
+
+/*
+ * Is the endpoint answering? An endpoint is taken out of the running
+ * once CROWDSEC_ENDPOINT_FAILURES lookups in a row have failed, after
+ * which a single lookup across all children is let through every
+ * CrowdsecCircuitRetry to find out whether it has recovered.
+ */
+static int crowdsec_endpoint_up(const crowdsec_server_rec * sconf,
+                                crowdsec_endpoint_t * ep, int probe)
+{
+    apr_uint32_t now, probed;
+
+    if (apr_atomic_read32(&ep->state->failures) < CROWDSEC_ENDPOINT_FAILURES) {
+        return 1;
+    }
+
+    if (!probe) {
+        return 0;
+    }
+
+    now = (apr_uint32_t) apr_time_sec(apr_time_now());
+    probed = apr_atomic_read32(&ep->state->probed);
+
+    return now - probed >= (apr_uint32_t) apr_time_sec(sconf->breaker_retry)
+        && apr_atomic_cas32(&ep->state->probed, now, probed) == probed;
+}
+
+/*
+ * Choose the CrowdsecURL to send a lookup to: the preferred endpoint for
+ * as long as it answers, otherwise an endpoint due a probe, otherwise the
+ * answering endpoint with the fewest lookups in progress across all
+ * children. Returns NULL if none is answering.
+ */
+static crowdsec_endpoint_t *crowdsec_endpoint_pick(crowdsec_server_rec *
+                                                   sconf,
+                                                   crowdsec_endpoint_t *
+                                                   prefer,
+                                                   const crowdsec_endpoint_t
+                                                   * exclude)
+{
+    crowdsec_endpoint_t *eps, *best = NULL;
+    apr_uint32_t least = 0, start;
+    int i, n;
+
+    if (!sconf->endpoints) {
+        return NULL;
+    }
+
+    eps = (crowdsec_endpoint_t *) sconf->endpoints->elts;
+    n = sconf->endpoints->nelts;
+
+    if (n == 1) {
+        /* with nowhere else to go, the circuit breaker decides */
+        return exclude == eps ? NULL : eps;
+    }
+
+    if (prefer && prefer != exclude && crowdsec_endpoint_up(sconf, prefer, 0)) {
+        return prefer;
+    }
+
+    /* spread the ties across the endpoints */
+    start = apr_atomic_inc32(&sconf->endpoint_next);
+
+    for (i = 0; i < n; i++) {
+        crowdsec_endpoint_t *ep = &eps[(start + i) % n];
+
+        if (ep != exclude && !crowdsec_endpoint_up(sconf, ep, 0) &&
+            crowdsec_endpoint_up(sconf, ep, 1)) {
+            return ep;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        crowdsec_endpoint_t *ep = &eps[(start + i) % n];
+        apr_uint32_t outstanding;
+
+        if (ep == exclude || !crowdsec_endpoint_up(sconf, ep, 0)) {
+            continue;
+        }
+
+        outstanding = apr_atomic_read32(&ep->state->outstanding);
+        if (!best || outstanding < least) {
+            best = ep;
+            least = outstanding;
+        }
+    }
+
+    return best;
+}
+
+static void crowdsec_endpoint_success(server_rec * s,
+                                      crowdsec_endpoint_t * ep)
+{
+    if (apr_atomic_read32(&ep->state->failures) &&
+        apr_atomic_xchg32(&ep->state->failures, 0) >=
+        CROWDSEC_ENDPOINT_FAILURES) {
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
+                     "crowdsec: crowdsec service '%s' is answering again, "
+                     "lookups resumed", ep->url);
+    }
+}
+
+static void crowdsec_endpoint_failure(server_rec * s,
+                                      crowdsec_endpoint_t * ep)
+{
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(s->module_config,
+                             &crowdsec_module);
+
+    if (sconf->endpoints->nelts < 2) {
+        return;
+    }
+
+    if (apr_atomic_inc32(&ep->state->failures) + 1 ==
+        CROWDSEC_ENDPOINT_FAILURES) {
+        apr_atomic_set32(&ep->state->probed,
+                         (apr_uint32_t) apr_time_sec(apr_time_now()));
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "crowdsec: %d lookups in a row to crowdsec service "
+                     "'%s' failed, lookups sent elsewhere",
+                     CROWDSEC_ENDPOINT_FAILURES, ep->url);
+    }
+}
+
+/*
+ * Point the connection at the endpoint, closing it should it be open to
+ * another. Returns non zero if the connection was moved.
+ */
+static int crowdsec_conn_target(crowdsec_conn_t * conn,
+                                crowdsec_endpoint_t * ep)
+{
+    int moved = conn->endpoint && conn->endpoint != ep;
+
+    if (conn->endpoint != ep) {
+        crowdsec_conn_close(conn);
+        conn->endpoint = ep;
+    }
+
+    return moved;
+}
+
+/*
+ * Pull the decisions from the crowdsec service, and apply them to the
+ * decision table. The first pull asks for the full set of decisions, later
+ * pulls return what has changed since.
+ */
+static apr_status_t crowdsec_stream_pull(server_rec * s, apr_pool_t * p)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(s->module_config,
+                             &crowdsec_module);
+
+    crowdsec_store_t *store = sconf->store;
+    crowdsec_snapshot_t *active, *next;
+    crowdsec_endpoint_t *ep;
+
+    crowdsec_json js;
+    apr_uint32_t index, seq;
+    int code = 0, startup;
+    apr_status_t status;
+
+    if (!store) {
+        return APR_SUCCESS;
+    }
+
+    crowdsec_count(pulls);
+
+    ep = crowdsec_endpoint_pick(sconf, sconf->stream_conn->endpoint, NULL);
+    if (!ep) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "crowdsec: no crowdsec service available to pull "
+                     "decisions from");
+        crowdsec_count(pull_failures);
+        return APR_EGENERAL;
+    }
+
+    /* the stream position belongs to the service, start over on another */
+    if (crowdsec_conn_target(sconf->stream_conn, ep)) {
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
+                     "crowdsec: pulling decisions from '%s' from now on",
+                     ep->url);
+        apr_atomic_set32(&store->hdr->resync, 1);
+    }
+
+    /* only the updater writes to the store, no need to be careful here */
+    index = apr_atomic_read32(&store->hdr->active);
+    active = &store->snap[index];
+    next = &store->snap[!index];
+
+    startup = !active->hdr->updated || apr_atomic_read32(&store->hdr->resync);
+
+    /*
+     * The decisions are parsed straight into the next snapshot as they
+     * arrive, which readers do not look at until it is published.
+     */
+    seq = crowdsec_snapshot_begin(next);
+    next->changes = 0;
+    next->evicted = 0;
+    next->dropped = 0;
+    next->resync = 0;
+
+    if (startup) {
+        crowdsec_snapshot_clear(next);
+    }
+    else {
+        crowdsec_snapshot_copy(next, active);
+    }
+
+    crowdsec_json_init(&js, 1, crowdsec_snapshot_apply, next);
+
+    status = crowdsec_http_get(s, sconf->stream_conn, p,
+                               CROWDSEC_STREAM_TIMEOUT,
+                               apr_pstrcat(p, "/v1/decisions/stream?",
+                                           startup ? "startup=true&" : "",
+                                           "scopes=ip,range",
+                                           crowdsec_geo_enabled(sconf) ?
+                                           ",country,as" : "", NULL),
+                               &code, crowdsec_json_body, &js);
+
+    if (code == HTTP_OK &&
+        (status != APR_SUCCESS || !crowdsec_json_finish(&js))) {
+
+        /* the delta is lost, start from scratch next time around */
+        apr_atomic_set32(&store->hdr->resync, 1);
+        crowdsec_snapshot_end(next, seq);
+
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                     "crowdsec: could not read decisions from '%s'",
+                     ep->url);
+        crowdsec_endpoint_failure(s, ep);
+        crowdsec_count(pull_failures);
+        return status != APR_SUCCESS ? status : APR_EGENERAL;
+    }
+
+    if (status != APR_SUCCESS) {
+        crowdsec_snapshot_end(next, seq);
+
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                     "crowdsec: could not pull decisions from '%s'",
+                     ep->url);
+        crowdsec_endpoint_failure(s, ep);
+        crowdsec_count(pull_failures);
+        return status;
+    }
+
+    if (code != HTTP_OK) {
+        crowdsec_snapshot_end(next, seq);
+
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "crowdsec: crowdsec service '%s' returned %d while "
+                     "pulling decisions", ep->url, code);
+        crowdsec_endpoint_failure(s, ep);
+        crowdsec_count(pull_failures);
+        return APR_EGENERAL;
+    }
+
+    crowdsec_endpoint_success(s, ep);
+
+    crowdsec_snapshot_expire(next, apr_time_now());
+
+    next->hdr->updated = apr_time_now();
+
+    crowdsec_snapshot_end(next, seq);
+
+    /* publish */
+    apr_atomic_set32(&store->hdr->active, !index);
+    apr_atomic_set32(&store->hdr->resync, next->resync);
+
+    if (next->resync) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                     "crowdsec: a decision lifted from '%s' may have "
+                     "uncovered another, pulling all decisions next",
+                     ep->url);
+    }
+
+    /* only once readers can see it, so that no verdict outlives it */
+    if (startup || next->changes) {
+        apr_atomic_inc32(&store->hdr->generation);
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                 "crowdsec: pulled decisions from '%s', %u address and "
+                 "%u range decisions active", ep->url,
+                 crowdsec_snapshot_used(next->hdr), next->hdr->ranges_used);
+
+    if (next->evicted || next->dropped) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                     "crowdsec: decision store full, %u decisions evicted "
+                     "and %u dropped, consider raising "
+                     "CrowdsecDecisionStoreSize", next->evicted,
+                     next->dropped);
+        if (crowdsec_metrics) {
+            apr_atomic_add32(&crowdsec_metrics->store_evicted,
+                             next->evicted);
+            apr_atomic_add32(&crowdsec_metrics->store_dropped,
+                             next->dropped);
+        }
+    }
+
+    if (startup || next->changes) {
+        sconf->stream_snapshot_dirty = 1;
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Save the active snapshot to the snapshot file if it has changed, and
+ * if it was not saved too recently.
+ */
+static void crowdsec_stream_save(server_rec * s, apr_pool_t * p, int force)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(s->module_config,
+                             &crowdsec_module);
+
+    crowdsec_store_t *store = sconf->store;
+    apr_time_t now = apr_time_now();
+
+    if (!store || !sconf->stream_snapshot || !sconf->stream_snapshot_dirty) {
+        return;
+    }
+
+    if (!force && now - sconf->stream_snapshot_saved <
+        CROWDSEC_SNAPSHOT_INTERVAL) {
+        return;
+    }
+
+    /* only the updater writes to the store, the active snapshot is stable */
+    if (crowdsec_snapshot_save(s,
+                               &store->snap[apr_atomic_read32
+                                            (&store->hdr->active)],
+                               sconf->stream_snapshot, p) == APR_SUCCESS) {
+        sconf->stream_snapshot_dirty = 0;
+    }
+
+    /* a failure is not retried at once, the disk is unlikely to recover */
+    sconf->stream_snapshot_saved = now;
+}
+
+static apr_status_t crowdsec_watchdog_callback(int state, void *data,
+                                               apr_pool_t * pool)
+{
+    server_rec *s = data;
+
+    switch (state) {
+    case AP_WATCHDOG_STATE_STARTING:
+    case AP_WATCHDOG_STATE_RUNNING:
+        crowdsec_stream_pull(s, pool);
+        crowdsec_stream_save(s, pool, 0);
+        break;
+    case AP_WATCHDOG_STATE_STOPPING:
+        crowdsec_stream_save(s, pool, 1);
+        break;
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Look up the address in the decision store of the server, as it stands
+ * at the given time, without taking any lock.
+ *
+ * Returns zero if the decision store has not yet been loaded.
+ */
+static int crowdsec_store_find(const crowdsec_server_rec * sconf,
+                               const apr_sockaddr_t * sa, apr_time_t now,
+                               crowdsec_verdict_t * verdict)
+{
+
+    crowdsec_store_t *store = sconf->store;
+    crowdsec_ip_t ip;
+    apr_uint32_t country = 0, asn = 0;
+
+    int ready, maybe, geo = 0;
+
+    if (!store || !crowdsec_ip_from_addr(sa, &ip)) {
+        return 0;
+    }
+
+    for (;;) {
+
+        crowdsec_snapshot_t *snap;
+        crowdsec_table_t *table;
+        apr_uint32_t seq, i = CROWDSEC_SLOT_NONE;
+
+        snap = &store->snap[apr_atomic_read32(&store->hdr->active) & 1];
+
+        seq = apr_atomic_read32(&snap->hdr->seq);
+        if (seq & 1) {
+            /* the updater has moved on to this snapshot already */
+            continue;
+        }
+        crowdsec_barrier();
+
+        ready = snap->hdr->updated != 0;
+
+        memset(verdict, 0, sizeof(crowdsec_verdict_t));
+        verdict->version = CROWDSEC_VERDICT_VERSION;
+
+        /* most addresses have no decision, and stop here */
+        maybe = crowdsec_filter_maybe(snap, &ip);
+
+        table = crowdsec_snapshot_table(snap, &ip);
+        if (maybe) {
+            i = crowdsec_table_find(table, &ip);
+        }
+
+        if (i != CROWDSEC_SLOT_NONE &&
+            table->states[i] == CROWDSEC_SLOT_USED) {
+            const crowdsec_entry_t *entry = &table->entries[i];
+            apr_time_t until = crowdsec_expiry_time(snap->hdr,
+                                                    entry->expiry);
+
+            if (until > now) {
+                verdict->type = entry->type;
+                verdict->origin = entry->origin;
+                verdict->id = entry->id;
+                verdict->until = until;
+            }
+        }
+
+        if (snap->hdr->scoped_used && crowdsec_geo_enabled(sconf)) {
+            const crowdsec_scoped_t *sc;
+
+            if (!geo) {
+                /* only once, even if we have to go around again */
+                crowdsec_geo_lookup(sconf, sa, &country, &asn);
+                geo = 1;
+            }
+
+            sc = crowdsec_snapshot_scoped_match(snap, country, asn, now);
+
+            if (sc && sc->type > verdict->type) {
+                verdict->type = sc->type;
+                verdict->origin = sc->origin;
+                verdict->id = sc->id;
+                verdict->until = crowdsec_expiry_time(snap->hdr,
+                                                      sc->expiry);
+            }
+        }
+
+        if (maybe && snap->hdr->ranges_used) {
+            const crowdsec_range_t *range;
+
+            range = crowdsec_snapshot_match(snap, &ip, now);
+
+            if (range && range->type > verdict->type) {
+                verdict->type = range->type;
+                verdict->origin = range->origin;
+                verdict->id = range->id;
+                verdict->until = crowdsec_expiry_time(snap->hdr,
+                                                      range->expiry);
+            }
+        }
+
+        crowdsec_barrier();
+        if (apr_atomic_read32(&snap->hdr->seq) == seq) {
+            break;
+        }
+
+    }
+
+    if (verdict->type > CROWDSEC_DECISION_BAN) {
+        verdict->type = CROWDSEC_DECISION_BAN;
+    }
+
+    return ready;
+}
+
+/*
+ * Look up the client of the request in the decision store.
+ */
+static int crowdsec_store_lookup(request_rec * r, crowdsec_verdict_t * verdict)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(r->server->module_config,
+                             &crowdsec_module);
+
+    return crowdsec_store_find(sconf, r->useragent_addr, r->request_time,
+                               verdict);
+}
+
+/*
+ * May we talk to the crowdsec service? While the circuit is open, only
+ * one lookup across all children is let through every
+ * CrowdsecCircuitRetry, to find out whether the service has recovered.
+ */
+static int crowdsec_breaker_allow(crowdsec_server_rec * sconf)
+{
+    crowdsec_breaker_t *breaker = sconf->breaker;
+    apr_uint32_t now, probed;
+
+    if (!breaker || apr_atomic_read32(&breaker->failures) <
+        (apr_uint32_t) sconf->breaker_failures) {
+        return 1;
+    }
+
+    now = (apr_uint32_t) apr_time_sec(apr_time_now());
+    probed = apr_atomic_read32(&breaker->probed);
+
+    return now - probed >= (apr_uint32_t) apr_time_sec(sconf->breaker_retry)
+        && apr_atomic_cas32(&breaker->probed, now, probed) == probed;
+}
+
+static int crowdsec_breaker_open(crowdsec_server_rec * sconf)
+{
+    return sconf->breaker && apr_atomic_read32(&sconf->breaker->failures) >=
+        (apr_uint32_t) sconf->breaker_failures;
+}
+
+static void crowdsec_breaker_success(server_rec * s)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(s->module_config,
+                             &crowdsec_module);
+
+    if (!sconf->breaker) {
+        return;
+    }
+
+    if (apr_atomic_read32(&sconf->breaker->failures) &&
+        apr_atomic_xchg32(&sconf->breaker->failures, 0) >=
+        (apr_uint32_t) sconf->breaker_failures) {
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
+                     "crowdsec: crowdsec service '%s' is answering again, "
+                     "circuit closed", sconf->url);
+    }
+
+}
+
+static void crowdsec_breaker_failure(server_rec * s)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(s->module_config,
+                             &crowdsec_module);
+
+    if (!sconf->breaker) {
+        return;
+    }
+
+    if (apr_atomic_inc32(&sconf->breaker->failures) + 1 ==
+        (apr_uint32_t) sconf->breaker_failures) {
+        apr_atomic_set32(&sconf->breaker->probed,
+                         (apr_uint32_t) apr_time_sec(apr_time_now()));
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "crowdsec: %d lookups in a row to crowdsec service "
+                     "'%s' failed, circuit opened", sconf->breaker_failures,
+                     sconf->url);
+    }
+
+}
+
+/*
+ * Keep the expired verdict found in the cache for this request, in case
+ * the crowdsec service does not answer.
+ */
+static void crowdsec_keep_stale(request_rec * r,
+                                const crowdsec_verdict_t * verdict)
+{
+    ap_set_module_config(r->request_config, &crowdsec_module,
+                         apr_pmemdup(r->pool, verdict,
+                                     sizeof(crowdsec_verdict_t)));
+}
+
+/*
+ * Serve the expired verdict kept for this request, if there is one.
+ */
+static int crowdsec_serve_stale(request_rec * r, int status,
+                                crowdsec_verdict_t * verdict)
+{
+    const crowdsec_verdict_t *stale = (const crowdsec_verdict_t *)
+        ap_get_module_config(r->request_config, &crowdsec_module);
+
+    if (!stale) {
+        return 0;
+    }
+
+    *verdict = *stale;
+
+    /* the decision may have run out since */
+    if (verdict->until && verdict->until <= r->request_time) {
+        verdict->type = CROWDSEC_DECISION_NONE;
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, r,
+                  "crowdsec: crowdsec service returned status %d, expired "
+                  "verdict for %s served: %s", status, r->useragent_ip,
+                  r->uri);
+
+    apr_table_setn(r->notes, "crowdsec-stale", apr_itoa(r->pool, status));
+
+    crowdsec_count(stale);
+
+    return 1;
+}
+
+/*
+ * Did a lookup fail recently enough that the service is best left alone?
+ */
+static int crowdsec_unhealthy(crowdsec_server_rec * sconf)
+{
+    apr_uint32_t failed = apr_atomic_read32(&sconf->failed);
+
+    if (crowdsec_breaker_open(sconf)) {
+        return 1;
+    }
+
+    return failed &&
+        (apr_uint32_t) apr_time_sec(apr_time_now()) - failed <
+        CROWDSEC_STALE_RETRY;
+}
+
+/*
+ * The crowdsec service could not give us an answer. Serve an expired
+ * verdict if we have one, otherwise apply the CrowdsecFallback behaviour.
+ */
+static int crowdsec_apply_fallback(request_rec * r, const char *target,
+                                   int status, crowdsec_verdict_t * verdict)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(r->server->module_config,
+                             &crowdsec_module);
+
+    crowdsec_config_rec *conf = (crowdsec_config_rec *)
+        ap_get_module_config(r->per_dir_config,
+                             &crowdsec_module);
+
+    apr_atomic_set32(&sconf->failed,
+                     (apr_uint32_t) apr_time_sec(apr_time_now()));
+
+    if (crowdsec_serve_stale(r, status, verdict)) {
+        return OK;
+    }
+
+    crowdsec_count(fallbacks);
+
+    switch (conf->fallback) {
+    case CROWDSEC_FAIL: {
+
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_SUCCESS, r,
+                      "crowdsec: crowdsec service '%s' returned status %d, "
+                      "request failed: %s", target, status, r->uri);
+
+        apr_table_setn(r->notes, "error-notes",
+                       "Could not verify the request against the threat intelligence "
+                       "service, the request has been rejected.");
+
+        /* Allow "error-notes" string to be printed by ap_send_error_response() */
+        apr_table_setn(r->notes, "verbose-error-to", "*");
+
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    case CROWDSEC_BLOCK: {
+
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_SUCCESS, r,
+                      "crowdsec: crowdsec service '%s' returned status %d, "
+                      "request blocked: %s", target, status, r->uri);
+
+        memset(verdict, 0, sizeof(crowdsec_verdict_t));
+        verdict->version = CROWDSEC_VERDICT_VERSION;
+        verdict->type = CROWDSEC_DECISION_BAN;
+
+        return OK;
+    }
+    case CROWDSEC_ALLOW: {
+
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_SUCCESS, r,
+                      "crowdsec: crowdsec service '%s' returned status %d, "
+                      "request accepted anyway: %s", target, status, r->uri);
+
+        memset(verdict, 0, sizeof(crowdsec_verdict_t));
+        verdict->version = CROWDSEC_VERDICT_VERSION;
+
+        return OK;
+    }
+    }
+
+    return HTTP_INTERNAL_SERVER_ERROR;
+}
+
+static int crowdsec_proxy(request_rec * r, crowdsec_verdict_t * verdict)
+{
+
+    request_rec *rr;
+    int status;
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(r->server->module_config,
+                             &crowdsec_module);
+
+    crowdsec_capture_t *cap;
+    crowdsec_endpoint_t *ep;
+    const char *target;
+
+    /*
+     * Using mod_proxy, we connect to the crowdsec API.
+     *
+     * To do this, we create a subrequest, and then disassociate
+     * the subrequest from the main request so that no part of
+     * the crowdsec response ends up in the main response.
+     *
+     * We then replace the input filter stack with a null filter
+     * so that no attempt is made to read from the main request,
+     * and finally we replace the output filter stack with a
+     * filter that reads and parses the response from the API.
+     */
+
+    ep = crowdsec_endpoint_pick(sconf, NULL, NULL);
+    if (!ep) {
+        return crowdsec_apply_fallback(r, sconf->url,
+                                       HTTP_SERVICE_UNAVAILABLE, verdict);
+    }
+
+    target = apr_pstrcat(r->pool, ep->url, "/v1/decisions?ip=",
+                         ap_escape_urlencoded(r->pool, r->useragent_ip),
+                         NULL);
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
+                  "crowdsec: looking up IP '%s' at url: %s",
+                  r->useragent_ip, target);
+
+    /* create a proxy request */
+    rr = ap_sub_req_method_uri("GET", r->uri, r, NULL);
+
+    if (rr->status != HTTP_OK) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_SUCCESS, r,
+                      "crowdsec: service '%s' returned %d, request rejected: %s",
+                      target, rr->status, r->uri);
+        return rr->status;
+    }
+
+    /* disassociate the subrequest from the main request */
+    rr->main = NULL;
+    rr->output_filters = NULL;
+    memset(verdict, 0, sizeof(crowdsec_verdict_t));
+    verdict->version = CROWDSEC_VERDICT_VERSION;
+
+    cap = apr_pcalloc(r->pool, sizeof(crowdsec_capture_t));
+    crowdsec_json_init(&cap->js, 0, crowdsec_verdict_apply, verdict);
+    ap_add_output_filter("CROWDSEC", cap, rr, r->connection);
+
+    /* Make sure that proxy cannot touch our main request body */
+    rr->input_filters = NULL;
+    ap_add_input_filter("CROWDSEC_NULL", NULL, rr, r->connection);
+
+    /* headers and trailers */
+    rr->headers_in = apr_table_make(r->pool, 2);
+    rr->trailers_in = apr_table_make(r->pool, 2);
+    rr->headers_out = apr_table_make(r->pool, 2);
+    rr->trailers_out = apr_table_make(r->pool, 2);
+
+    /* emulate the function of proxy_detect so that a remote proxy request
+     * will be attempted */
+    rr->proxyreq = PROXYREQ_REVERSE;
+    rr->uri = rr->unparsed_uri;
+    rr->filename = apr_pstrcat(rr->pool, "proxy:", target, NULL);
+    rr->handler = "proxy-server";
+
+    if (sconf->key) {
+        apr_table_setn(rr->headers_in, "X-Api-Key", sconf->key);
+    }
+
+    apr_table_setn(rr->headers_in, "User-Agent", ap_get_server_description());
+
+    apr_atomic_inc32(&ep->state->outstanding);
+    status = ap_run_sub_req(rr);
+    apr_atomic_dec32(&ep->state->outstanding);
+
+    if (HTTP_NOT_FOUND == status) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_SUCCESS, r,
+                      "crowdsec: we received a 404 Not Found when speaking "
+                      "to the crowdsec service '%s', you might be pointing at "
+                      "something that isn't a crowdsec service, or the "
+                      "mod_proxy_http module has not been installed, request "
+                      "rejected: %s", target, r->uri);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    else if ((status)) {
+        crowdsec_endpoint_failure(r->server, ep);
+        crowdsec_breaker_failure(r->server);
+        return crowdsec_apply_fallback(r, target, status, verdict);
+    }
+
+    if (!cap->eos && !cap->len) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_SUCCESS, r,
+                      "crowdsec: response from crowdsec service '%s' was not recorded, "
+                      "request rejected: %s", target, r->uri);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (cap->invalid || !crowdsec_json_finish(&cap->js)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_SUCCESS, r,
+                      "crowdsec: response from crowdsec service '%s' could "
+                      "not be parsed: %s", target, r->uri);
+        crowdsec_endpoint_failure(r->server, ep);
+        crowdsec_breaker_failure(r->server);
+        return crowdsec_apply_fallback(r, target, HTTP_OK, verdict);
+    }
+
+    crowdsec_endpoint_success(r->server, ep);
+    crowdsec_breaker_success(r->server);
+
+    return OK;
+}
+
+#if APR_HAS_THREADS
+static apr_status_t crowdsec_conn_construct(void **resource, void *params,
+                                            apr_pool_t * pool)
+{
+    crowdsec_conn_t *conn = crowdsec_conn_create(pool);
+
+    if (!conn) {
+        return APR_ENOMEM;
+    }
+
+    conn->endpoint = params;
+    *resource = conn;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t crowdsec_conn_destruct(void *resource, void *params,
+                                           apr_pool_t * pool)
+{
+    crowdsec_conn_t *conn = resource;
+
+    crowdsec_conn_close(conn);
+    apr_pool_destroy(conn->pool);
+
+    return APR_SUCCESS;
+}
+#endif
+
+/*
+ * Take a kept alive connection to the endpoint. Returns OK, the status
+ * CrowdsecFallback should be applied with, or DECLINED if the builtin
+ * client was not initialised.
+ */
+static int crowdsec_endpoint_acquire(server_rec * s, crowdsec_endpoint_t * ep,
+                                     crowdsec_conn_t ** conn)
+{
+    *conn = ep->conn;
+
+#if APR_HAS_THREADS
+    if (ep->conns) {
+        apr_status_t status = apr_reslist_acquire(ep->conns, (void **) conn);
+
+        if (status != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                         "crowdsec: no connection available to crowdsec "
+                         "service '%s'", ep->url);
+            return HTTP_SERVICE_UNAVAILABLE;
+        }
+    }
+#endif
+
+    if (!*conn) {
+        return DECLINED;
+    }
+
+    apr_atomic_inc32(&ep->state->outstanding);
+
+    return OK;
+}
+
+static void crowdsec_endpoint_release(crowdsec_endpoint_t * ep,
+                                      crowdsec_conn_t * conn)
+{
+    apr_atomic_dec32(&ep->state->outstanding);
+
+#if APR_HAS_THREADS
+    if (ep->conns) {
+        apr_reslist_release(ep->conns, conn);
+    }
+#endif
+}
+
+/*
+ * How long to wait on the first endpoint before asking another as well,
+ * or zero not to. By percentile, this is the upper bound of the bucket
+ * of the lookup latency histogram the percentile falls in. A budget that
+ * leaves nothing of CrowdsecTimeout for the second endpoint is no budget.
+ */
+static apr_interval_time_t crowdsec_hedge_budget(const crowdsec_server_rec *
+                                                 sconf)
+{
+    crowdsec_metrics_t m;
+    apr_uint32_t total = 0, want, seen = 0;
+    apr_size_t i;
+
+    if (sconf->endpoints->nelts < 2) {
+        return 0;
+    }
+
+    if (!sconf->hedge_percentile) {
+        return sconf->hedge;
+    }
+
+    if (!crowdsec_metrics) {
+        return 0;
+    }
+
+    for (i = 0; i <= CROWDSEC_LATENCY_BUCKETS; i++) {
+        m.latency[i] = apr_atomic_read32(&crowdsec_metrics->latency[i]);
+        total += m.latency[i];
+    }
+
+    if (total < CROWDSEC_HEDGE_SAMPLES) {
+        return 0;
+    }
+
+    want = (apr_uint32_t) ((apr_uint64_t) total * sconf->hedge_percentile /
+                           100);
+
+    for (i = 0; i < CROWDSEC_LATENCY_BUCKETS; i++) {
+        seen += m.latency[i];
+        if (seen >= want) {
+            return crowdsec_latency_bounds[i] < sconf->timeout ?
+                crowdsec_latency_bounds[i] : 0;
+        }
+    }
+
+    /* slower than the histogram tells apart, hedging would not help */
+    return 0;
+}
+
+/*
+ * Wait for either connection to have the response ready to read, for no
+ * longer than the timeout. Returns the connection, or NULL on timeout.
+ */
+static crowdsec_conn_t *crowdsec_conn_wait(crowdsec_conn_t ** conns, int n,
+                                           apr_interval_time_t timeout)
+{
+    apr_pollfd_t pfd[2];
+    apr_int32_t nsds = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (conns[i]->pos < conns[i]->len) {
+            return conns[i];
+        }
+        memset(&pfd[i], 0, sizeof(apr_pollfd_t));
+        pfd[i].p = conns[i]->pool;
+        pfd[i].desc_type = APR_POLL_SOCKET;
+        pfd[i].reqevents = APR_POLLIN;
+        pfd[i].desc.s = conns[i]->sock;
+        pfd[i].client_data = conns[i];
+    }
+
+    if (apr_poll(pfd, n, &nsds, timeout) != APR_SUCCESS || !nsds) {
+        return NULL;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (pfd[i].rtnevents) {
+            return pfd[i].client_data;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Look up the address at the endpoint. Should the endpoint not start to
+ * answer within the CrowdsecHedge budget, the lookup is sent to another
+ * endpoint too, and whichever answers first is read. The other connection
+ * is closed, its answer unread.
+ *
+ * Returns OK, or the status CrowdsecFallback should be applied with.
+ */
+static int crowdsec_endpoint_query(server_rec * s, apr_pool_t * p,
+                                   crowdsec_endpoint_t * ep,
+                                   const char *path, const char *ip,
+                                   crowdsec_verdict_t * verdict)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(s->module_config,
+                             &crowdsec_module);
+
+    crowdsec_endpoint_t *eps[2];
+    crowdsec_conn_t *conns[2], *conn;
+    crowdsec_json js;
+    const char *target;
+    apr_interval_time_t hedge;
+    int code = 0, n = 1, i, rv;
+    apr_status_t status;
+
+    target = apr_pstrcat(p, ep->url, path, NULL);
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, s,
+                 "crowdsec: looking up IP '%s' at url: %s", ip, target);
+
+    rv = crowdsec_endpoint_acquire(s, ep, &conns[0]);
+    if (rv != OK) {
+        return rv;
+    }
+    eps[0] = ep;
+    conn = conns[0];
+
+    memset(verdict, 0, sizeof(crowdsec_verdict_t));
+    verdict->version = CROWDSEC_VERDICT_VERSION;
+
+    crowdsec_json_init(&js, 0, crowdsec_verdict_apply, verdict);
+
+    hedge = crowdsec_hedge_budget(sconf);
+
+    if (!hedge) {
+        status = crowdsec_http_get(s, conn, p, sconf->timeout,
+                                   path, &code, crowdsec_json_body, &js);
+    }
+    else {
+
+        const char *req = crowdsec_http_request(s, p, ep, path);
+        int reused = conn->sock && conn->requests > 0;
+
+        status = crowdsec_http_start(s, conn, sconf->timeout, req,
+                                     strlen(req));
+
+        if (status == APR_SUCCESS && !crowdsec_conn_wait(conns, 1, hedge) &&
+            (eps[1] = crowdsec_endpoint_pick(sconf, NULL, ep)) &&
+            crowdsec_endpoint_acquire(s, eps[1], &conns[1]) == OK) {
+
+            n = 2;
+            crowdsec_count(hedges);
+
+            req = crowdsec_http_request(s, p, eps[1], path);
+
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, s,
+                         "crowdsec: no answer from '%s' within %"
+                         APR_TIME_T_FMT "ms, asking '%s' too", ep->url,
+                         apr_time_as_msec(hedge), eps[1]->url);
+
+            if (crowdsec_http_start(s, conns[1], sconf->timeout, req,
+                                    strlen(req)) == APR_SUCCESS) {
+                conn = crowdsec_conn_wait(conns, 2, sconf->timeout - hedge);
+            }
+
+            if (conn == conns[1]) {
+                crowdsec_count(hedge_wins);
+                ep = eps[1];
+                target = apr_pstrcat(p, ep->url, path, NULL);
+            }
+            else if (!conn) {
+                /* neither answered in time, the first gets the blame */
+                status = APR_TIMEUP;
+            }
+
+        }
+
+        if (status == APR_SUCCESS) {
+            status = crowdsec_http_response(conn, &code, crowdsec_json_body,
+                                            &js);
+        }
+
+        if (status != APR_SUCCESS && !code && reused && n == 1) {
+            /* the service closed the idle connection, try again */
+            status = crowdsec_http_get(s, conn, p, sconf->timeout,
+                                       path, &code, crowdsec_json_body, &js);
+        }
+
+    }
+
+    for (i = 0; i < n; i++) {
+        if (conns[i] != conn) {
+            /* the answer is still on its way, the connection is spent */
+            crowdsec_conn_close(conns[i]);
+        }
+        crowdsec_endpoint_release(eps[i], conns[i]);
+    }
+
+    if (status != APR_SUCCESS && code == HTTP_OK) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                     "crowdsec: response from crowdsec service '%s' could "
+                     "not be read", target);
+        crowdsec_endpoint_failure(s, ep);
+        return HTTP_BAD_GATEWAY;
+    }
+
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                     "crowdsec: could not reach crowdsec service '%s'",
+                     target);
+        crowdsec_endpoint_failure(s, ep);
+        return APR_STATUS_IS_TIMEUP(status) ? HTTP_GATEWAY_TIME_OUT :
+            HTTP_BAD_GATEWAY;
+    }
+
+    if (code != HTTP_OK) {
+        if (code >= HTTP_INTERNAL_SERVER_ERROR) {
+            crowdsec_endpoint_failure(s, ep);
+        }
+        return code;
+    }
+
+    if (!crowdsec_json_finish(&js)) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, APR_SUCCESS, s,
+                     "crowdsec: response from crowdsec service '%s' could "
+                     "not be parsed", target);
+        crowdsec_endpoint_failure(s, ep);
+        return HTTP_OK;
+    }
+
+    crowdsec_endpoint_success(s, ep);
+
+    return OK;
+}
+
+/*
+ * Look up the address with the builtin client, over a kept alive
+ * connection to the crowdsec service. Unlike crowdsec_proxy, this does
+ * not involve a subrequest or mod_proxy, and so needs no request.
+ *
+ * With several CrowdsecURLs, a lookup that gets no answer is tried once
+ * more at another endpoint.
+ *
+ * Returns OK, the status CrowdsecFallback should be applied with, or
+ * DECLINED if the builtin client was not initialised.
+ */
+static int crowdsec_builtin_query(server_rec * s, apr_pool_t * p,
+                                  const char *ip, crowdsec_verdict_t * verdict)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(s->module_config,
+                             &crowdsec_module);
+
+    crowdsec_endpoint_t *ep = NULL;
+    const char *path;
+    int i, status = HTTP_SERVICE_UNAVAILABLE;
+
+    if (!sconf->endpoints) {
+        return DECLINED;
+    }
+
+    path = apr_pstrcat(p, "/v1/decisions?ip=",
+                       ap_escape_urlencoded(p, ip), NULL);
+
+    for (i = 0; i < CROWDSEC_ENDPOINT_TRIES; i++) {
+
+        ep = crowdsec_endpoint_pick(sconf, NULL, ep);
+        if (!ep) {
+            break;
+        }
+
+        status = crowdsec_endpoint_query(s, p, ep, path, ip, verdict);
+
+        if (status != HTTP_BAD_GATEWAY && status != HTTP_GATEWAY_TIME_OUT &&
+            status != HTTP_SERVICE_UNAVAILABLE) {
+            break;
+        }
+
+    }
+
+    return status;
+}
+
+#if APR_HAS_THREADS
+/*
+ * Send a batch of lookups pipelined over the dispatcher's connection, and
+ * read the answers back in order. Should the connection close part way,
+ * the lookups not yet answered are sent again over a new one.
+ *
+ * The dispatcher keeps to one of several CrowdsecURLs for as long as it
+ * answers, so as to keep its connection alive.
+ */
+static void crowdsec_batch_run(crowdsec_batch_t * batch,
+                               crowdsec_job_t ** jobs, int n)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(batch->s->module_config,
+                             &crowdsec_module);
+
+    crowdsec_conn_t *conn = batch->conn;
+    crowdsec_endpoint_t *ep;
+    const char **reqs;
+    apr_status_t status = APR_SUCCESS;
+    int i, j, retried = 0;
+
+    ep = crowdsec_endpoint_pick(sconf, conn->endpoint, NULL);
+    if (!ep) {
+        for (i = 0; i < n; i++) {
+            jobs[i]->status = HTTP_SERVICE_UNAVAILABLE;
+        }
+        return;
+    }
+    crowdsec_conn_target(conn, ep);
+
+    reqs = apr_palloc(batch->pool, n * sizeof(const char *));
+    for (i = 0; i < n; i++) {
+        reqs[i] = crowdsec_http_request(batch->s, batch->pool, ep,
+                apr_pstrcat(batch->pool, "/v1/decisions?ip=",
+                            ap_escape_urlencoded(batch->pool, jobs[i]->ip),
+                            NULL));
+    }
+
+    apr_atomic_inc32(&ep->state->outstanding);
+
+    for (i = 0; i < n;) {
+
+        int start = i, reused;
+
+        if (!conn->sock) {
+            status = crowdsec_conn_open(batch->s, conn, sconf->timeout);
+            if (status != APR_SUCCESS) {
+                break;
+            }
+        }
+        else {
+            apr_socket_timeout_set(conn->sock, sconf->timeout);
+        }
+
+        reused = conn->requests > 0;
+
+        for (j = i; j < n && status == APR_SUCCESS; j++) {
+            status = crowdsec_http_send(conn, reqs[j], strlen(reqs[j]));
+        }
+        if (status != APR_SUCCESS) {
+            crowdsec_conn_close(conn);
+        }
+
+        for (j = i; j < n && status == APR_SUCCESS; j++) {
+            crowdsec_verdict_t *verdict = &jobs[j]->verdict;
+            crowdsec_json js;
+            int code;
+
+            memset(verdict, 0, sizeof(crowdsec_verdict_t));
+            verdict->version = CROWDSEC_VERDICT_VERSION;
+
+            crowdsec_json_init(&js, 0, crowdsec_verdict_apply, verdict);
+
+            status = crowdsec_http_response(conn, &code, crowdsec_json_body,
+                                            &js);
+            if (status != APR_SUCCESS && !code) {
+                /* not answered, try again below */
+                break;
+            }
+
+            jobs[j]->status = status != APR_SUCCESS ? HTTP_BAD_GATEWAY :
+                code != HTTP_OK ? code :
+                !crowdsec_json_finish(&js) ? HTTP_OK : OK;
+
+            i = j + 1;
+            status = APR_SUCCESS;
+
+            if (!conn->sock) {
+                /* the service closed the connection after this one */
+                break;
+            }
+        }
+
+        if (i > start) {
+            retried = 0;
+        }
+        else if (reused && !retried) {
+            /* the service closed the idle connection */
+            retried = 1;
+        }
+        else {
+            break;
+        }
+
+        status = APR_SUCCESS;
+    }
+
+    apr_atomic_dec32(&ep->state->outstanding);
+
+    if (i < n) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, batch->s,
+                     "crowdsec: could not reach crowdsec service '%s', "
+                     "%d lookups failed", ep->url, n - i);
+        for (; i < n; i++) {
+            jobs[i]->status = APR_STATUS_IS_TIMEUP(status) ?
+                HTTP_GATEWAY_TIME_OUT : HTTP_BAD_GATEWAY;
+        }
+        crowdsec_endpoint_failure(batch->s, ep);
+    }
+    else {
+        crowdsec_endpoint_success(batch->s, ep);
+    }
+
+    apr_pool_clear(batch->pool);
+}
+
+/*
+ * Put the job back for reuse. Called with the dispatcher mutex held.
+ */
+static void crowdsec_job_free(crowdsec_batch_t * batch, crowdsec_job_t * job)
+{
+    job->next = batch->free;
+    batch->free = job;
+}
+
+static void *APR_THREAD_FUNC crowdsec_batch_thread(apr_thread_t * thd,
+                                                   void *baton)
+{
+
+    crowdsec_batch_t *batch = baton;
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(batch->s->module_config,
+                             &crowdsec_module);
+
+    crowdsec_job_t *jobs[CROWDSEC_BATCH_MAX], *job;
+    int i, n;
+
+    apr_thread_mutex_lock(batch->mutex);
+
+    for (;;) {
+
+        apr_time_t deadline;
+
+        while (!batch->head && !batch->stop) {
+            apr_thread_cond_wait(batch->wake, batch->mutex);
+        }
+        if (batch->stop) {
+            break;
+        }
+
+        /* give other lookups a moment to join this batch */
+        deadline = apr_time_now() + sconf->batch_window;
+        while (batch->queued < CROWDSEC_BATCH_MAX && !batch->stop) {
+            apr_time_t now = apr_time_now();
+
+            if (now >= deadline) {
+                break;
+            }
+            apr_thread_cond_timedwait(batch->wake, batch->mutex,
+                                      deadline - now);
+        }
+
+        for (n = 0; n < CROWDSEC_BATCH_MAX && (job = batch->head);) {
+            batch->head = job->next;
+            batch->queued--;
+            if (job->abandoned) {
+                /* no one is waiting for this one any more */
+                crowdsec_job_free(batch, job);
+                continue;
+            }
+            jobs[n++] = job;
+        }
+        if (!batch->head) {
+            batch->tail = NULL;
+        }
+
+        if (!n) {
+            continue;
+        }
+
+        apr_thread_mutex_unlock(batch->mutex);
+
+        crowdsec_batch_run(batch, jobs, n);
+
+        apr_thread_mutex_lock(batch->mutex);
+
+        for (i = 0; i < n; i++) {
+            if (jobs[i]->abandoned) {
+                crowdsec_job_free(batch, jobs[i]);
+            }
+            else {
+                jobs[i]->done = 1;
+            }
+        }
+        apr_thread_cond_broadcast(batch->done);
+
+    }
+
+    /* the child is going away, fail whatever is left */
+    while ((job = batch->head)) {
+        batch->head = job->next;
+        if (job->abandoned) {
+            crowdsec_job_free(batch, job);
+            continue;
+        }
+        job->status = HTTP_SERVICE_UNAVAILABLE;
+        job->done = 1;
+    }
+    batch->tail = NULL;
+    batch->queued = 0;
+    apr_thread_cond_broadcast(batch->done);
+
+    apr_thread_mutex_unlock(batch->mutex);
+
+    return NULL;
+}
+
+/*
+ * Hand the lookup to the dispatcher, and wait for the batch carrying it,
+ * for no longer than the batch window and CrowdsecTimeout together.
+ * Should the batch not be done by then, the job is left behind for the
+ * dispatcher to free, and the lookup timed out.
+ */
+static int crowdsec_batch_query(request_rec * r, crowdsec_verdict_t * verdict)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(r->server->module_config,
+                             &crowdsec_module);
+
+    crowdsec_batch_t *batch = sconf->batch;
+    crowdsec_job_t *job;
+    apr_time_t deadline;
+    int status;
+
+    if (strlen(r->useragent_ip) >= sizeof(job->ip)) {
+        /* no room in the job, look it up on its own */
+        return crowdsec_builtin_query(r->server, r->pool, r->useragent_ip,
+                                      verdict);
+    }
+
+    deadline = apr_time_now() + sconf->batch_window + sconf->timeout;
+
+    apr_thread_mutex_lock(batch->mutex);
+
+    if (batch->stop) {
+        apr_thread_mutex_unlock(batch->mutex);
+        return HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    job = batch->free;
+    if (job) {
+        batch->free = job->next;
+    }
+    else {
+        job = apr_palloc(batch->jobs, sizeof(crowdsec_job_t));
+    }
+
+    memset(job, 0, sizeof(crowdsec_job_t));
+    apr_cpystrn(job->ip, r->useragent_ip, sizeof(job->ip));
+
+    if (batch->tail) {
+        batch->tail->next = job;
+    }
+    else {
+        batch->head = job;
+    }
+    batch->tail = job;
+
+    /* wake the dispatcher for a new batch, or once a batch is full */
+    if (++batch->queued == 1 || batch->queued >= CROWDSEC_BATCH_MAX) {
+        apr_thread_cond_signal(batch->wake);
+    }
+
+    while (!job->done) {
+        apr_time_t now = apr_time_now();
+
+        if (now >= deadline) {
+            break;
+        }
+        apr_thread_cond_timedwait(batch->done, batch->mutex, deadline - now);
+    }
+
+    if (job->done) {
+        *verdict = job->verdict;
+        status = job->status;
+        crowdsec_job_free(batch, job);
+    }
+    else {
+        job->abandoned = 1;
+        status = HTTP_GATEWAY_TIME_OUT;
+    }
+
+    apr_thread_mutex_unlock(batch->mutex);
+
+    if (status == HTTP_GATEWAY_TIME_OUT) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_TIMEUP, r,
+                      "crowdsec: lookup of IP '%s' not answered in time by "
+                      "the lookup dispatcher", r->useragent_ip);
+    }
+
+    return status;
+}
+
+static apr_status_t crowdsec_batch_stop(void *baton)
+{
+    crowdsec_batch_t *batch = baton;
+    apr_status_t rv;
+
+    apr_thread_mutex_lock(batch->mutex);
+    batch->stop = 1;
+    apr_thread_cond_signal(batch->wake);
+    apr_thread_mutex_unlock(batch->mutex);
+
+    apr_thread_join(&rv, batch->thread);
+
+    return APR_SUCCESS;
+}
+
+static void crowdsec_batch_start(apr_pool_t * pchild, server_rec * s)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(s->module_config,
+                             &crowdsec_module);
+
+    crowdsec_batch_t *batch = apr_pcalloc(pchild, sizeof(crowdsec_batch_t));
+    apr_status_t status;
+
+    batch->s = s;
+
+    status = apr_thread_mutex_create(&batch->mutex, APR_THREAD_MUTEX_DEFAULT,
+                                     pchild);
+    if (status == APR_SUCCESS) {
+        status = apr_thread_cond_create(&batch->wake, pchild);
+    }
+    if (status == APR_SUCCESS) {
+        status = apr_thread_cond_create(&batch->done, pchild);
+    }
+    if (status == APR_SUCCESS) {
+        status = apr_pool_create(&batch->pool, pchild);
+    }
+    if (status == APR_SUCCESS) {
+        status = apr_pool_create(&batch->jobs, pchild);
+    }
+    if (status == APR_SUCCESS) {
+        batch->conn = crowdsec_conn_create(pchild);
+        if (!batch->conn) {
+            status = APR_ENOMEM;
+        }
+    }
+    if (status == APR_SUCCESS) {
+        status = apr_thread_create(&batch->thread, NULL,
+                                   crowdsec_batch_thread, batch, pchild);
+    }
+
+    if (status != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                     "crowdsec: failed to start lookup dispatcher, "
+                     "lookups will not be batched");
+        return;
+    }
+
+    /* stop the dispatcher before the connection and pools go away */
+    apr_pool_pre_cleanup_register(pchild, batch, crowdsec_batch_stop);
+
+    sconf->batch = batch;
+}
+#endif
+
+static int crowdsec_builtin(request_rec * r, crowdsec_verdict_t * verdict)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(r->server->module_config,
+                             &crowdsec_module);
+
+    int status;
+
+#if APR_HAS_THREADS
+    if (sconf->batch) {
+        status = crowdsec_batch_query(r, verdict);
+    }
+    else
+#endif
+    {
+        status = crowdsec_builtin_query(r->server, r->pool,
+                                        r->useragent_ip, verdict);
+    }
+
+    if (status == DECLINED) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_SUCCESS, r,
+                      "crowdsec: builtin client not initialised, "
+                      "request rejected: %s", r->uri);
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (status != OK) {
+        crowdsec_breaker_failure(r->server);
+        return crowdsec_apply_fallback(r, sconf->url, status, verdict);
+    }
+
+    crowdsec_breaker_success(r->server);
+
+    return OK;
+}
+
+#if APR_HAS_THREADS
+/* a cache entry to be refreshed in the background */
+typedef struct
+{
+    server_rec *s;
+    /* the pool of the refresh, destroyed once done */
+    apr_pool_t *pool;
+    const char *ip;
+    unsigned int keylen;
+    unsigned char key[CROWDSEC_CACHE_KEY_LEN];
+} crowdsec_refresh_t;
+
+static void *APR_THREAD_FUNC crowdsec_refresh_task(apr_thread_t * thd,
+                                                   void *baton)
+{
+    crowdsec_refresh_t *refresh = baton;
+    crowdsec_verdict_t verdict;
+    int status = HTTP_SERVICE_UNAVAILABLE;
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(refresh->s->module_config,
+                             &crowdsec_module);
+
+    if (crowdsec_breaker_allow(sconf)) {
+        status = crowdsec_builtin_query(refresh->s, refresh->pool,
+                                        refresh->ip, &verdict);
+        if (status == OK) {
+            crowdsec_breaker_success(refresh->s);
+        }
+        else if (status != DECLINED) {
+            crowdsec_breaker_failure(refresh->s);
+        }
+    }
+
+    if (status == OK) {
+        crowdsec_cache_store(refresh->s, refresh->pool, refresh->key,
+                             refresh->keylen, refresh->ip, &verdict);
+    }
+    else {
+        /* the entry we have expires as it would have done anyway */
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, refresh->s,
+                     "crowdsec: refresh of %s failed, cache entry left "
+                     "to expire", refresh->ip);
+    }
+
+    apr_pool_destroy(refresh->pool);
+
+    return NULL;
+}
+
+/*
+ * Refresh the cache entry just hit in the background, if it expires
+ * within CrowdsecCacheRefresh. The entry is marked first, so that
+ * further hits in this and other children leave the refresh to us.
+ */
+static void crowdsec_refresh(request_rec * r,
+                             const crowdsec_verdict_t * verdict)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(r->server->module_config,
+                             &crowdsec_module);
+
+    crowdsec_verdict_t marked;
+    crowdsec_refresh_t *refresh;
+    apr_pool_t *pool;
+
+    if (!sconf->refresh_pool ||
+        (verdict->flags & (CROWDSEC_VERDICT_PENDING |
+                           CROWDSEC_VERDICT_REFRESH)) ||
+        verdict->expiry - r->request_time > sconf->cache_refresh) {
+        return;
+    }
+
+    if (apr_thread_pool_tasks_count(sconf->refresh_pool) >=
+        CROWDSEC_REFRESH_QUEUE) {
+        return;
+    }
+
+    /* the refresh outlives the request, and may not share its pool */
+    if (apr_pool_create_unmanaged_ex(&pool, NULL, NULL) != APR_SUCCESS) {
+        return;
+    }
+
+    refresh = apr_pcalloc(pool, sizeof(crowdsec_refresh_t));
+    refresh->s = r->server;
+    refresh->pool = pool;
+    refresh->ip = apr_pstrdup(pool, r->useragent_ip);
+    refresh->keylen = crowdsec_cache_key(r, refresh->key);
+
+    if (!refresh->keylen) {
+        apr_pool_destroy(pool);
+        return;
+    }
+
+    marked = *verdict;
+    marked.flags |= CROWDSEC_VERDICT_REFRESH;
+    crowdsec_to_cache(r, &marked);
+
+    if (apr_thread_pool_push(sconf->refresh_pool, crowdsec_refresh_task,
+                             refresh, APR_THREAD_TASK_PRIORITY_NORMAL,
+                             NULL) != APR_SUCCESS) {
+        apr_pool_destroy(pool);
+        return;
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                  "crowdsec: refreshing cache entry for %s ahead of expiry",
+                  r->useragent_ip);
+
+}
+#endif
+
+/*
+ * Record how long a lookup took in the latency histogram.
+ */
+static void crowdsec_count_lookup(apr_interval_time_t took)
+{
+    apr_size_t i;
+
+    for (i = 0; i < CROWDSEC_LATENCY_BUCKETS; i++) {
+        if (took <= crowdsec_latency_bounds[i]) {
+            break;
+        }
+    }
+
+    apr_atomic_inc32(&crowdsec_metrics->lookups);
+    apr_atomic_inc32(&crowdsec_metrics->latency[i]);
+    apr_atomic_add32(&crowdsec_metrics->latency_ms,
+                     (apr_uint32_t) apr_time_as_msec(took));
+}
+
+/*
+ * Look up the address with whichever client is configured.
+ */
+static int crowdsec_fetch(request_rec * r, crowdsec_verdict_t * verdict)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(r->server->module_config,
+                             &crowdsec_module);
+
+    apr_time_t start;
+    int status;
+
+    if (!crowdsec_breaker_allow(sconf)) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                      "crowdsec: circuit open, %s not looked up",
+                      r->useragent_ip);
+        return crowdsec_apply_fallback(r, sconf->url,
+                                       HTTP_SERVICE_UNAVAILABLE, verdict);
+    }
+
+    start = crowdsec_metrics ? apr_time_now() : 0;
+
+    if (sconf->client == CROWDSEC_CLIENT_BUILTIN) {
+        status = crowdsec_builtin(r, verdict);
+    }
+    else {
+        status = crowdsec_proxy(r, verdict);
+    }
+
+    if (crowdsec_metrics) {
+        crowdsec_count_lookup(apr_time_now() - start);
+    }
+
+    return status;
+}
+
+/*
+ * Remove our pending marker from the cache, when the lookup failed.
+ */
+static void crowdsec_cache_remove(request_rec * r)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(r->server->module_config,
+                             &crowdsec_module);
+
+    unsigned char key[CROWDSEC_CACHE_KEY_LEN];
+    unsigned int keylen;
+    apr_status_t status;
+
+    if (!sconf->cache_provider) {
+        return;
+    }
+
+    keylen = crowdsec_cache_key(r, key);
+    if (!keylen) {
+        return;
+    }
+
+    if (sconf->l1) {
+        crowdsec_l1_put(sconf->l1, key, keylen, r->request_time, NULL);
+    }
+
+    status = sconf->cache_mutex ?
+        apr_global_mutex_trylock(sconf->cache_mutex) : APR_SUCCESS;
+
+    if (APR_STATUS_IS_EBUSY(status)) {
+        /* don't wait around, the pending marker expires on its own */
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, status, r,
+                      "crowdsec: result for %s not removed from cache "
+                      "(mutex busy)", r->useragent_ip);
+        crowdsec_count(cache_busy);
+        return;
+    }
+    else if (status != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "crowdsec: result for %s not removed from cache "
+                      "(failed to lock cache mutex)", r->useragent_ip);
+        return;
+    }
+
+    sconf->cache_provider->remove(sconf->cache_instance, r->server,
+                                  key, keylen, r->pool);
+
+    if (sconf->cache_mutex) {
+        apr_global_mutex_unlock(sconf->cache_mutex);
+    }
+
+}
+
+/*
+ * Wait for a lookup in progress in another child to reach the cache.
+ *
+ * Returns zero if the lookup did not finish in time.
+ */
+static int crowdsec_cache_wait(request_rec * r, crowdsec_verdict_t * verdict)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(r->server->module_config,
+                             &crowdsec_module);
+
+    apr_time_t deadline = apr_time_now() + sconf->coalesce_timeout;
+
+    do {
+
+        apr_sleep(CROWDSEC_COALESCE_POLL);
+
+        if (!crowdsec_from_cache(r, verdict)) {
+            /* the marker was removed, the lookup failed */
+            return 0;
+        }
+
+        if (verdict->flags & CROWDSEC_VERDICT_PENDING) {
+            if (verdict->expiry <= apr_time_now()) {
+                /* the lookup behind the marker never finished */
+                return 0;
+            }
+        }
+        else {
+            if (verdict->expiry <= r->request_time) {
+                /* the lookup failed, and put back the expired entry */
+                crowdsec_keep_stale(r, verdict);
+                return 0;
+            }
+            return 1;
+        }
+
+    } while (apr_time_now() < deadline);
+
+    return 0;
+}
+
+/*
+ * Count a request about to wait on a lookup, made or joined, unless
+ * CrowdsecMaxLookups are already waiting in this child. Returns zero if
+ * the request should not wait.
+ */
+static int crowdsec_lookup_enter(request_rec * r,
+                                 crowdsec_server_rec * sconf)
+{
+    if (sconf->max_lookups &&
+        apr_atomic_inc32(&sconf->lookups) >=
+        (apr_uint32_t) sconf->max_lookups) {
+
+        apr_atomic_dec32(&sconf->lookups);
+
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
+                      "crowdsec: %d requests already waiting on '%s', not "
+                      "looking up %s", sconf->max_lookups, sconf->url,
+                      r->useragent_ip);
+
+        return 0;
+    }
+
+    return 1;
+}
+
+static void crowdsec_lookup_leave(crowdsec_server_rec * sconf)
+{
+    if (sconf->max_lookups) {
+        apr_atomic_dec32(&sconf->lookups);
+    }
+}
+
+/*
+ * Look up the address with the crowdsec service, and cache the result.
+ *
+ * Only one lookup per address is made at a time. Within a child, other
+ * requests for the same address wait for the lookup in progress. Across
+ * children, a pending marker in the cache tells other children to wait
+ * for the result to appear in the cache. If the result does not arrive
+ * within CrowdsecCoalesceTimeout the fallback applies.
+ *
+ * Every request waiting here counts towards CrowdsecMaxLookups, whether
+ * it makes the lookup or waits on one in progress, as each holds a
+ * thread of the child all the same.
+ */
+static int crowdsec_lookup(request_rec * r, int pending,
+                           crowdsec_verdict_t * verdict)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(r->server->module_config,
+                             &crowdsec_module);
+
+#if APR_HAS_THREADS
+    crowdsec_flight_t *flight = NULL;
+#endif
+
+    int status, fetched = 0;
+
+    if (!sconf->coalesce_timeout) {
+
+        if (!crowdsec_lookup_enter(r, sconf)) {
+            return crowdsec_apply_fallback(r, sconf->url,
+                                           HTTP_SERVICE_UNAVAILABLE,
+                                           verdict);
+        }
+
+        status = crowdsec_fetch(r, verdict);
+
+        crowdsec_lookup_leave(sconf);
+
+        if (status == OK) {
+            crowdsec_to_cache(r, verdict);
+        }
+
+        return status;
+    }
+
+#if APR_HAS_THREADS
+    if (sconf->flight_mutex) {
+
+        unsigned char key[CROWDSEC_CACHE_KEY_LEN];
+        unsigned int keylen;
+
+        keylen = crowdsec_cache_key(r, key);
+
+        if (keylen) {
+
+            apr_thread_mutex_lock(sconf->flight_mutex);
+
+            flight = apr_hash_get(sconf->flights, key, keylen);
+
+            if (flight) {
+
+                apr_time_t deadline = apr_time_now() + sconf->coalesce_timeout;
+                int done, ok;
+
+                if (!crowdsec_lookup_enter(r, sconf)) {
+                    apr_thread_mutex_unlock(sconf->flight_mutex);
+                    return crowdsec_apply_fallback(r, sconf->url,
+                                                   HTTP_SERVICE_UNAVAILABLE,
+                                                   verdict);
+                }
+
+                flight->waiters++;
+
+                while (!flight->done) {
+                    apr_time_t now = apr_time_now();
+
+                    if (now >= deadline) {
+                        break;
+                    }
+                    apr_thread_cond_timedwait(flight->cond,
+                                              sconf->flight_mutex,
+                                              deadline - now);
+                }
+
+                done = flight->done;
+                ok = done && flight->ok;
+                if (ok) {
+                    *verdict = flight->verdict;
+                }
+
+                if (!--flight->waiters && flight->done) {
+                    flight->next = sconf->flight_free;
+                    sconf->flight_free = flight;
+                }
+
+                apr_thread_mutex_unlock(sconf->flight_mutex);
+
+                crowdsec_lookup_leave(sconf);
+
+                if (ok) {
+                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                                  "crowdsec: joined lookup in progress for %s",
+                                  r->useragent_ip);
+                    return OK;
+                }
+
+                if (done) {
+                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                                  "crowdsec: lookup in progress for %s failed",
+                                  r->useragent_ip);
+                }
+                else {
+                    ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
+                                  "crowdsec: lookup in progress for %s did "
+                                  "not finish in time", r->useragent_ip);
+                }
+
+                return crowdsec_apply_fallback(r, sconf->url,
+                                               done ? HTTP_BAD_GATEWAY :
+                                               HTTP_GATEWAY_TIME_OUT,
+                                               verdict);
+            }
+
+            flight = sconf->flight_free;
+            if (flight) {
+                sconf->flight_free = flight->next;
+            }
+            else {
+                flight = apr_pcalloc(sconf->flight_pool,
+                                     sizeof(crowdsec_flight_t));
+                if (apr_thread_cond_create(&flight->cond,
+                                           sconf->flight_pool) != APR_SUCCESS) {
+                    flight = NULL;
+                }
+            }
+
+            if (flight) {
+                flight->waiters = 0;
+                flight->done = 0;
+                flight->ok = 0;
+                flight->keylen = keylen;
+                memcpy(flight->key, key, keylen);
+                apr_hash_set(sconf->flights, flight->key, flight->keylen,
+                             flight);
+            }
+
+            apr_thread_mutex_unlock(sconf->flight_mutex);
+
+        }
+
+    }
+#endif
+
+    if (!crowdsec_lookup_enter(r, sconf)) {
+        /* whoever joined us applies the fallback too */
+        status = crowdsec_apply_fallback(r, sconf->url,
+                                         HTTP_SERVICE_UNAVAILABLE, verdict);
+    }
+    else if (pending) {
+
+        int joined = crowdsec_cache_wait(r, verdict);
+
+        crowdsec_lookup_leave(sconf);
+
+        if (joined) {
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                          "crowdsec: joined lookup in another child for %s",
+                          r->useragent_ip);
+            status = OK;
+        }
+        else {
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
+                          "crowdsec: lookup in another child for %s did not "
+                          "finish in time", r->useragent_ip);
+            status = crowdsec_apply_fallback(r, sconf->url,
+                                             HTTP_GATEWAY_TIME_OUT, verdict);
+        }
+
+    }
+    else {
+
+        crowdsec_verdict_t marker;
+
+        /* tell the other children we are on it */
+        memset(&marker, 0, sizeof(crowdsec_verdict_t));
+        marker.version = CROWDSEC_VERDICT_VERSION;
+        marker.flags = CROWDSEC_VERDICT_PENDING;
+        crowdsec_to_cache(r, &marker);
+
+        status = crowdsec_fetch(r, verdict);
+        fetched = 1;
+
+        crowdsec_lookup_leave(sconf);
+
+        if (status == OK) {
+            crowdsec_to_cache(r, verdict);
+        }
+        else {
+            crowdsec_cache_remove(r);
+        }
+
+    }
+
+#if APR_HAS_THREADS
+    if (flight) {
+
+        apr_thread_mutex_lock(sconf->flight_mutex);
+
+        apr_hash_set(sconf->flights, flight->key, flight->keylen, NULL);
+
+        flight->done = 1;
+        flight->ok = (fetched && status == OK);
+        if (flight->ok) {
+            flight->verdict = *verdict;
+        }
+
+        if (flight->waiters) {
+            apr_thread_cond_broadcast(flight->cond);
+        }
+        else {
+            flight->next = sconf->flight_free;
+            sconf->flight_free = flight;
+        }
+
+        apr_thread_mutex_unlock(sconf->flight_mutex);
+
+    }
+#endif
+
+    return status;
+}
+
+/*
+ * The memo of the connection the request came in on, shared by all the
+ * streams of an HTTP/2 connection.
+ */
+static crowdsec_memo_t *crowdsec_memo(request_rec * r)
+{
+    conn_rec *c = r->connection;
+
+#if AP_MODULE_MAGIC_AT_LEAST(20120211, 52)
+    while (c->master) {
+        c = c->master;
+    }
+#endif
+
+    return (crowdsec_memo_t *) ap_get_module_config(c->conn_config,
+                                                    &crowdsec_module);
+}
+
+/*
+ * Find the verdict remembered on the connection, if it was reached for
+ * this server and client, and still holds.
+ */
+static int crowdsec_memo_get(request_rec * r, crowdsec_server_rec * sconf,
+                             apr_uint32_t generation,
+                             crowdsec_verdict_t * verdict)
+{
+    crowdsec_memo_t *memo;
+    int i;
+
+    if (!sconf->conn_cache_timeout || !(memo = crowdsec_memo(r))) {
+        return 0;
+    }
+
+    for (i = 0; i < CROWDSEC_MEMO_READS; i++) {
+
+        apr_uint32_t seq = apr_atomic_read32(&memo->seq);
+        int found;
+
+        if (seq & 1) {
+            continue;
+        }
+        crowdsec_barrier();
+
+        found = memo->sconf == sconf && memo->generation == generation &&
+            memo->expiry > r->request_time &&
+            !strncmp(memo->ip, r->useragent_ip, sizeof(memo->ip));
+        if (found) {
+            *verdict = memo->verdict;
+        }
+
+        crowdsec_barrier();
+        if (apr_atomic_read32(&memo->seq) == seq) {
+            return found;
+        }
+
+    }
+
+    return 0;
+}
+
+/*
+ * Remember the verdict on the connection, for no longer than
+ * CrowdsecConnectionCache, and never beyond the expiry of the verdict.
+ */
+static void crowdsec_memo_put(request_rec * r, crowdsec_server_rec * sconf,
+                              apr_uint32_t generation,
+                              const crowdsec_verdict_t * verdict)
+{
+    crowdsec_memo_t *memo;
+    apr_time_t expiry = r->request_time + sconf->conn_cache_timeout;
+    apr_size_t len;
+    apr_uint32_t seq;
+
+    if (!sconf->conn_cache_timeout || !(memo = crowdsec_memo(r))) {
+        return;
+    }
+
+    len = strlen(r->useragent_ip);
+    if (len >= sizeof(memo->ip)) {
+        return;
+    }
+
+    if (verdict->expiry && verdict->expiry < expiry) {
+        expiry = verdict->expiry;
+    }
+    if (verdict->until && verdict->until < expiry) {
+        expiry = verdict->until;
+    }
+
+    seq = apr_atomic_read32(&memo->seq);
+    if ((seq & 1) || apr_atomic_cas32(&memo->seq, seq + 1, seq) != seq) {
+        /* another stream is writing, one verdict is as good as another */
+        return;
+    }
+
+    memo->sconf = sconf;
+    memo->generation = generation;
+    memo->expiry = expiry;
+    memo->verdict = *verdict;
+    memcpy(memo->ip, r->useragent_ip, len + 1);
+
+    crowdsec_barrier();
+    apr_atomic_set32(&memo->seq, seq + 2);
+}
+
+/*
+ * The response to a blocked request in the absence of an ErrorDocument,
+ * as httpd would send it, or NULL for a status we have none for.
+ */
+static const char *crowdsec_block_body(int status)
+{
+    switch (status) {
+    case HTTP_FORBIDDEN:
+        return CROWDSEC_BLOCK_HEAD("403 Forbidden", "Forbidden")
+            "<p>You don't have permission to access this resource.</p>\n"
+            CROWDSEC_BLOCK_TAIL;
+    case HTTP_TOO_MANY_REQUESTS:
+        return CROWDSEC_BLOCK_HEAD("429 Too Many Requests",
+                                   "Too Many Requests")
+            "<p>The user has sent too many requests\n"
+            "in a given amount of time.</p>\n"
+            CROWDSEC_BLOCK_TAIL;
+    case HTTP_INTERNAL_SERVER_ERROR:
+        return CROWDSEC_BLOCK_HEAD("500 Internal Server Error",
+                                   "Internal Server Error")
+            "<p>The server encountered an internal error or\n"
+            "misconfiguration and was unable to complete\n"
+            "your request.</p>\n"
+            CROWDSEC_BLOCK_TAIL;
+    }
+
+    return NULL;
+}
+
+/*
+ * Send a response rendered ahead of time, rather than have httpd build
+ * an error page for each blocked request. The request is then done.
+ */
+static int crowdsec_block(request_rec * r, int status, const char *location,
+                          const char *body)
+{
+    apr_bucket_alloc_t *ba = r->connection->bucket_alloc;
+    apr_bucket_brigade *bb;
+    apr_size_t len = strlen(body);
+
+    /* as ap_die() would, so the connection may be kept alive */
+    ap_discard_request_body(r);
+
+    r->status = status;
+    if (location) {
+        apr_table_setn(r->headers_out, "Location", location);
+    }
+    ap_set_content_type(r, "text/html; charset=iso-8859-1");
+    ap_set_content_length(r, len);
+
+    bb = apr_brigade_create(r->pool, ba);
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_immortal_create(body, len, ba));
+    APR_BRIGADE_INSERT_TAIL(bb, apr_bucket_eos_create(ba));
+
+    ap_pass_brigade(r->output_filters, bb);
+
+    return DONE;
+}
+
+/*
+ * Turn the request away with the given status, with the response rendered
+ * ahead of time unless an ErrorDocument needs the full error handling.
+ */
+static int crowdsec_reject(request_rec * r, int status)
+{
+    const char *body = crowdsec_block_body(status);
+
+    if (body && !ap_response_code_string(r, ap_index_of_response(status))) {
+        return crowdsec_block(r, status, NULL, body);
+    }
+
+    return status;
+}
+
+/*
+ * Is the client of the request, with a throttle decision, within the
+ * CrowdsecThrottle rate? Returns the time until it would be, in
+ * milliseconds, or zero if it is.
+ *
+ * The slot is updated with a compare and swap, and a slot that stays
+ * busy past a few tries, or is held by another address still within its
+ * burst, lets the request through.
+ */
+static apr_uint32_t crowdsec_throttle_wait(request_rec * r,
+                                           const crowdsec_server_rec * sconf)
+{
+    crowdsec_throttle_t *slot;
+    crowdsec_ip_t ip;
+    apr_uint32_t key, now, interval, limit;
+    int i;
+
+    if (!crowdsec_throttles ||
+        !crowdsec_ip_from_addr(r->useragent_addr, &ip)) {
+        return 0;
+    }
+
+    key = crowdsec_cache_hash((const unsigned char *) ip.addr,
+                              sizeof(ip.addr));
+    slot = &crowdsec_throttles[key & (CROWDSEC_THROTTLE_SLOTS - 1)];
+
+    now = (apr_uint32_t) r->request_time;
+    interval = APR_USEC_PER_SEC / sconf->throttle_rate;
+    limit = interval * sconf->throttle_burst;
+
+    for (i = 0; i < CROWDSEC_THROTTLE_TRIES; i++) {
+
+        apr_uint32_t held = apr_atomic_read32(&slot->key);
+        apr_uint32_t tat = apr_atomic_read32(&slot->tat);
+        apr_uint32_t from = tat, next;
+        int idle = (apr_int32_t) (tat - now) < 0 || tat - now > limit;
+
+        if (held != key) {
+            if (held && !idle) {
+                /* another address within its burst, let this one be */
+                return 0;
+            }
+            if (apr_atomic_cas32(&slot->key, key, held) != held) {
+                continue;
+            }
+            idle = 1;
+        }
+
+        if (idle) {
+            /* idle for a while, or so long the clock has wrapped */
+            from = now;
+        }
+
+        next = from + interval;
+        if (next - now > limit) {
+            return (next - now - limit + 999) / 1000;
+        }
+
+        if (apr_atomic_cas32(&slot->tat, next, tat) == tat) {
+            return 0;
+        }
+
+    }
+
+    return 0;
+}
+
+/*
+ * Apply the CrowdsecThrottle rate to a client with a throttle decision.
+ * Requests over the rate are turned away, with a Retry-After telling the
+ * client when to come back.
+ */
+static int crowdsec_throttle(request_rec * r,
+                             const crowdsec_server_rec * sconf)
+{
+    apr_uint32_t wait = crowdsec_throttle_wait(r, sconf);
+
+    if (!wait) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
+                      "crowdsec: ip address '%s' lookup returned throttle, "
+                      "within %d requests a second, request accepted: %s",
+                      r->useragent_ip, sconf->throttle_rate, r->uri);
+        return OK;
+    }
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
+                  "crowdsec: ip address '%s' lookup returned throttle, "
+                  "over %d requests a second, request rejected: %s",
+                  r->useragent_ip, sconf->throttle_rate, r->uri);
+
+    crowdsec_count(throttled);
+
+    apr_table_setn(r->err_headers_out, "Retry-After",
+                   apr_psprintf(r->pool, "%u", (wait + 999) / 1000));
+
+    return crowdsec_reject(r, HTTP_TOO_MANY_REQUESTS);
+}
+
+static int crowdsec_query(request_rec * r)
+{
+
+    crowdsec_verdict_t verdict;
+    apr_uint32_t generation = 0;
+    int status;
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(r->server->module_config,
+                             &crowdsec_module);
+
+    crowdsec_config_rec *conf = (crowdsec_config_rec *)
+        ap_get_module_config(r->per_dir_config,
+                             &crowdsec_module);
+
+    if (r->main || !sconf || !sconf->url) {
+        return DECLINED;
+    }
+
+    crowdsec_count(requests);
+
+    if (sconf->mode == CROWDSEC_MODE_STREAM && sconf->store) {
+        /* read ahead of the lookup, so no verdict outlives its snapshot */
+        generation = apr_atomic_read32(&sconf->store->hdr->generation);
+    }
+
+    if (crowdsec_memo_get(r, sconf, generation, &verdict)) {
+        crowdsec_count(connection_hits);
+    }
+
+    else if (sconf->mode == CROWDSEC_MODE_STREAM) {
+
+        if (!crowdsec_store_lookup(r, &verdict)) {
+
+            status = crowdsec_apply_fallback(r, sconf->url,
+                                             HTTP_SERVICE_UNAVAILABLE,
+                                             &verdict);
+
+            if ((status) != OK) {
+                return status;
+            }
+
+        }
+        else {
+            crowdsec_memo_put(r, sconf, generation, &verdict);
+        }
+
+    }
+
+    else {
+
+        int found = crowdsec_from_cache(r, &verdict);
+        int pending = found && (verdict.flags & CROWDSEC_VERDICT_PENDING);
+        int stale;
+
+        if (pending && verdict.expiry <= r->request_time) {
+            /* the lookup behind the marker never finished, a miss */
+            found = pending = 0;
+        }
+
+        stale = found && !pending && verdict.expiry <= r->request_time;
+
+        if (stale) {
+            /* kept beyond its expiry, for when the service is down */
+            crowdsec_keep_stale(r, &verdict);
+        }
+
+        if (stale && crowdsec_unhealthy(sconf)) {
+            /* don't wait on a service that has just failed us */
+            crowdsec_serve_stale(r, HTTP_SERVICE_UNAVAILABLE, &verdict);
+        }
+        else if (!found || pending || stale) {
+
+            status = crowdsec_lookup(r, pending, &verdict);
+
+            if ((status) != OK) {
+                return status;
+            }
+
+        }
+        else {
+            crowdsec_memo_put(r, sconf, generation, &verdict);
+#if APR_HAS_THREADS
+            crowdsec_refresh(r, &verdict);
+#endif
+        }
+
+    }
+
+    crowdsec_count(verdicts[verdict.type]);
+
+    if (verdict.type == CROWDSEC_DECISION_THROTTLE && sconf->throttle_rate) {
+        return crowdsec_throttle(r, sconf);
+    }
+
+    if (verdict.type == CROWDSEC_DECISION_NONE) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
+                      "crowdsec: ip address '%s' not blocked, "
+                      "request accepted: %s", r->useragent_ip, r->uri);
+        return OK;
+    }
+
+    else if (conf->location) {
+
+        const char *location = conf->location_str;
+        const char *err;
+
+        err = NULL;
+        if (!location) {
+            location = ap_expr_str_exec(r, conf->location, &err);
+        }
+        if (err) {
+            ap_log_rerror(
+                    APLOG_MARK, APLOG_ERR, 0, r,
+                                       "crowdsec: CrowdsecLocation: can't "
+                    "evaluate location expression: %s", err);
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
+                      "crowdsec: ip address '%s' lookup returned %s, "
+                      "request redirected to '%s': %s", r->useragent_ip,
+                      crowdsec_decision_names[verdict.type], location, r->uri);
+
+        if (conf->location_body) {
+            return crowdsec_block(r, HTTP_MOVED_TEMPORARILY, location,
+                                  conf->location_body);
+        }
+
+        ap_custom_response(r, conf->blockedhttpcode, location);
+        return conf->blockedhttpcode;
+    }
+
+    else {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
+                      "crowdsec: ip address '%s' lookup returned %s, "
+                      "request rejected: %s", r->useragent_ip,
+                      crowdsec_decision_names[verdict.type], r->uri);
+        return crowdsec_reject(r, conf->blockedhttpcode);
+    }
+
+}
+
+/*
+ * Is the address within one of the CrowdsecTrustedNetworks?
+ */
+static int crowdsec_trusted(const crowdsec_server_rec * sconf,
+                            const apr_sockaddr_t * sa)
+{
+    const crowdsec_trusted_t *trusted;
+    crowdsec_ip_t ip;
+    apr_uint64_t addr[2];
+    int i;
+
+    if (!sconf->trusted || !crowdsec_ip_from_addr(sa, &ip)) {
+        return 0;
+    }
+
+    memcpy(addr, ip.addr, sizeof(addr));
+
+    trusted = (const crowdsec_trusted_t *) sconf->trusted->elts;
+    for (i = 0; i < sconf->trusted->nelts; i++) {
+        if (trusted[i].family == ip.family &&
+            (addr[0] & trusted[i].mask[0]) == trusted[i].net[0] &&
+            (addr[1] & trusted[i].mask[1]) == trusted[i].net[1]) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int crowdsec_check_access(request_rec * r)
+{
+    /* make sure we don't recurse */
+    crowdsec_config_rec *conf = (crowdsec_config_rec *)
+        ap_get_module_config(r->per_dir_config,
+                             &crowdsec_module);
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(r->server->module_config,
+                             &crowdsec_module);
+
+    int status;
+
+    if (r->main || !conf->enable) {
+        return DECLINED;
+    }
+
+    /* before the cache and the crowdsec service are bothered */
+    if (crowdsec_trusted(sconf, r->useragent_addr)) {
+        crowdsec_count(trusted);
+        return DECLINED;
+    }
+
+    if ((status = crowdsec_query(r)) == OK) {
+        return DECLINED;
+    }
+
+    return status;
+}
+
+/*
+ * Take a copy of the counters.
+ */
+static void crowdsec_metrics_read(crowdsec_metrics_t * m)
+{
+    volatile apr_uint32_t *from = (volatile apr_uint32_t *) crowdsec_metrics;
+    apr_uint32_t *to = (apr_uint32_t *) m;
+    apr_size_t i;
+
+    for (i = 0; i < sizeof(crowdsec_metrics_t) / sizeof(apr_uint32_t); i++) {
+        to[i] = apr_atomic_read32(&from[i]);
+    }
+}
+
+static apr_uint32_t crowdsec_metrics_counter(const crowdsec_metrics_t * m,
+                                             apr_size_t i)
+{
+    return *(const apr_uint32_t *) ((const char *) m +
+                                    crowdsec_counters[i].offset);
+}
+
+/*
+ * Take a copy of the header of the active snapshot of the decision store
+ * of the server, if it has one. This is read racing with the updater, and
+ * is good enough for reporting.
+ */
+static int crowdsec_metrics_store(server_rec * s,
+                                  crowdsec_snapshot_hdr_t * hdr)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(s->module_config,
+                             &crowdsec_module);
+
+    crowdsec_store_t *store = sconf->store;
+
+    if (!store) {
+        return 0;
+    }
+
+    *hdr = *store->snap[apr_atomic_read32(&store->hdr->active)].hdr;
+
+    return 1;
+}
+
+static apr_int64_t crowdsec_metrics_age(const crowdsec_snapshot_hdr_t * hdr)
+{
+    return hdr->updated ?
+        (apr_int64_t) apr_time_sec(apr_time_now() - hdr->updated) : -1;
+}
+
+/*
+ * Write the counters in the Prometheus text format.
+ */
+static void crowdsec_metrics_prometheus(request_rec * r,
+                                        const crowdsec_metrics_t * m,
+                                        const crowdsec_snapshot_hdr_t * hdr)
+{
+    apr_uint32_t total = 0;
+    apr_size_t i;
+
+    for (i = 0; i < CROWDSEC_COUNTERS; i++) {
+        ap_rprintf(r, "# HELP crowdsec_%s_total %s\n"
+                   "# TYPE crowdsec_%s_total counter\n"
+                   "crowdsec_%s_total %u\n",
+                   crowdsec_counters[i].name, crowdsec_counters[i].help,
+                   crowdsec_counters[i].name, crowdsec_counters[i].name,
+                   crowdsec_metrics_counter(m, i));
+    }
+
+    ap_rputs("# HELP crowdsec_verdicts_total Verdicts reached, by decision "
+             "type.\n"
+             "# TYPE crowdsec_verdicts_total counter\n", r);
+    for (i = 0; i <= CROWDSEC_DECISION_BAN; i++) {
+        ap_rprintf(r, "crowdsec_verdicts_total{decision=\"%s\"} %u\n",
+                   crowdsec_decision_names[i], m->verdicts[i]);
+    }
+
+    ap_rputs("# HELP crowdsec_lookup_duration_seconds Time requests spent "
+             "in lookups to the crowdsec service.\n"
+             "# TYPE crowdsec_lookup_duration_seconds histogram\n", r);
+    for (i = 0; i < CROWDSEC_LATENCY_BUCKETS; i++) {
+        total += m->latency[i];
+        ap_rprintf(r, "crowdsec_lookup_duration_seconds_bucket{le=\"%g\"} "
+                   "%u\n", (double) crowdsec_latency_bounds[i] /
+                   APR_USEC_PER_SEC, total);
+    }
+    total += m->latency[i];
+    ap_rprintf(r, "crowdsec_lookup_duration_seconds_bucket{le=\"+Inf\"} %u\n"
+               "crowdsec_lookup_duration_seconds_sum %.3f\n"
+               "crowdsec_lookup_duration_seconds_count %u\n", total,
+               (double) m->latency_ms / 1000, m->lookups);
+
+    if (hdr) {
+        ap_rprintf(r, "# HELP crowdsec_store_decisions Decisions in the "
+                   "decision store, by scope.\n"
+                   "# TYPE crowdsec_store_decisions gauge\n"
+                   "crowdsec_store_decisions{scope=\"ip\"} %u\n"
+                   "crowdsec_store_decisions{scope=\"range\"} %u\n"
+                   "crowdsec_store_decisions{scope=\"country_as\"} %u\n"
+                   "# HELP crowdsec_store_age_seconds Time since the "
+                   "decisions were last pulled, -1 if never.\n"
+                   "# TYPE crowdsec_store_age_seconds gauge\n"
+                   "crowdsec_store_age_seconds %" APR_INT64_T_FMT "\n",
+                   crowdsec_snapshot_used(hdr), hdr->ranges_used,
+                   hdr->scoped_used,
+                   crowdsec_metrics_age(hdr));
+    }
+}
+
+/*
+ * Write the counters as a JSON object.
+ */
+static void crowdsec_metrics_json(request_rec * r,
+                                  const crowdsec_metrics_t * m,
+                                  const crowdsec_snapshot_hdr_t * hdr)
+{
+    apr_uint32_t total = 0;
+    apr_size_t i;
+
+    ap_rputs("{", r);
+
+    for (i = 0; i < CROWDSEC_COUNTERS; i++) {
+        ap_rprintf(r, "\"%s\":%u,", crowdsec_counters[i].name,
+                   crowdsec_metrics_counter(m, i));
+    }
+
+    ap_rputs("\"verdicts\":{", r);
+    for (i = 0; i <= CROWDSEC_DECISION_BAN; i++) {
+        ap_rprintf(r, "%s\"%s\":%u", i ? "," : "",
+                   crowdsec_decision_names[i], m->verdicts[i]);
+    }
+
+    ap_rprintf(r, "},\"lookups\":{\"count\":%u,\"sum_ms\":%u,\"buckets\":{",
+               m->lookups, m->latency_ms);
+    for (i = 0; i < CROWDSEC_LATENCY_BUCKETS; i++) {
+        total += m->latency[i];
+        ap_rprintf(r, "\"%g\":%u,", (double) crowdsec_latency_bounds[i] /
+                   APR_USEC_PER_SEC, total);
+    }
+    total += m->latency[i];
+    ap_rprintf(r, "\"+Inf\":%u}}", total);
+
+    if (hdr) {
+        ap_rprintf(r, ",\"store\":{\"ip\":%u,\"range\":%u,\"country_as\":%u,"
+                   "\"age\":%" APR_INT64_T_FMT "}",
+                   crowdsec_snapshot_used(hdr), hdr->ranges_used, hdr->scoped_used,
+                   crowdsec_metrics_age(hdr));
+    }
+
+    ap_rputs("}\n", r);
+}
+
+/**
+ * The crowdsec-metrics handler: report the counters in the Prometheus
+ * text format, or as JSON when asked for with ?json.
+ */
+static int crowdsec_metrics_handle(request_rec * r)
+{
+    crowdsec_metrics_t m;
+    crowdsec_snapshot_hdr_t hdr;
+    int have_store, json;
+
+    if (!r->handler || strcmp(r->handler, crowdsec_metrics_handler)) {
+        return DECLINED;
+    }
+
+    r->allowed = (AP_METHOD_BIT << M_GET);
+    if (r->method_number != M_GET) {
+        return DECLINED;
+    }
+
+    if (!crowdsec_metrics) {
+        return HTTP_NOT_FOUND;
+    }
+
+    json = r->args && !strcmp(r->args, "json");
+
+    ap_set_content_type(r, json ? "application/json" :
+                        "text/plain; version=0.0.4");
+
+    if (r->header_only) {
+        return OK;
+    }
+
+    crowdsec_metrics_read(&m);
+    have_store = crowdsec_metrics_store(r->server, &hdr);
+
+    if (json) {
+        crowdsec_metrics_json(r, &m, have_store ? &hdr : NULL);
+    }
+    else {
+        crowdsec_metrics_prometheus(r, &m, have_store ? &hdr : NULL);
+    }
+
+    return OK;
+}
+
+/*
+ * Add the counters to the mod_status page.
+ */
+static int crowdsec_status_hook(request_rec * r, int flags)
+{
+    crowdsec_metrics_t m;
+    crowdsec_snapshot_hdr_t hdr;
+    int have_store;
+    apr_size_t i;
+
+    if (!crowdsec_metrics) {
+        return OK;
+    }
+
+    crowdsec_metrics_read(&m);
+    have_store = crowdsec_metrics_store(r->server, &hdr);
+
+    if (flags & AP_STATUS_SHORT) {
+
+        for (i = 0; i < CROWDSEC_COUNTERS; i++) {
+            ap_rprintf(r, "Crowdsec%s: %u\n", crowdsec_counters[i].title,
+                       crowdsec_metrics_counter(&m, i));
+        }
+        ap_rprintf(r, "CrowdsecLookups: %u\n"
+                   "CrowdsecLookupMs: %u\n", m.lookups, m.latency_ms);
+        for (i = 0; i <= CROWDSEC_DECISION_BAN; i++) {
+            ap_rprintf(r, "CrowdsecVerdicts%c%s: %u\n",
+                       apr_toupper(crowdsec_decision_names[i][0]),
+                       crowdsec_decision_names[i] + 1, m.verdicts[i]);
+        }
+        if (have_store) {
+            ap_rprintf(r, "CrowdsecStoreIp: %u\n"
+                       "CrowdsecStoreRange: %u\n"
+                       "CrowdsecStoreCountryAs: %u\n"
+                       "CrowdsecStoreAge: %" APR_INT64_T_FMT "\n",
+                       crowdsec_snapshot_used(&hdr), hdr.ranges_used,
+                       hdr.scoped_used, crowdsec_metrics_age(&hdr));
+        }
+
+        return OK;
+    }
+
+    ap_rputs("<hr />\n<h2>Crowdsec</h2>\n<table>\n", r);
+    for (i = 0; i < CROWDSEC_COUNTERS; i++) {
+        ap_rprintf(r, "<tr><td>%s</td><td>%u</td></tr>\n",
+                   crowdsec_counters[i].help,
+                   crowdsec_metrics_counter(&m, i));
+    }
+    ap_rprintf(r, "<tr><td>Lookups made by requests.</td><td>%u, %.1f ms "
+               "on average</td></tr>\n", m.lookups,
+               m.lookups ? (double) m.latency_ms / m.lookups : 0.0);
+    for (i = 0; i <= CROWDSEC_DECISION_BAN; i++) {
+        ap_rprintf(r, "<tr><td>Verdicts of %s.</td><td>%u</td></tr>\n",
+                   crowdsec_decision_names[i], m.verdicts[i]);
+    }
+    if (have_store) {
+        ap_rprintf(r, "<tr><td>Decisions in the store.</td><td>%u address, "
+                   "%u range, %u country and AS</td></tr>\n"
+                   "<tr><td>Seconds since the decisions were pulled."
+                   "</td><td>%" APR_INT64_T_FMT "</td></tr>\n",
+                   crowdsec_snapshot_used(&hdr), hdr.ranges_used,
+                   hdr.scoped_used,
+                   crowdsec_metrics_age(&hdr));
+    }
+    ap_rputs("</table>\n", r);
+
+    return OK;
+}
+
+/**
+ * CROWDSEC filter: Soak up the response from the API.
+ *
+ * The response may arrive over several calls. Each bucket is fed in place
+ * to the parser in the capture passed as the filter context, and nothing
+ * is copied or kept, crowdsec_proxy reads the result once the subrequest
+ * is done.
+ */
+static apr_status_t crowdsec_out_filter(ap_filter_t * f,
+                                        apr_bucket_brigade * bb)
+{
+
+    crowdsec_capture_t *cap = f->ctx;
+    apr_bucket *e;
+
+    for (e = APR_BRIGADE_FIRST(bb);
+         e != APR_BRIGADE_SENTINEL(bb);
+         e = APR_BUCKET_NEXT(e)) {
+
+        const char *data;
+        apr_size_t len;
+        apr_status_t status;
+
+        if (APR_BUCKET_IS_EOS(e)) {
+            cap->eos = 1;
+            break;
+        }
+
+        if (APR_BUCKET_IS_METADATA(e) || cap->invalid) {
+            continue;
+        }
+
+        status = apr_bucket_read(e, &data, &len, APR_BLOCK_READ);
+        if (status != APR_SUCCESS) {
+            apr_brigade_cleanup(bb);
+            return status;
+        }
+
+        cap->len += len;
+
+        if (len && !crowdsec_json_feed(&cap->js, data, len)) {
+            cap->invalid = 1;
+        }
+
+    }
+
+    apr_brigade_cleanup(bb);
+
+    return APR_SUCCESS;
+}
+
+/**
+ * Cap the input filter stack, returning nothing.
+ */
+static apr_status_t null_in_filter(ap_filter_t * f, apr_bucket_brigade * bb,
+                                   ap_input_mode_t mode,
+                                   apr_read_type_e block, apr_off_t readbytes)
+{
+    apr_bucket *e;
+
+    /* all the null filter does is insert an EOS, and then return success. */
+    e = apr_bucket_eos_create(f->c->bucket_alloc);
+    APR_BRIGADE_INSERT_TAIL(bb, e);
+
+    return APR_SUCCESS;
+}
+
+static void *create_crowdsec_dir_config(apr_pool_t * p, char *d)
+{
+    crowdsec_config_rec *conf = apr_pcalloc(p, sizeof(crowdsec_config_rec));
+
+    conf->blockedhttpcode = HTTP_TOO_MANY_REQUESTS;
+
+    return conf;
+}
+
+static void *merge_crowdsec_dir_config(apr_pool_t * p, void *basev,
+                                       void *addv)
+{
+    crowdsec_config_rec *new = (crowdsec_config_rec *) apr_pcalloc(p,
+                                                                   sizeof
+                                                                   (crowdsec_config_rec));
+    crowdsec_config_rec *add = (crowdsec_config_rec *) addv;
+    crowdsec_config_rec *base = (crowdsec_config_rec *) basev;
+
+    new->enable = (add->enable_set == 0) ? base->enable : add->enable;
+    new->enable_set = add->enable_set || base->enable_set;
+
+    new->fallback = (add->fallback_set == 0) ? base->fallback : add->fallback;
+    new->fallback_set = add->fallback_set || base->fallback_set;
+
+    new->location = (add->location_set == 0) ? base->location : add->location;
+    new->location_str =
+        (add->location_set == 0) ? base->location_str : add->location_str;
+    new->location_body =
+        (add->location_set == 0) ? base->location_body : add->location_body;
+    new->location_set = add->location_set || base->location_set;
+
+    new->blockedhttpcode = (add->blockedhttpcode_set == 0) ? base->blockedhttpcode : add->blockedhttpcode;
+    new->blockedhttpcode_set = add->blockedhttpcode_set || base->blockedhttpcode_set;
+
+    return new;
+}
+
+static void *create_crowdsec_server_config(apr_pool_t * p, server_rec * s)
+{
+    crowdsec_server_rec *conf = apr_pcalloc(p, sizeof(crowdsec_server_rec));
+
+    conf->cache_timeout = apr_time_from_sec(CROWDSEC_CACHE_TIMEOUT_DEFAULT);
+    conf->stream_interval = apr_time_from_sec(CROWDSEC_STREAM_INTERVAL_DEFAULT);
+    conf->store_size = CROWDSEC_STORE_SIZE_DEFAULT;
+    conf->coalesce_timeout =
+        apr_time_from_sec(CROWDSEC_COALESCE_TIMEOUT_DEFAULT);
+    conf->connect_timeout =
+        apr_time_from_sec(CROWDSEC_CONNECT_TIMEOUT_DEFAULT);
+    conf->timeout = apr_time_from_sec(CROWDSEC_TIMEOUT_DEFAULT);
+    conf->breaker_failures = CROWDSEC_BREAKER_FAILURES_DEFAULT;
+    conf->breaker_retry = apr_time_from_sec(CROWDSEC_BREAKER_RETRY_DEFAULT);
+    conf->l1_timeout = apr_time_from_sec(CROWDSEC_L1_TIMEOUT_DEFAULT);
+    conf->conn_cache_timeout =
+        apr_time_from_sec(CROWDSEC_CONN_CACHE_TIMEOUT_DEFAULT);
+
+    return conf;
+}
+
+/* cache-related settings are not merged here, but in the post_config hook,
+ * since the cache has not yet sprung to life
+ */
+static void *merge_crowdsec_server_config(apr_pool_t * p, void *basev,
+                                          void *addv)
+{
+    crowdsec_server_rec *new = (crowdsec_server_rec *) apr_pcalloc(p,
+                                                                   sizeof
+                                                                   (crowdsec_server_rec));
+    crowdsec_server_rec *add = (crowdsec_server_rec *) addv;
+    crowdsec_server_rec *base = (crowdsec_server_rec *) basev;
+
+    new->url = (add->url_set == 0) ? base->url : add->url;
+    new->urls = (add->url_set == 0) ? base->urls : add->urls;
+    new->url_set = add->url_set || base->url_set;
+
+    new->key = (add->key_set == 0) ? base->key : add->key;
+    new->key_set = add->key_set || base->key_set;
+
+    new->cache_provider =
+        (add->cache_provider_set ==
+         0) ? base->cache_provider : add->cache_provider;
+    new->cache_instance =
+        (add->cache_provider_set ==
+         0) ? base->cache_instance : add->cache_instance;
+    new->cache_provider_set = add->cache_provider_set
+        || base->cache_provider_set;
+
+    new->cache_timeout =
+        (add->cache_timeout_set ==
+         0) ? base->cache_timeout : add->cache_timeout;
+    new->cache_timeout_set = add->cache_timeout_set
+        || base->cache_timeout_set;
+
+    new->cache_allow_timeout =
+        (add->cache_allow_timeout_set ==
+         0) ? base->cache_allow_timeout : add->cache_allow_timeout;
+    new->cache_allow_timeout_set = add->cache_allow_timeout_set
+        || base->cache_allow_timeout_set;
+
+    new->cache_ban_timeout =
+        (add->cache_ban_timeout_set ==
+         0) ? base->cache_ban_timeout : add->cache_ban_timeout;
+    new->cache_ban_timeout_set = add->cache_ban_timeout_set
+        || base->cache_ban_timeout_set;
+
+    new->cache_refresh =
+        (add->cache_refresh_set ==
+         0) ? base->cache_refresh : add->cache_refresh;
+    new->cache_refresh_set = add->cache_refresh_set
+        || base->cache_refresh_set;
+
+    new->cache_stale =
+        (add->cache_stale_set ==
+         0) ? base->cache_stale : add->cache_stale;
+    new->cache_stale_set = add->cache_stale_set
+        || base->cache_stale_set;
+
+    new->l1_size = (add->l1_size_set == 0) ? base->l1_size : add->l1_size;
+    new->l1_size_set = add->l1_size_set || base->l1_size_set;
+
+    new->l1_timeout =
+        (add->l1_timeout_set ==
+         0) ? base->l1_timeout : add->l1_timeout;
+    new->l1_timeout_set = add->l1_timeout_set || base->l1_timeout_set;
+
+    new->conn_cache_timeout =
+        (add->conn_cache_timeout_set ==
+         0) ? base->conn_cache_timeout : add->conn_cache_timeout;
+    new->conn_cache_timeout_set = add->conn_cache_timeout_set
+        || base->conn_cache_timeout_set;
+
+    new->mode = (add->mode_set == 0) ? base->mode : add->mode;
+    new->mode_set = add->mode_set || base->mode_set;
+
+    new->stream_interval =
+        (add->stream_interval_set ==
+         0) ? base->stream_interval : add->stream_interval;
+    new->stream_interval_set = add->stream_interval_set
+        || base->stream_interval_set;
+
+    new->stream_snapshot =
+        (add->stream_snapshot_set ==
+         0) ? base->stream_snapshot : add->stream_snapshot;
+    new->stream_snapshot_set = add->stream_snapshot_set
+        || base->stream_snapshot_set;
+
+    new->store_size =
+        (add->store_size_set == 0) ? base->store_size : add->store_size;
+    new->store_size_set = add->store_size_set || base->store_size_set;
+
+    new->coalesce_timeout =
+        (add->coalesce_timeout_set ==
+         0) ? base->coalesce_timeout : add->coalesce_timeout;
+    new->coalesce_timeout_set = add->coalesce_timeout_set
+        || base->coalesce_timeout_set;
+
+    new->client = (add->client_set == 0) ? base->client : add->client;
+    new->client_set = add->client_set || base->client_set;
+
+    new->connect_timeout =
+        (add->connect_timeout_set ==
+         0) ? base->connect_timeout : add->connect_timeout;
+    new->connect_timeout_set = add->connect_timeout_set
+        || base->connect_timeout_set;
+
+    new->timeout = (add->timeout_set == 0) ? base->timeout : add->timeout;
+    new->timeout_set = add->timeout_set || base->timeout_set;
+
+    new->max_lookups =
+        (add->max_lookups_set == 0) ? base->max_lookups : add->max_lookups;
+    new->max_lookups_set = add->max_lookups_set || base->max_lookups_set;
+
+    new->breaker_failures =
+        (add->breaker_failures_set ==
+         0) ? base->breaker_failures : add->breaker_failures;
+    new->breaker_failures_set = add->breaker_failures_set
+        || base->breaker_failures_set;
+
+    new->breaker_retry =
+        (add->breaker_retry_set ==
+         0) ? base->breaker_retry : add->breaker_retry;
+    new->breaker_retry_set = add->breaker_retry_set
+        || base->breaker_retry_set;
+
+    new->batch_window =
+        (add->batch_window_set ==
+         0) ? base->batch_window : add->batch_window;
+    new->batch_window_set = add->batch_window_set
+        || base->batch_window_set;
+
+    new->geo_files =
+        (add->geo_files_set == 0) ? base->geo_files : add->geo_files;
+    new->geo_files_set = add->geo_files_set || base->geo_files_set;
+
+    new->trusted = (add->trusted_set == 0) ? base->trusted : add->trusted;
+    new->trusted_set = add->trusted_set || base->trusted_set;
+
+    new->conn_filter =
+        (add->conn_filter_set == 0) ? base->conn_filter : add->conn_filter;
+    new->conn_filter_set = add->conn_filter_set || base->conn_filter_set;
+
+    new->throttle_rate =
+        (add->throttle_set == 0) ? base->throttle_rate : add->throttle_rate;
+    new->throttle_burst =
+        (add->throttle_set == 0) ? base->throttle_burst : add->throttle_burst;
+    new->throttle_set = add->throttle_set || base->throttle_set;
+
+    new->hedge = (add->hedge_set == 0) ? base->hedge : add->hedge;
+    new->hedge_percentile =
+        (add->hedge_set == 0) ? base->hedge_percentile :
+        add->hedge_percentile;
+    new->hedge_set = add->hedge_set || base->hedge_set;
+
+    return new;
+}
+
+static int crowdsec_pre_config(apr_pool_t * pconf, apr_pool_t * plog,
+                               apr_pool_t * ptmp)
+{
+    apr_status_t rv = ap_mutex_register(pconf, crowdsec_id,
+                                        NULL, APR_LOCK_DEFAULT, 0);
+    if (rv != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_CRIT, rv, plog,
+                      "failed to register %s mutex", crowdsec_id);
+        return 500;             /* An HTTP status would be a misnomer! */
+    }
+
+    return OK;
+}
+
+/*
+ * Set up the endpoints for each of the CrowdsecURLs. Stream mode and the
+ * builtin client talk to the crowdsec service directly, and need a plain
+ * http url. With more than one url, the state of each lives in shared
+ * memory, so that all children balance and fail over alike.
+ */
+static int crowdsec_endpoints_config(apr_pool_t * pconf, apr_pool_t * plog,
+                                     apr_pool_t * ptmp, server_rec * s,
+                                     int startup)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(s->module_config,
+                             &crowdsec_module);
+
+    const char **urls;
+    const char *what = NULL;
+    crowdsec_endpoint_state_t *state;
+    int i, n;
+
+    if (!sconf->urls || !sconf->urls->nelts) {
+        return OK;
+    }
+
+    if (sconf->mode == CROWDSEC_MODE_STREAM) {
+        what = "CrowdsecMode stream";
+    }
+    else if (sconf->client == CROWDSEC_CLIENT_BUILTIN) {
+        what = "CrowdsecClient builtin";
+    }
+
+    urls = (const char **) sconf->urls->elts;
+    n = sconf->urls->nelts;
+
+    if (!startup && n > 1) {
+        apr_shm_t *shm;
+        apr_status_t status;
+
+        status = crowdsec_shm_create(&shm,
+                                     n * sizeof(crowdsec_endpoint_state_t),
+                                     crowdsec_endpoints_id, pconf, ptmp, s);
+        if (status != APR_SUCCESS) {
+            ap_log_perror(APLOG_MARK, APLOG_CRIT, status, plog,
+                          "crowdsec: failed to create endpoint state");
+            return 500;         /* An HTTP status would be a misnomer! */
+        }
+
+        state = apr_shm_baseaddr_get(shm);
+        memset(state, 0, n * sizeof(crowdsec_endpoint_state_t));
+    }
+    else {
+        state = apr_pcalloc(pconf, n * sizeof(crowdsec_endpoint_state_t));
+    }
+
+    sconf->endpoints = apr_array_make(pconf, n, sizeof(crowdsec_endpoint_t));
+    sconf->endpoint_next = 0;
+
+    for (i = 0; i < n; i++) {
+        crowdsec_endpoint_t *ep = apr_array_push(sconf->endpoints);
+
+        memset(ep, 0, sizeof(crowdsec_endpoint_t));
+        ep->url = urls[i];
+        ep->state = &state[i];
+
+        if (!what) {
+            continue;
+        }
+
+        if (apr_uri_parse(pconf, ep->url, &ep->uri) != APR_SUCCESS ||
+            !ep->uri.scheme || strcmp(ep->uri.scheme, "http") ||
+            !ep->uri.hostname) {
+            ap_log_perror(APLOG_MARK, APLOG_CRIT, 0, plog,
+                          "crowdsec: %s requires a CrowdsecURL "
+                          "of the form http://host:port, not '%s'", what,
+                          ep->url);
+            return 500;         /* An HTTP status would be a misnomer! */
+        }
+
+        if (!ep->uri.port) {
+            ep->uri.port = apr_uri_port_of_scheme(ep->uri.scheme);
+        }
+
+        if (ep->uri.path) {
+            apr_size_t len = strlen(ep->uri.path);
+
+            while (len && ep->uri.path[len - 1] == '/') {
+                ep->uri.path[--len] = 0;
+            }
+        }
+    }
+
+    return OK;
+}
+
+/*
+ * The circuit breaker lives in shared memory, so that all children see
+ * the crowdsec service fail, and only one of them probes it.
+ */
+static int crowdsec_breaker_config(apr_pool_t * pconf, apr_pool_t * plog,
+                                   apr_pool_t * ptmp, server_rec * s)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(s->module_config,
+                             &crowdsec_module);
+
+    apr_shm_t *shm;
+    apr_status_t status;
+
+    status = crowdsec_shm_create(&shm, sizeof(crowdsec_breaker_t),
+                                 crowdsec_breaker_id, pconf, ptmp, s);
+    if (status != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_CRIT, status, plog,
+                      "crowdsec: failed to create circuit breaker");
+        return 500;             /* An HTTP status would be a misnomer! */
+    }
+
+    sconf->breaker = apr_shm_baseaddr_get(shm);
+    memset(sconf->breaker, 0, sizeof(crowdsec_breaker_t));
+
+    return OK;
+}
+
+static apr_status_t cleanup_metrics(void *data)
+{
+    crowdsec_metrics = NULL;
+
+    return APR_SUCCESS;
+}
+
+/*
+ * The counters live in shared memory, so that they add up the work of
+ * all children. They start again from zero on restart.
+ */
+static int crowdsec_metrics_config(apr_pool_t * pconf, apr_pool_t * plog,
+                                   apr_pool_t * ptmp, server_rec * s)
+{
+    apr_shm_t *shm;
+    apr_status_t status;
+
+    status = crowdsec_shm_create(&shm, sizeof(crowdsec_metrics_t),
+                                 crowdsec_metrics_id, pconf, ptmp, s);
+    if (status != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_CRIT, status, plog,
+                      "crowdsec: failed to create counters");
+        return 500;             /* An HTTP status would be a misnomer! */
+    }
+
+    crowdsec_metrics = apr_shm_baseaddr_get(shm);
+    memset(crowdsec_metrics, 0, sizeof(crowdsec_metrics_t));
+
+    apr_pool_cleanup_register(pconf, NULL, cleanup_metrics,
+                              apr_pool_cleanup_null);
+
+    return OK;
+}
+
+static apr_status_t cleanup_throttle(void *data)
+{
+    crowdsec_throttles = NULL;
+
+    return APR_SUCCESS;
+}
+
+/*
+ * The throttle slots live in shared memory, shared by all servers, and
+ * are created once the first server with CrowdsecThrottle is seen.
+ */
+static int crowdsec_throttle_config(apr_pool_t * pconf, apr_pool_t * plog,
+                                    apr_pool_t * ptmp, server_rec * s)
+{
+    apr_shm_t *shm;
+    apr_size_t size = CROWDSEC_THROTTLE_SLOTS * sizeof(crowdsec_throttle_t);
+    apr_status_t status;
+
+    if (crowdsec_throttles) {
+        return OK;
+    }
+
+    status = crowdsec_shm_create(&shm, size, crowdsec_throttle_id, pconf,
+                                 ptmp, s);
+    if (status != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_CRIT, status, plog,
+                      "crowdsec: failed to create throttle");
+        return 500;             /* An HTTP status would be a misnomer! */
+    }
+
+    crowdsec_throttles = apr_shm_baseaddr_get(shm);
+    memset(crowdsec_throttles, 0, size);
+
+    apr_pool_cleanup_register(pconf, NULL, cleanup_throttle,
+                              apr_pool_cleanup_null);
+
+    return OK;
+}
+
+static apr_uint32_t crowdsec_pow2(apr_uint32_t n)
+{
+    apr_uint32_t size = 1;
+
+    while (size < n) {
+        size <<= 1;
+    }
+
+    return size;
+}
+
+/*
+ * The service keeps a single stream position per API key, so servers
+ * pulling from the same CrowdsecURLs with the same key must share the one
+ * store: two stores would each consume changes the other never sees.
+ */
+static const char *crowdsec_stream_key(apr_pool_t * p,
+                                       const crowdsec_server_rec * sconf)
+{
+    const char *key = sconf->key ? sconf->key : "";
+    int i;
+
+    for (i = 0; i < sconf->urls->nelts; i++) {
+        key = apr_pstrcat(p, key, " ",
+                          APR_ARRAY_IDX(sconf->urls, i, const char *), NULL);
+    }
+
+    return key;
+}
+
+static int crowdsec_strings_equal(const apr_array_header_t * a,
+                                  const apr_array_header_t * b)
+{
+    int i;
+
+    if (!a || !b || a->nelts != b->nelts) {
+        return (!a || !a->nelts) && (!b || !b->nelts);
+    }
+
+    for (i = 0; i < a->nelts; i++) {
+        if (strcmp(APR_ARRAY_IDX(a, i, const char *),
+                   APR_ARRAY_IDX(b, i, const char *))) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Name the first setting a server sharing a store disagrees on with the
+ * server that made it, or return NULL if they agree.
+ */
+static const char *crowdsec_stream_conflict(const crowdsec_server_rec * sconf,
+                                            const crowdsec_server_rec * owner)
+{
+    if (sconf->store_size != owner->store_size) {
+        return "CrowdsecDecisionStoreSize";
+    }
+    if (sconf->stream_interval != owner->stream_interval) {
+        return "CrowdsecStreamInterval";
+    }
+    if (!crowdsec_strings_equal(sconf->geo_files, owner->geo_files)) {
+        return "CrowdsecGeoDatabase";
+    }
+    if ((sconf->stream_snapshot != NULL) != (owner->stream_snapshot != NULL) ||
+        (sconf->stream_snapshot &&
+         strcmp(sconf->stream_snapshot, owner->stream_snapshot))) {
+        return "CrowdsecStreamSnapshot";
+    }
+
+    return NULL;
+}
+
+static int crowdsec_stream_config(apr_pool_t * pconf, apr_pool_t * plog,
+                                  apr_pool_t * ptmp, server_rec * s,
+                                  apr_hash_t * stores)
+{
+
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(s->module_config,
+                             &crowdsec_module);
+
+    crowdsec_server_rec *owner;
+    server_rec *owner_s;
+    crowdsec_store_t *store;
+    apr_size_t size, snap_size;
+    apr_size_t v4_len, v6_len, ranges_len, nodes_len, scoped_len;
+    apr_uint32_t v4_max, v6_max, v4_slots, v6_slots, filter_size;
+    const char *key;
+    int i;
+
+    APR_OPTIONAL_FN_TYPE(ap_watchdog_get_instance) *wd_get_instance;
+    APR_OPTIONAL_FN_TYPE(ap_watchdog_register_callback) *wd_register_callback;
+
+    ap_watchdog_t *watchdog;
+    apr_status_t status;
+
+    if (!sconf->url) {
+        return OK;
+    }
+
+    key = crowdsec_stream_key(ptmp, sconf);
+
+    owner_s = apr_hash_get(stores, key, APR_HASH_KEY_STRING);
+    if (owner_s) {
+        const char *conflict;
+
+        owner = (crowdsec_server_rec *)
+            ap_get_module_config(owner_s->module_config, &crowdsec_module);
+        conflict = crowdsec_stream_conflict(sconf, owner);
+
+        if (conflict) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s,
+                         "crowdsec: %s differs from that of server %s:%d, "
+                         "which pulls decisions from the same CrowdsecURL "
+                         "with the same CrowdsecAPIKey into the same "
+                         "decision store", conflict,
+                         owner_s->server_hostname, owner_s->port);
+            return 500;         /* An HTTP status would be a misnomer! */
+        }
+
+        sconf->store = owner->store;
+#ifdef HAVE_MAXMINDDB
+        sconf->geo = owner->geo;
+#endif
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                     "crowdsec: sharing the decision store of another "
+                     "server pulling the same decisions");
+        return OK;
+    }
+
+    sconf->stream_conn = crowdsec_conn_create(pconf);
+
+#ifdef HAVE_MAXMINDDB
+    if (sconf->geo_files) {
+
+        /* mapped once here, and shared read only by all children */
+        sconf->geo = apr_array_make(pconf, sconf->geo_files->nelts,
+                                    sizeof(MMDB_s));
+
+        for (i = 0; i < sconf->geo_files->nelts; i++) {
+            const char *fname = APR_ARRAY_IDX(sconf->geo_files, i,
+                                              const char *);
+            MMDB_s *mmdb = apr_array_push(sconf->geo);
+            int rv = MMDB_open(fname, MMDB_MODE_MMAP, mmdb);
+
+            if (rv != MMDB_SUCCESS) {
+                ap_log_perror(APLOG_MARK, APLOG_CRIT, 0, plog,
+                              "crowdsec: could not open GeoIP database "
+                              "'%s': %s", fname, MMDB_strerror(rv));
+                apr_array_pop(sconf->geo);
+                return 500;     /* An HTTP status would be a misnomer! */
+            }
+
+            apr_pool_cleanup_register(pconf, mmdb, cleanup_mmdb,
+                                      apr_pool_cleanup_null);
+        }
+
+    }
+#endif
+
+    store = apr_pcalloc(pconf, sizeof(crowdsec_store_t));
+
+    /* each table is kept at most half full */
+    v4_max = (apr_uint32_t) sconf->store_size;
+    v6_max = v4_max / CROWDSEC_STORE_IPV6_SHARE;
+    if (v6_max < CROWDSEC_STORE_SIZE_MIN) {
+        v6_max = CROWDSEC_STORE_SIZE_MIN;
+    }
+    v4_slots = crowdsec_pow2(v4_max * 2);
+    v6_slots = crowdsec_pow2(v6_max * 2);
+
+    filter_size = crowdsec_pow2((v4_max + v6_max + CROWDSEC_STORE_RANGES) /
+                                CROWDSEC_STORE_FILTER_LOAD);
+    if (filter_size < CROWDSEC_STORE_SIZE_MIN) {
+        filter_size = CROWDSEC_STORE_SIZE_MIN;
+    }
+
+    v4_len = APR_ALIGN_DEFAULT((apr_size_t) v4_slots * 4) +
+        APR_ALIGN_DEFAULT(v4_slots) +
+        APR_ALIGN_DEFAULT(v4_slots * sizeof(crowdsec_entry_t));
+    v6_len = APR_ALIGN_DEFAULT((apr_size_t) v6_slots * 16) +
+        APR_ALIGN_DEFAULT(v6_slots) +
+        APR_ALIGN_DEFAULT(v6_slots * sizeof(crowdsec_entry_t));
+    ranges_len =
+        APR_ALIGN_DEFAULT(CROWDSEC_STORE_RANGES * sizeof(crowdsec_range_t));
+    nodes_len =
+        APR_ALIGN_DEFAULT(CROWDSEC_STORE_NODES * sizeof(crowdsec_node_t));
+    scoped_len =
+        APR_ALIGN_DEFAULT(CROWDSEC_STORE_SCOPED * sizeof(crowdsec_scoped_t));
+
+    snap_size = APR_ALIGN_DEFAULT(sizeof(crowdsec_snapshot_hdr_t)) +
+        v4_len + v6_len + ranges_len + nodes_len + scoped_len +
+        APR_ALIGN_DEFAULT(filter_size * sizeof(crowdsec_bucket_t));
+    size = APR_ALIGN_DEFAULT(sizeof(crowdsec_store_hdr_t)) + 2 * snap_size;
+
+    status = crowdsec_shm_create(&store->shm, size, crowdsec_store_id,
+                                 pconf, ptmp, s);
+    if (status != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_CRIT, status, plog,
+                      "crowdsec: failed to create %" APR_SIZE_T_FMT
+                      " byte decision store", size);
+        return 500;             /* An HTTP status would be a misnomer! */
+    }
+
+    store->hdr = apr_shm_baseaddr_get(store->shm);
+    memset(store->hdr, 0, size);
+
+    for (i = 0; i < 2; i++) {
+        crowdsec_snapshot_t *snap = &store->snap[i];
+        char *base = (char *) store->hdr +
+            APR_ALIGN_DEFAULT(sizeof(crowdsec_store_hdr_t)) + i * snap_size;
+        int t;
+
+        snap->hdr = (crowdsec_snapshot_hdr_t *) base;
+        base += APR_ALIGN_DEFAULT(sizeof(crowdsec_snapshot_hdr_t));
+
+        snap->tables[CROWDSEC_TABLE_IPV4].size = v4_slots;
+        snap->tables[CROWDSEC_TABLE_IPV4].max = v4_max;
+        snap->tables[CROWDSEC_TABLE_IPV4].key_len = 4;
+        snap->tables[CROWDSEC_TABLE_IPV6].size = v6_slots;
+        snap->tables[CROWDSEC_TABLE_IPV6].max = v6_max;
+        snap->tables[CROWDSEC_TABLE_IPV6].key_len = 16;
+
+        for (t = 0; t < CROWDSEC_TABLES; t++) {
+            crowdsec_table_t *table = &snap->tables[t];
+
+            table->keys = (unsigned char *) base;
+            base += APR_ALIGN_DEFAULT((apr_size_t) table->size *
+                                      table->key_len);
+            table->states = (apr_byte_t *) base;
+            base += APR_ALIGN_DEFAULT(table->size);
+            table->entries = (crowdsec_entry_t *) base;
+            base += APR_ALIGN_DEFAULT(table->size *
+                                      sizeof(crowdsec_entry_t));
+        }
+
+        snap->ranges = (crowdsec_range_t *) base;
+        base += ranges_len;
+        snap->nodes = (crowdsec_node_t *) base;
+        base += nodes_len;
+        snap->scoped = (crowdsec_scoped_t *) base;
+        base += scoped_len;
+        snap->filter = (crowdsec_bucket_t *) base;
+        snap->max_ranges = CROWDSEC_STORE_RANGES;
+        snap->max_nodes = CROWDSEC_STORE_NODES;
+        snap->max_scoped = CROWDSEC_STORE_SCOPED;
+        snap->filter_size = filter_size;
+        snap->hdr->nodes_top = CROWDSEC_NODE_ROOTS;
+        snap->hdr->epoch = apr_time_from_sec(apr_time_sec(apr_time_now()));
+    }
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                 "crowdsec: created %" APR_SIZE_T_FMT " byte decision store "
+                 "for %u IPv4 and %u IPv6 address decisions", size, v4_max,
+                 v6_max);
+
+    /*
+     * Start from the decisions saved before the restart, if any. The file
+     * may be up to a minute old, and the service hands out changes since
+     * our last pull rather than since the file was saved, so whatever
+     * changed in between would be lost for good on a delta. The saved
+     * decisions are served while the first pull fetches the full set.
+     */
+    if (sconf->stream_snapshot &&
+        crowdsec_snapshot_load(s, &store->snap[0], sconf->stream_snapshot,
+                               ptmp)) {
+        apr_atomic_set32(&store->hdr->resync, 1);
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
+                     "crowdsec: loaded %u address and %u range decisions "
+                     "from snapshot file '%s'",
+                     crowdsec_snapshot_used(store->snap[0].hdr),
+                     store->snap[0].hdr->ranges_used, sconf->stream_snapshot);
+    }
+
+    sconf->store = store;
+    apr_hash_set(stores, key, APR_HASH_KEY_STRING, s);
+
+    wd_get_instance = APR_RETRIEVE_OPTIONAL_FN(ap_watchdog_get_instance);
+    wd_register_callback =
+        APR_RETRIEVE_OPTIONAL_FN(ap_watchdog_register_callback);
+
+    if (!wd_get_instance || !wd_register_callback) {
+        ap_log_perror(APLOG_MARK, APLOG_CRIT, 0, plog,
+                      "crowdsec: CrowdsecMode stream requires mod_watchdog "
+                      "to be loaded");
+        return 500;             /* An HTTP status would be a misnomer! */
+    }
+
+    /* one child updates the store on behalf of all children */
+    status = wd_get_instance(&watchdog, CROWDSEC_WATCHDOG_NAME, 0, 1, pconf);
+    if (status != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_CRIT, status, plog,
+                      "crowdsec: failed to create %s watchdog",
+                      CROWDSEC_WATCHDOG_NAME);
+        return 500;             /* An HTTP status would be a misnomer! */
+    }
+
+    status = wd_register_callback(watchdog, sconf->stream_interval, s,
+                                  crowdsec_watchdog_callback);
+    if (status != APR_SUCCESS) {
+        ap_log_perror(APLOG_MARK, APLOG_CRIT, status, plog,
+                      "crowdsec: failed to register %s watchdog callback",
+                      CROWDSEC_WATCHDOG_NAME);
+        return 500;             /* An HTTP status would be a misnomer! */
+    }
+
+    return OK;
+}
+
+static int crowdsec_post_config(apr_pool_t * pconf, apr_pool_t * plog,
+                                apr_pool_t * ptmp, server_rec * s)
+{
+    apr_status_t status;
+
+    server_rec *s_vhost;
+
+    /* the decision stores made so far, keyed on what they pull */
+    apr_hash_t *stores = apr_hash_make(ptmp);
+
+    static struct ap_socache_hints cache_hints =
+        { CROWDSEC_CACHE_KEY_LEN, sizeof(crowdsec_verdict_t), 60000000 };
+
+    /* the watchdog is only started once the configuration is final */
+    int startup = ap_state_query(AP_SQ_MAIN_STATE) ==
+        AP_SQ_MS_CREATE_PRE_CONFIG;
+
+    if (!startup) {
+
+        int rv = crowdsec_metrics_config(pconf, plog, ptmp, s);
+
+        if (rv != OK) {
+            return rv;
+        }
+
+    }
+
+    crowdsec_conn_cache = 0;
+
+    s_vhost = s;
+    while (s_vhost) {
+
+        crowdsec_server_rec *sconf;
+
+        sconf = (crowdsec_server_rec *)
+            ap_get_module_config(s_vhost->module_config, &crowdsec_module);
+
+        if (sconf->url && sconf->conn_cache_timeout) {
+            crowdsec_conn_cache = 1;
+        }
+
+        if (sconf->cache_provider_set) {
+
+            /* providers safe across processes need no mutex of ours */
+            if (sconf->cache_provider->flags & AP_SOCACHE_FLAG_NOTMPSAFE) {
+
+                status = ap_global_mutex_create(&sconf->cache_mutex, NULL,
+                                                crowdsec_id, NULL, s_vhost,
+                                                pconf, 0);
+                if (status != APR_SUCCESS) {
+                    ap_log_perror(APLOG_MARK, APLOG_CRIT, status, plog,
+                                  "failed to create %s mutex", crowdsec_id);
+                    return 500; /* An HTTP status would be a misnomer! */
+                }
+                apr_pool_cleanup_register(pconf, (void *) s_vhost,
+                                          cleanup_lock,
+                                          apr_pool_cleanup_null);
+
+            }
+
+
+            status =
+                sconf->cache_provider->init(sconf->cache_instance,
+                                            crowdsec_id, &cache_hints,
+                                            s_vhost, pconf);
+
+            if (status != APR_SUCCESS) {
+                ap_log_perror(APLOG_MARK, APLOG_CRIT, status, plog,
+                              "failed to initialise %s cache", crowdsec_id);
+                return 500;     /* An HTTP status would be a misnomer! */
+            }
+            apr_pool_cleanup_register(pconf, (void *) s_vhost, cleanup_cache,
+                                      apr_pool_cleanup_null);
+
+        }
+
+        if (sconf->url) {
+
+            int rv = crowdsec_endpoints_config(pconf, plog, ptmp, s_vhost,
+                                               startup);
+
+            if (rv != OK) {
+                return rv;
+            }
+
+        }
+
+        if (sconf->batch_window && !startup &&
+            (sconf->mode != CROWDSEC_MODE_LIVE ||
+             sconf->client != CROWDSEC_CLIENT_BUILTIN)) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s_vhost,
+                         "crowdsec: CrowdsecBatchWindow needs "
+                         "CrowdsecClient builtin in live mode, and is "
+                         "ignored");
+        }
+
+        if ((sconf->hedge || sconf->hedge_percentile) && !startup &&
+            (sconf->mode != CROWDSEC_MODE_LIVE ||
+             sconf->client != CROWDSEC_CLIENT_BUILTIN ||
+             !sconf->urls || sconf->urls->nelts < 2)) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s_vhost,
+                         "crowdsec: CrowdsecHedge needs several CrowdsecURLs "
+                         "and CrowdsecClient builtin in live mode, and is "
+                         "ignored");
+        }
+
+        if (sconf->hedge && sconf->hedge >= sconf->timeout) {
+            ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s_vhost,
+                         "crowdsec: CrowdsecHedge of %" APR_TIME_T_FMT
+                         "ms must be shorter than CrowdsecTimeout of %"
+                         APR_TIME_T_FMT "ms", apr_time_as_msec(sconf->hedge),
+                         apr_time_as_msec(sconf->timeout));
+            return 500; /* An HTTP status would be a misnomer! */
+        }
+
+        if (sconf->url && sconf->throttle_rate && !startup) {
+
+            int rv = crowdsec_throttle_config(pconf, plog, ptmp, s);
+
+            if (rv != OK) {
+                return rv;
+            }
+
+        }
+
+        if (sconf->conn_filter && !startup &&
+            sconf->mode != CROWDSEC_MODE_STREAM) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s_vhost,
+                         "crowdsec: CrowdsecConnectionFilter needs "
+                         "CrowdsecMode stream, and is ignored");
+        }
+
+        if (sconf->store_size_set && !startup &&
+            sconf->mode != CROWDSEC_MODE_STREAM) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s_vhost,
+                         "crowdsec: CrowdsecDecisionStoreSize needs "
+                         "CrowdsecMode stream, and is ignored");
+        }
+
+        if (sconf->l1_size && !startup &&
+            (sconf->mode != CROWDSEC_MODE_LIVE || !sconf->cache_provider)) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s_vhost,
+                         "crowdsec: CrowdsecCacheL1 needs CrowdsecCache in "
+                         "live mode, and is ignored");
+        }
+
+        if (sconf->cache_refresh && !startup &&
+            (sconf->mode != CROWDSEC_MODE_LIVE ||
+             sconf->client != CROWDSEC_CLIENT_BUILTIN ||
+             !sconf->cache_provider)) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s_vhost,
+                         "crowdsec: CrowdsecCacheRefresh needs "
+                         "CrowdsecCache and CrowdsecClient builtin in live "
+                         "mode, and is ignored");
+        }
+
+        if (sconf->url && sconf->mode == CROWDSEC_MODE_LIVE &&
+            sconf->breaker_failures && !startup) {
+
+            int rv = crowdsec_breaker_config(pconf, plog, ptmp, s_vhost);
+
+            if (rv != OK) {
+                return rv;
+            }
+
+        }
+
+        if (sconf->mode == CROWDSEC_MODE_STREAM && !startup) {
+
+            int rv = crowdsec_stream_config(pconf, plog, ptmp, s_vhost,
+                                            stores);
+
+            if (rv != OK) {
+                return rv;
+            }
+
+        }
+
+        s_vhost = s_vhost->next;
+    }
+
+
+    return OK;
+}
+
+static void crowdsec_child_init(apr_pool_t * pchild, server_rec * s)
+{
+    server_rec *s_vhost;
+    int threaded = 0, threads = 0;
+
+    if (ap_mpm_query(AP_MPMQ_IS_THREADED, &threaded) != APR_SUCCESS) {
+        threaded = AP_MPMQ_NOT_SUPPORTED;
+    }
+    if (threaded != AP_MPMQ_NOT_SUPPORTED &&
+        (ap_mpm_query(AP_MPMQ_MAX_THREADS, &threads) != APR_SUCCESS ||
+         threads < 1)) {
+        threads = 1;
+    }
+
+    for (s_vhost = s; s_vhost; s_vhost = s_vhost->next) {
+
+        crowdsec_server_rec *sconf;
+        apr_status_t status;
+        int pooled;
+
+        sconf = (crowdsec_server_rec *)
+            ap_get_module_config(s_vhost->module_config, &crowdsec_module);
+
+        if (!sconf->url || sconf->mode != CROWDSEC_MODE_LIVE) {
+            continue;
+        }
+
+        if (!sconf->max_lookups_set) {
+            /* leave the other half of the threads to everyone else */
+            sconf->max_lookups = threads > 1 ? threads / 2 : 0;
+        }
+
+        if (sconf->l1_size && sconf->cache_provider) {
+            sconf->l1 = crowdsec_l1_create(pchild,
+                                           (apr_uint32_t) sconf->l1_size,
+                                           threaded != AP_MPMQ_NOT_SUPPORTED,
+                                           sconf->l1_timeout);
+            if (!sconf->l1) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, 0, s_vhost,
+                             "crowdsec: failed to create the per child "
+                             "cache, CrowdsecCacheL1 is ignored");
+            }
+        }
+
+        pooled = 0;
+        if (sconf->client == CROWDSEC_CLIENT_BUILTIN && sconf->endpoints) {
+            crowdsec_endpoint_t *eps =
+                (crowdsec_endpoint_t *) sconf->endpoints->elts;
+            int i;
+
+            for (i = 0; i < sconf->endpoints->nelts; i++) {
+                crowdsec_endpoint_t *ep = &eps[i];
+#if APR_HAS_THREADS
+                if (threaded != AP_MPMQ_NOT_SUPPORTED) {
+                    status = apr_reslist_create(&ep->conns, 0, threads,
+                                                threads, CROWDSEC_CONN_TTL,
+                                                crowdsec_conn_construct,
+                                                crowdsec_conn_destruct, ep,
+                                                pchild);
+                    if (status != APR_SUCCESS) {
+                        ap_log_error(APLOG_MARK, APLOG_ERR, status, s_vhost,
+                                     "crowdsec: failed to create connection "
+                                     "pool for '%s'", ep->url);
+                        ep->conns = NULL;
+                    }
+                    else {
+                        pooled = 1;
+                    }
+                }
+                else
+#endif
+                {
+                    ep->conn = crowdsec_conn_create(pchild);
+                    if (ep->conn) {
+                        ep->conn->endpoint = ep;
+                    }
+                }
+            }
+        }
+
+#if APR_HAS_THREADS
+        if (threaded != AP_MPMQ_NOT_SUPPORTED && sconf->batch_window &&
+            sconf->client == CROWDSEC_CLIENT_BUILTIN) {
+            crowdsec_batch_start(pchild, s_vhost);
+        }
+
+        /* created after the connections, so that it is destroyed first */
+        if (threaded != AP_MPMQ_NOT_SUPPORTED && sconf->cache_refresh &&
+            sconf->cache_provider && pooled) {
+            status = apr_thread_pool_create(&sconf->refresh_pool, 0,
+                                            CROWDSEC_REFRESH_THREADS, pchild);
+            if (status != APR_SUCCESS) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, status, s_vhost,
+                             "crowdsec: failed to create refresh threads, "
+                             "cache entries will not be refreshed");
+                sconf->refresh_pool = NULL;
+            }
+        }
+#endif
+
+#if APR_HAS_THREADS
+        if (threaded == AP_MPMQ_NOT_SUPPORTED || !sconf->coalesce_timeout) {
+            /* one request at a time, nothing to coalesce within the child */
+            continue;
+        }
+
+        status = apr_thread_mutex_create(&sconf->flight_mutex,
+                                         APR_THREAD_MUTEX_DEFAULT, pchild);
+        if (status != APR_SUCCESS) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, status, s_vhost,
+                         "crowdsec: failed to create lookup mutex, "
+                         "lookups will not be coalesced");
+            sconf->flight_mutex = NULL;
+            continue;
+        }
+
+        sconf->flights = apr_hash_make(pchild);
+        sconf->flight_pool = pchild;
+#endif
+
+    }
+}
+
+/*
+ * Drop the connection should the peer have a ban decision, before any
+ * other module sees it, and so before the TLS handshake.
+ *
+ * Otherwise give the connection somewhere to remember its verdict. This
+ * is done here rather than on the first request, as the streams of an
+ * HTTP/2 connection share the memo of the master connection, and would
+ * race to create it.
+ */
+static int crowdsec_pre_connection(conn_rec * c, void *csd)
+{
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(c->base_server->module_config,
+                             &crowdsec_module);
+
+    crowdsec_memo_t *memo;
+
+#if AP_MODULE_MAGIC_AT_LEAST(20120211, 52)
+    if (c->master) {
+        return OK;
+    }
+#endif
+
+    if (sconf->conn_filter && sconf->mode == CROWDSEC_MODE_STREAM &&
+        sconf->url && !crowdsec_trusted(sconf, c->client_addr)) {
+
+        crowdsec_verdict_t verdict;
+
+        if (crowdsec_store_find(sconf, c->client_addr, apr_time_now(),
+                                &verdict) &&
+            verdict.type == CROWDSEC_DECISION_BAN) {
+
+            ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0, c,
+                          "crowdsec: ip address '%s' has a ban decision, "
+                          "connection dropped", c->client_ip);
+
+            crowdsec_count(connections_dropped);
+
+            /* no other pre_connection hook runs, nor any protocol */
+            c->aborted = 1;
+            return DONE;
+        }
+
+    }
+
+    if (!crowdsec_conn_cache) {
+        return OK;
+    }
+
+    memo = apr_pcalloc(c->pool, sizeof(crowdsec_memo_t));
+    ap_set_module_config(c->conn_config, &crowdsec_module, memo);
+
+    return OK;
+}
+
+static const char *set_crowdsec(cmd_parms * cmd, void *dconf, int flag)
+{
+    crowdsec_config_rec *conf = dconf;
+
+    conf->enable = flag;
+    conf->enable_set = 1;
+
+    return NULL;
+}
+
+
+
+static const char *set_crowdsec_fallback(cmd_parms * cmd, void *dconf, const char *fallback)
+{
+    crowdsec_config_rec *conf = dconf;
+
+    if (!strcmp(fallback, "fail")) {
+        conf->fallback = CROWDSEC_FAIL;
+    }
+    else if (!strcmp(fallback, "block")) {
+        conf->fallback = CROWDSEC_BLOCK;
+    }
+    else if (!strcmp(fallback, "allow")) {
+        conf->fallback = CROWDSEC_ALLOW;
+    }
+    else {
+        return apr_psprintf(cmd->pool,
+                            "Unknown CrowdsecFallback '%s'. Valid values "
+                            "are 'fail', 'block' and 'allow'.", fallback);
+    }
+
+    conf->fallback_set = 1;
+
+    return NULL;
+}
+
+
+static const char *set_crowdsec_blockedhttpcode(cmd_parms * cmd, void *dconf, const char *blockedhttpcode)
+{
+    crowdsec_config_rec *conf = dconf;
+    int http_code = atoi(blockedhttpcode);
+
+    //let's restrict to a few values to avoid weird stuff:
+    // 200, 403, 500, 429
+    switch (http_code) {
+        case HTTP_FORBIDDEN:
+        case HTTP_INTERNAL_SERVER_ERROR:
+        case HTTP_TOO_MANY_REQUESTS:
+        //case 418: /*Apache won't let me do that :<*/
+            conf->blockedhttpcode = http_code;
+            break;
+        default:
+            return apr_psprintf(cmd->pool,
+                                "Unknown CrowdsecBlockedHTTPCode '%s'. Valid values "
+                                "are 403, 500 and 429.", blockedhttpcode);
+    }
+
+    conf->blockedhttpcode_set = 1;
+
+    return NULL;
+}
+
+static const char *set_crowdsec_location(cmd_parms *cmd, void *dconf,
+                                const char *location)
+{
+    crowdsec_config_rec *conf = dconf;
+
+    const char *expr_err = NULL;
+
+    conf->location = ap_expr_parse_cmd(cmd, location, AP_EXPR_FLAG_STRING_RESULT,
+            &expr_err, NULL);
+    if (expr_err) {
+        return apr_pstrcat(cmd->temp_pool,
+                "crowdsec: cannot parse expression '", location, "' in CrowdsecLocation: ",
+                      expr_err, NULL);
+    }
+
+    /* with no variables and no escapes, the expression is the string */
+    conf->location_str = NULL;
+    conf->location_body = NULL;
+    if (!ap_strchr_c(location, '%') && !ap_strchr_c(location, '\\')) {
+        conf->location_str = location;
+        if (ap_is_url(location)) {
+            conf->location_body = apr_pstrcat(cmd->pool,
+                    CROWDSEC_BLOCK_HEAD("302 Found", "Found"),
+                    "<p>The document has moved <a href=\"",
+                    ap_escape_html(cmd->pool, location),
+                    "\">here</a>.</p>\n", CROWDSEC_BLOCK_TAIL, NULL);
+        }
+    }
+
+    conf->location_set = 1;
+
+    return NULL;
+}
+
+static const char *set_crowdsec_url(cmd_parms * cmd, void *dconf,
+                                    const char *url)
+{
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
+
+    if (!sconf->urls) {
+        sconf->urls = apr_array_make(cmd->pool, 2, sizeof(const char *));
+        sconf->url = url;
+    }
+    APR_ARRAY_PUSH(sconf->urls, const char *) = url;
+    sconf->url_set = 1;
+
+    return NULL;
+}
+
+static const char *set_crowdsec_api_key(cmd_parms * cmd, void *dconf,
+                                        const char *key)
+{
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
+
+    sconf->key = key;
+    sconf->key_set = 1;
+
+    return NULL;
+}
+
+static const char *set_crowdsec_cache(cmd_parms * cmd, void *dconf,
+                                      const char *cache)
+{
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
+
+    const char *err;
+    const char *param, *name;
+
+    /* Argument is of form 'name:args' or just 'name'. */
+    param = ap_strchr_c(cache, ':');
+    if (param) {
+        name = apr_pstrmemdup(cmd->pool, cache, param - cache);
+        param++;
+    }
+    else {
+        name = cache;
+    }
+
+    if (!strcmp(name, crowdsec_native_cache.name)) {
+        sconf->cache_provider = &crowdsec_native_cache;
+    }
+    else {
+        sconf->cache_provider =
+            ap_lookup_provider(AP_SOCACHE_PROVIDER_GROUP, name,
+                               AP_SOCACHE_PROVIDER_VERSION);
+    }
+    if (sconf->cache_provider == NULL) {
+        err = apr_psprintf(cmd->pool,
+                           "Unknown socache provider '%s'. Maybe you need "
+                           "to load the appropriate socache module "
+                           "(mod_socache_%s?)", name, name);
+    }
+    else {
+        err = sconf->cache_provider->create(&sconf->cache_instance, param,
+                                            cmd->temp_pool, cmd->pool);
+    }
+
+    if (err) {
+        err = apr_psprintf(cmd->pool, "CrowdsecCache: %s", err);
+
+        return err;
+    }
+
+    sconf->cache_provider_set = 1;
+
+    return err;
+}
+
+static const char *set_crowdsec_cache_timeout(cmd_parms * cmd, void *dconf,
+                                              const char *timeout)
+{
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
+
+    int secs = atoi(timeout);
+
+    sconf->cache_timeout = apr_time_from_sec(secs);
+    sconf->cache_timeout_set = 1;
+
+    return NULL;
+}
+
+static const char *set_crowdsec_cache_allow_timeout(cmd_parms * cmd,
+                                                    void *dconf,
+                                                    const char *timeout)
+{
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
+
+    int secs = atoi(timeout);
+
+    if (secs < 0) {
+        return apr_psprintf(cmd->pool,
+                            "CrowdsecCacheAllowTimeout '%s' must not be "
+                            "negative.", timeout);
+    }
+
+    sconf->cache_allow_timeout = apr_time_from_sec(secs);
+    sconf->cache_allow_timeout_set = 1;
+
+    return NULL;
+}
+
+static const char *set_crowdsec_cache_refresh(cmd_parms * cmd, void *dconf,
+                                              const char *window)
+{
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
+
+    int secs = atoi(window);
+
+    if (secs < 0) {
+        return apr_psprintf(cmd->pool,
+                            "CrowdsecCacheRefresh '%s' must not be "
+                            "negative.", window);
+    }
+
+    sconf->cache_refresh = apr_time_from_sec(secs);
+    sconf->cache_refresh_set = 1;
+
+    return NULL;
+}
+
+static const char *set_crowdsec_cache_stale(cmd_parms * cmd, void *dconf,
+                                            const char *timeout)
+{
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
+
+    int secs = atoi(timeout);
+
+    if (secs < 0) {
+        return apr_psprintf(cmd->pool,
+                            "CrowdsecCacheStale '%s' must not be "
+                            "negative.", timeout);
+    }
+
+    sconf->cache_stale = apr_time_from_sec(secs);
+    sconf->cache_stale_set = 1;
+
+    return NULL;
+}
+
+static const char *set_crowdsec_cache_l1(cmd_parms * cmd, void *dconf,
+                                         const char *size)
+{
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
+
+    int entries = atoi(size);
+
+    if (entries < 0) {
+        return apr_psprintf(cmd->pool,
+                            "CrowdsecCacheL1 '%s' must not be negative.",
+                            size);
+    }
+
+    sconf->l1_size = entries;
+    sconf->l1_size_set = 1;
+
+    return NULL;
+}
+
+static const char *set_crowdsec_connection_cache(cmd_parms * cmd,
+                                                 void *dconf,
+                                                 const char *timeout)
+{
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
+
+    apr_interval_time_t t;
+
+    if (ap_timeout_parameter_parse(timeout, &t, "s") != APR_SUCCESS ||
+        t < 0) {
+        return apr_psprintf(cmd->pool,
+                            "CrowdsecConnectionCache '%s' must be a time, "
+                            "such as 1 or 500ms, or 0 to disable.", timeout);
+    }
+
+    sconf->conn_cache_timeout = t;
+    sconf->conn_cache_timeout_set = 1;
+
+    return NULL;
+}
+
+static const char *set_crowdsec_cache_l1_timeout(cmd_parms * cmd,
+                                                 void *dconf,
+                                                 const char *timeout)
+{
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
+
+    apr_interval_time_t t;
+
+    if (ap_timeout_parameter_parse(timeout, &t, "s") != APR_SUCCESS ||
+        t <= 0) {
+        return apr_psprintf(cmd->pool,
+                            "CrowdsecCacheL1Timeout '%s' must be a positive "
+                            "time, such as 1 or 500ms.", timeout);
+    }
+
+    sconf->l1_timeout = t;
+    sconf->l1_timeout_set = 1;
+
+    return NULL;
+}
+
+static const char *set_crowdsec_cache_ban_timeout(cmd_parms * cmd,
+                                                  void *dconf,
+                                                  const char *timeout)
+{
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
+
+    int secs = atoi(timeout);
+
+    if (secs < 0) {
+        return apr_psprintf(cmd->pool,
+                            "CrowdsecCacheBanTimeout '%s' must not be "
+                            "negative.", timeout);
+    }
+
+    sconf->cache_ban_timeout = apr_time_from_sec(secs);
+    sconf->cache_ban_timeout_set = 1;
+
+    return NULL;
+}
+
+static const char *set_crowdsec_mode(cmd_parms * cmd, void *dconf,
+                                     const char *mode)
+{
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
+
+    if (!strcmp(mode, "live")) {
+        sconf->mode = CROWDSEC_MODE_LIVE;
+    }
+    else if (!strcmp(mode, "stream")) {
+        sconf->mode = CROWDSEC_MODE_STREAM;
+    }
+    else {
+        return apr_psprintf(cmd->pool,
+                            "Unknown CrowdsecMode '%s'. Valid values "
+                            "are 'live' and 'stream'.", mode);
+    }
+
+    sconf->mode_set = 1;
+
+    return NULL;
+}
+
+static const char *set_crowdsec_stream_interval(cmd_parms * cmd, void *dconf,
+                                                const char *interval)
+{
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
+
+    int secs = atoi(interval);
+
+    if (secs < 1) {
+        return apr_psprintf(cmd->pool,
+                            "CrowdsecStreamInterval '%s' must be a positive "
+                            "number of seconds.", interval);
+    }
+
+    sconf->stream_interval = apr_time_from_sec(secs);
+    sconf->stream_interval_set = 1;
+
+    return NULL;
+}
+
+static const char *set_crowdsec_store_size(cmd_parms * cmd, void *dconf,
+                                           const char *size)
+{
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
+
+    apr_int64_t n = apr_atoi64(size);
+
+    if (n < CROWDSEC_STORE_SIZE_MIN || n > CROWDSEC_STORE_SIZE_MAX) {
+        return apr_psprintf(cmd->pool,
+                            "CrowdsecDecisionStoreSize '%s' must be between "
+                            "%d and %d.", size, CROWDSEC_STORE_SIZE_MIN,
+                            CROWDSEC_STORE_SIZE_MAX);
+    }
+
+    sconf->store_size = (int) n;
+    sconf->store_size_set = 1;
+
+    return NULL;
 }
 
-static void *create_crowdsec_server_config(apr_pool_t * p, server_rec * s)
+static const char *set_crowdsec_stream_snapshot(cmd_parms * cmd, void *dconf,
+                                                const char *fname)
 {
-    crowdsec_server_rec *conf = apr_pcalloc(p, sizeof(crowdsec_server_rec));
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
 
-    conf->cache_timeout = apr_time_from_sec(CROWDSEC_CACHE_TIMEOUT_DEFAULT);
+    if (!strcasecmp(fname, "none")) {
+        sconf->stream_snapshot = NULL;
+    }
+    else {
+        sconf->stream_snapshot = ap_server_root_relative(cmd->pool, fname);
+        if (!sconf->stream_snapshot) {
+            return apr_psprintf(cmd->pool,
+                                "CrowdsecStreamSnapshot '%s' is not a valid "
+                                "path.", fname);
+        }
+    }
+    sconf->stream_snapshot_set = 1;
 
-    return conf;
+    return NULL;
 }
 
-/* cache-related settings are not merged here, but in the post_config hook,
- * since the cache has not yet sprung to life
- */
-static void *merge_crowdsec_server_config(apr_pool_t * p, void *basev,
-                                          void *addv)
+static const char *set_crowdsec_coalesce_timeout(cmd_parms * cmd,
+                                                 void *dconf,
+                                                 const char *timeout)
 {
-    crowdsec_server_rec *new = (crowdsec_server_rec *) apr_pcalloc(p,
-                                                                   sizeof
-                                                                   (crowdsec_server_rec));
-    crowdsec_server_rec *add = (crowdsec_server_rec *) addv;
-    crowdsec_server_rec *base = (crowdsec_server_rec *) basev;
-
-    new->url = (add->url_set == 0) ? base->url : add->url;
-    new->url_set = add->url_set || base->url_set;
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
 
-    new->key = (add->key_set == 0) ? base->key : add->key;
-    new->key_set = add->key_set || base->key_set;
+    int secs = atoi(timeout);
 
-    new->cache_provider =
-        (add->cache_provider_set ==
-         0) ? base->cache_provider : add->cache_provider;
-    new->cache_instance =
-        (add->cache_provider_set ==
-         0) ? base->cache_instance : add->cache_instance;
-    new->cache_provider_set = add->cache_provider_set
-        || base->cache_provider_set;
+    if (secs < 0) {
+        return apr_psprintf(cmd->pool,
+                            "CrowdsecCoalesceTimeout '%s' must not be "
+                            "negative.", timeout);
+    }
 
-    new->cache_timeout =
-        (add->cache_timeout_set ==
-         0) ? base->cache_timeout : add->cache_timeout;
-    new->cache_timeout_set = add->cache_timeout_set
-        || base->cache_timeout_set;
+    sconf->coalesce_timeout = apr_time_from_sec(secs);
+    sconf->coalesce_timeout_set = 1;
 
-    return new;
+    return NULL;
 }
 
-static int crowdsec_pre_config(apr_pool_t * pconf, apr_pool_t * plog,
-                               apr_pool_t * ptmp)
+static const char *set_crowdsec_max_lookups(cmd_parms * cmd, void *dconf,
+                                            const char *max)
 {
-    apr_status_t rv = ap_mutex_register(pconf, crowdsec_id,
-                                        NULL, APR_LOCK_DEFAULT, 0);
-    if (rv != APR_SUCCESS) {
-        ap_log_perror(APLOG_MARK, APLOG_CRIT, rv, plog,
-                      "failed to register %s mutex", crowdsec_id);
-        return 500;             /* An HTTP status would be a misnomer! */
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
+
+    int lookups = atoi(max);
+
+    if (lookups < 0) {
+        return apr_psprintf(cmd->pool,
+                            "CrowdsecMaxLookups '%s' must not be negative.",
+                            max);
     }
 
-    return OK;
+    sconf->max_lookups = lookups;
+    sconf->max_lookups_set = 1;
+
+    return NULL;
 }
 
-static int crowdsec_post_config(apr_pool_t * pconf, apr_pool_t * plog,
-                                apr_pool_t * ptmp, server_rec * s)
+static const char *set_crowdsec_circuit_breaker(cmd_parms * cmd,
+                                                void *dconf,
+                                                const char *failures)
 {
-    apr_status_t status;
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
 
-    server_rec *s_vhost;
+    int n = atoi(failures);
 
-    static struct ap_socache_hints cache_hints = { 48, 256, 60000000 };
+    if (n < 0) {
+        return apr_psprintf(cmd->pool,
+                            "CrowdsecCircuitBreaker '%s' must not be "
+                            "negative.", failures);
+    }
 
-    s_vhost = s;
-    while (s_vhost) {
+    sconf->breaker_failures = n;
+    sconf->breaker_failures_set = 1;
 
-        crowdsec_server_rec *sconf;
+    return NULL;
+}
 
-        sconf = (crowdsec_server_rec *)
-            ap_get_module_config(s_vhost->module_config, &crowdsec_module);
+static const char *set_crowdsec_circuit_retry(cmd_parms * cmd, void *dconf,
+                                              const char *retry)
+{
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
 
-        if (sconf->cache_provider_set) {
+    int secs = atoi(retry);
 
-            status = ap_global_mutex_create(&sconf->cache_mutex, NULL,
-                                            crowdsec_id, NULL, s_vhost, pconf,
-                                            0);
-            if (status != APR_SUCCESS) {
-                ap_log_perror(APLOG_MARK, APLOG_CRIT, status, plog,
-                              "failed to create %s mutex", crowdsec_id);
-                return 500;     /* An HTTP status would be a misnomer! */
-            }
-            apr_pool_cleanup_register(pconf, (void *) s_vhost, cleanup_lock,
-                                      apr_pool_cleanup_null);
+    if (secs < 1) {
+        return apr_psprintf(cmd->pool,
+                            "CrowdsecCircuitRetry '%s' must be at least "
+                            "one second.", retry);
+    }
 
+    sconf->breaker_retry = apr_time_from_sec(secs);
+    sconf->breaker_retry_set = 1;
 
-            status =
-                sconf->cache_provider->init(sconf->cache_instance,
-                                            crowdsec_id, &cache_hints,
-                                            s_vhost, pconf);
+    return NULL;
+}
 
-            if (status != APR_SUCCESS) {
-                ap_log_perror(APLOG_MARK, APLOG_CRIT, status, plog,
-                              "failed to initialise %s cache", crowdsec_id);
-                return 500;     /* An HTTP status would be a misnomer! */
-            }
-            apr_pool_cleanup_register(pconf, (void *) s_vhost, cleanup_cache,
-                                      apr_pool_cleanup_null);
+static const char *set_crowdsec_batch_window(cmd_parms * cmd, void *dconf,
+                                             const char *window)
+{
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
 
-        }
+    apr_interval_time_t t;
 
-        s_vhost = s_vhost->next;
+    if (ap_timeout_parameter_parse(window, &t, "ms") != APR_SUCCESS ||
+        t < 0 || t > apr_time_from_sec(1)) {
+        return apr_psprintf(cmd->pool,
+                            "CrowdsecBatchWindow '%s' must be a time of "
+                            "at most one second, such as 2 or 2ms.", window);
     }
 
+    sconf->batch_window = t;
+    sconf->batch_window_set = 1;
 
-    return OK;
+    return NULL;
 }
 
-static const char *set_crowdsec(cmd_parms * cmd, void *dconf, int flag)
+static const char *set_crowdsec_client(cmd_parms * cmd, void *dconf,
+                                       const char *client)
 {
-    crowdsec_config_rec *conf = dconf;
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
 
-    conf->enable = flag;
-    conf->enable_set = 1;
+    if (!strcmp(client, "proxy")) {
+        sconf->client = CROWDSEC_CLIENT_PROXY;
+    }
+    else if (!strcmp(client, "builtin")) {
+        sconf->client = CROWDSEC_CLIENT_BUILTIN;
+    }
+    else {
+        return apr_psprintf(cmd->pool,
+                            "Unknown CrowdsecClient '%s'. Valid values "
+                            "are 'proxy' and 'builtin'.", client);
+    }
+
+    sconf->client_set = 1;
 
     return NULL;
 }
 
-
-
-static const char *set_crowdsec_fallback(cmd_parms * cmd, void *dconf, const char *fallback)
+static const char *set_crowdsec_connect_timeout(cmd_parms * cmd, void *dconf,
+                                                const char *timeout)
 {
-    crowdsec_config_rec *conf = dconf;
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
 
-    if (!strcmp(fallback, "fail")) {
-        conf->fallback = CROWDSEC_FAIL;
-    }
-    else if (!strcmp(fallback, "block")) {
-        conf->fallback = CROWDSEC_BLOCK;
-    }
-    else if (!strcmp(fallback, "allow")) {
-        conf->fallback = CROWDSEC_ALLOW;
-    }
-    else {
+    apr_interval_time_t t;
+
+    if (ap_timeout_parameter_parse(timeout, &t, "s") != APR_SUCCESS ||
+        t <= 0) {
         return apr_psprintf(cmd->pool,
-                            "Unknown CrowdsecFallback '%s'. Valid values "
-                            "are 'fail', 'block' and 'allow'.", fallback);
+                            "CrowdsecConnectTimeout '%s' must be a positive "
+                            "time, such as 1 or 500ms.", timeout);
     }
 
-    conf->fallback_set = 1;
+    sconf->connect_timeout = t;
+    sconf->connect_timeout_set = 1;
 
     return NULL;
 }
 
-
-static const char *set_crowdsec_blockedhttpcode(cmd_parms * cmd, void *dconf, const char *blockedhttpcode)
+static const char *set_crowdsec_timeout(cmd_parms * cmd, void *dconf,
+                                        const char *timeout)
 {
-    crowdsec_config_rec *conf = dconf;
-    int http_code = atoi(blockedhttpcode);
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
 
-    //let's restrict to a few values to avoid weird stuff:
-    // 200, 403, 500, 429
-    switch (http_code) {
-        case HTTP_FORBIDDEN:
-        case HTTP_INTERNAL_SERVER_ERROR:
-        case HTTP_TOO_MANY_REQUESTS:
-        //case 418: /*Apache won't let me do that :<*/
-            conf->blockedhttpcode = http_code;
-            break;
-        default:
-            return apr_psprintf(cmd->pool,
-                                "Unknown CrowdsecBlockedHTTPCode '%s'. Valid values "
-                                "are 403, 500 and 429.", blockedhttpcode);
+    apr_interval_time_t t;
+
+    if (ap_timeout_parameter_parse(timeout, &t, "s") != APR_SUCCESS ||
+        t <= 0) {
+        return apr_psprintf(cmd->pool,
+                            "CrowdsecTimeout '%s' must be a positive "
+                            "time, such as 5 or 500ms.", timeout);
     }
 
-    conf->blockedhttpcode_set = 1;
+    sconf->timeout = t;
+    sconf->timeout_set = 1;
 
     return NULL;
 }
 
-static const char *set_crowdsec_location(cmd_parms *cmd, void *dconf,
-                                const char *location)
+static const char *set_crowdsec_hedge(cmd_parms * cmd, void *dconf,
+                                      const char *hedge)
 {
-    crowdsec_config_rec *conf = dconf;
+    crowdsec_server_rec *sconf = (crowdsec_server_rec *)
+        ap_get_module_config(cmd->server->module_config,
+                             &crowdsec_module);
 
-    const char *expr_err = NULL;
+    apr_size_t len = strlen(hedge);
+    apr_interval_time_t t = 0;
+    int percentile = 0;
 
-    conf->location = ap_expr_parse_cmd(cmd, location, AP_EXPR_FLAG_STRING_RESULT,
-            &expr_err, NULL);
-    if (expr_err) {
-        return apr_pstrcat(cmd->temp_pool,
-                "crowdsec: cannot parse expression '", location, "' in CrowdsecLocation: ",
-                      expr_err, NULL);
+    if (len && hedge[len - 1] == '%') {
+        percentile = atoi(hedge);
+        if (percentile < 1 || percentile > 99) {
+            return apr_psprintf(cmd->pool,
+                                "CrowdsecHedge '%s' must be a percentile "
+                                "between 1%% and 99%%.", hedge);
+        }
+    }
+    else if (ap_timeout_parameter_parse(hedge, &t, "ms") != APR_SUCCESS ||
+             t < 0) {
+        return apr_psprintf(cmd->pool,
+                            "CrowdsecHedge '%s' must be a time, such as "
+                            "50ms, or a percentile, such as 95%%.", hedge);
     }
 
-    conf->location_set = 1;
+    sconf->hedge = t;
+    sconf->hedge_percentile = percentile;
+    sconf->hedge_set = 1;
 
     return NULL;
 }
 
-static const char *set_crowdsec_url(cmd_parms * cmd, void *dconf,
-                                    const char *url)
+static const char *set_crowdsec_throttle(cmd_parms * cmd, void *dconf,
+                                         const char *rate,
+                                         const char *burst)
 {
     crowdsec_server_rec *sconf = (crowdsec_server_rec *)
         ap_get_module_config(cmd->server->module_config,
                              &crowdsec_module);
 
-    sconf->url = url;
-    sconf->url_set = 1;
+    int r = atoi(rate);
+    int b = burst ? atoi(burst) : r;
+
+    if (r < 0 || r > CROWDSEC_THROTTLE_RATE_MAX) {
+        return apr_psprintf(cmd->pool,
+                            "CrowdsecThrottle '%s' must be between 0 and %d "
+                            "requests a second.", rate,
+                            CROWDSEC_THROTTLE_RATE_MAX);
+    }
+
+    if (b < 1 && r) {
+        return apr_psprintf(cmd->pool,
+                            "CrowdsecThrottle burst '%s' must be at least 1.",
+                            burst);
+    }
+
+    if (r && b > CROWDSEC_THROTTLE_SPAN / (APR_USEC_PER_SEC / r)) {
+        return apr_psprintf(cmd->pool,
+                            "CrowdsecThrottle burst '%s' must be at most %d "
+                            "at %d requests a second.", burst,
+                            (int) (CROWDSEC_THROTTLE_SPAN /
+                                   (APR_USEC_PER_SEC / r)), r);
+    }
+
+    sconf->throttle_rate = r;
+    sconf->throttle_burst = b;
+    sconf->throttle_set = 1;
 
     return NULL;
 }
 
-static const char *set_crowdsec_api_key(cmd_parms * cmd, void *dconf,
-                                        const char *key)
+static const char *set_crowdsec_connection_filter(cmd_parms * cmd,
+                                                  void *dconf, int flag)
 {
     crowdsec_server_rec *sconf = (crowdsec_server_rec *)
         ap_get_module_config(cmd->server->module_config,
                              &crowdsec_module);
 
-    sconf->key = key;
-    sconf->key_set = 1;
+    sconf->conn_filter = flag;
+    sconf->conn_filter_set = 1;
 
     return NULL;
 }
 
-static const char *set_crowdsec_cache(cmd_parms * cmd, void *dconf,
-                                      const char *cache)
+/*
+ * Compile a trusted network, leaving out networks covered by another.
+ */
+static const char *set_crowdsec_trusted_networks(cmd_parms * cmd,
+                                                 void *dconf,
+                                                 const char *network)
 {
     crowdsec_server_rec *sconf = (crowdsec_server_rec *)
         ap_get_module_config(cmd->server->module_config,
                              &crowdsec_module);
 
-    const char *err;
-    const char *param, *name;
+    crowdsec_trusted_t t, *trusted;
+    crowdsec_ip_t ip, mask;
+    apr_byte_t bits;
+    int i;
 
-    /* Argument is of form 'name:args' or just 'name'. */
-    param = ap_strchr_c(cache, ':');
-    if (param) {
-        name = apr_pstrmemdup(cmd->pool, cache, param - cache);
-        param++;
-    }
-    else {
-        name = cache;
+    if (!crowdsec_prefix_parse(network, strlen(network), &ip, &bits)) {
+        return apr_psprintf(cmd->pool,
+                            "CrowdsecTrustedNetworks '%s' must be an address "
+                            "or a range such as 192.0.2.0/24.", network);
     }
 
-    sconf->cache_provider =
-        ap_lookup_provider(AP_SOCACHE_PROVIDER_GROUP, name,
-                           AP_SOCACHE_PROVIDER_VERSION);
-    if (sconf->cache_provider == NULL) {
-        err = apr_psprintf(cmd->pool,
-                           "Unknown socache provider '%s'. Maybe you need "
-                           "to load the appropriate socache module "
-                           "(mod_socache_%s?)", name, name);
+    memset(&mask, 0, sizeof(mask));
+    for (i = 0; i < bits; i++) {
+        mask.addr[i >> 3] |= 0x80 >> (i & 7);
     }
-    else {
-        err = sconf->cache_provider->create(&sconf->cache_instance, param,
-                                            cmd->temp_pool, cmd->pool);
+
+    memcpy(t.net, ip.addr, sizeof(t.net));
+    memcpy(t.mask, mask.addr, sizeof(t.mask));
+    t.family = ip.family;
+    t.bits = bits;
+
+    if (!sconf->trusted) {
+        sconf->trusted = apr_array_make(cmd->pool, 4,
+                                        sizeof(crowdsec_trusted_t));
     }
+    sconf->trusted_set = 1;
 
-    if (err) {
-        err = apr_psprintf(cmd->pool, "CrowdsecCache: %s", err);
+    trusted = (crowdsec_trusted_t *) sconf->trusted->elts;
+    for (i = 0; i < sconf->trusted->nelts; i++) {
 
-        return err;
+        crowdsec_trusted_t *wide = &trusted[i], *narrow = &t;
+
+        if (wide->family != t.family) {
+            continue;
+        }
+        if (wide->bits > t.bits) {
+            wide = &t;
+            narrow = &trusted[i];
+        }
+        if ((narrow->net[0] & wide->mask[0]) != wide->net[0] ||
+            (narrow->net[1] & wide->mask[1]) != wide->net[1]) {
+            continue;
+        }
+
+        if (wide == &trusted[i]) {
+            return NULL;
+        }
+
+        /* covered by the new network */
+        trusted[i--] = trusted[--sconf->trusted->nelts];
     }
 
-    sconf->cache_provider_set = 1;
+    APR_ARRAY_PUSH(sconf->trusted, crowdsec_trusted_t) = t;
 
-    return err;
+    return NULL;
 }
 
-static const char *set_crowdsec_cache_timeout(cmd_parms * cmd, void *dconf,
-                                              const char *timeout)
+static const char *set_crowdsec_geo_database(cmd_parms * cmd, void *dconf,
+                                             const char *file)
 {
+#ifdef HAVE_MAXMINDDB
     crowdsec_server_rec *sconf = (crowdsec_server_rec *)
         ap_get_module_config(cmd->server->module_config,
                              &crowdsec_module);
 
-    int secs = atoi(timeout);
+    const char *path = ap_server_root_relative(cmd->pool, file);
 
-    sconf->cache_timeout = apr_time_from_sec(secs);
-    sconf->cache_timeout_set = 1;
+    if (!path) {
+        return apr_psprintf(cmd->pool,
+                            "CrowdsecGeoDatabase '%s' is not a valid path.",
+                            file);
+    }
+
+    if (!sconf->geo_files) {
+        sconf->geo_files = apr_array_make(cmd->pool, 2, sizeof(const char *));
+    }
+    APR_ARRAY_PUSH(sconf->geo_files, const char *) = path;
+    sconf->geo_files_set = 1;
 
     return NULL;
+#else
+    return "CrowdsecGeoDatabase requires mod_crowdsec to be built with "
+        "libmaxminddb.";
+#endif
 }
 
 static const command_rec crowdsec_cmds[] = {
@@ -959,18 +9689,90 @@ static const command_rec crowdsec_cmds[] = {
     AP_INIT_TAKE1("CrowdsecLocation",
                   set_crowdsec_location, NULL, RSRC_CONF | ACCESS_CONF,
                   "Set to the URL to redirect to when the IP address is banned. As per RFC 7231 may be a path, or a full URL. For example: /sorry.html"),
-    AP_INIT_TAKE1("CrowdsecURL",
+    AP_INIT_ITERATE("CrowdsecURL",
                   set_crowdsec_url, NULL, RSRC_CONF,
-                  "Set to the URL of the Crowdsec API. For example: http://localhost:8080."),
+                  "Set to the URL of the Crowdsec API. For example: http://localhost:8080. Several may be given, and lookups go to the least busy of those answering."),
     AP_INIT_TAKE1("CrowdsecAPIKey",
                   set_crowdsec_api_key, NULL, RSRC_CONF,
                   "Set to the API key of the Crowdsec API. Add an API key using 'cscli bouncers add'."),
     AP_INIT_TAKE1("CrowdsecCache",
                   set_crowdsec_cache, NULL, RSRC_CONF,
-                  "Enable the crowdsec cache. Defaults to 'none'. Options detailed here: https://httpd.apache.org/docs/2.4/socache.html."),
+                  "Enable the crowdsec cache. Defaults to 'none'. Set to 'native' or 'native:entries' for the builtin shared memory cache. Other options detailed here: https://httpd.apache.org/docs/2.4/socache.html."),
     AP_INIT_TAKE1("CrowdsecCacheTimeout",
                   set_crowdsec_cache_timeout, NULL, RSRC_CONF,
                   "Set the crowdsec cache timeout. Defaults to 60 seconds."),
+    AP_INIT_TAKE1("CrowdsecCacheAllowTimeout",
+                  set_crowdsec_cache_allow_timeout, NULL, RSRC_CONF,
+                  "Set the crowdsec cache timeout for addresses with no decision. Defaults to CrowdsecCacheTimeout."),
+    AP_INIT_TAKE1("CrowdsecCacheBanTimeout",
+                  set_crowdsec_cache_ban_timeout, NULL, RSRC_CONF,
+                  "Set the longest time an address with a decision is cached. Entries never outlive the decision itself. Defaults to the remaining duration of the decision."),
+    AP_INIT_TAKE1("CrowdsecCacheL1",
+                  set_crowdsec_cache_l1, NULL, RSRC_CONF,
+                  "Set how many entries each child keeps in a cache of its own, in front of CrowdsecCache. Defaults to 0, none."),
+    AP_INIT_TAKE1("CrowdsecCacheL1Timeout",
+                  set_crowdsec_cache_l1_timeout, NULL, RSRC_CONF,
+                  "Set the longest time each child keeps an entry in its own cache, before reading it from CrowdsecCache again. Defaults to 1 second."),
+    AP_INIT_TAKE1("CrowdsecConnectionCache",
+                  set_crowdsec_connection_cache, NULL, RSRC_CONF,
+                  "Set the longest time the verdict on a client is remembered on its connection, for the requests that follow on it. Defaults to 1 second, 0 disables."),
+    AP_INIT_TAKE1("CrowdsecCacheStale",
+                  set_crowdsec_cache_stale, NULL, RSRC_CONF,
+                  "Set how long cache entries are kept beyond their expiry, to be served should the Crowdsec API fail rather than applying CrowdsecFallback. Defaults to 0, never."),
+    AP_INIT_TAKE1("CrowdsecCacheRefresh",
+                  set_crowdsec_cache_refresh, NULL, RSRC_CONF,
+                  "Set how long before expiry a cache entry that is hit is looked up again in the background. Needs CrowdsecClient builtin and a threaded MPM. Defaults to 0, never."),
+    AP_INIT_TAKE1("CrowdsecCoalesceTimeout",
+                  set_crowdsec_coalesce_timeout, NULL, RSRC_CONF,
+                  "Set how long a request waits for a lookup of the same IP address already in progress, before CrowdsecFallback applies. Set to 0 to look up every cache miss. Defaults to 5 seconds."),
+    AP_INIT_TAKE1("CrowdsecCircuitBreaker",
+                  set_crowdsec_circuit_breaker, NULL, RSRC_CONF,
+                  "Set how many lookups in a row must fail before the Crowdsec API is no longer contacted, and CrowdsecFallback applies at once. Set to 0 to always contact the API. Defaults to 5."),
+    AP_INIT_TAKE1("CrowdsecCircuitRetry",
+                  set_crowdsec_circuit_retry, NULL, RSRC_CONF,
+                  "Set how often a single lookup is let through to the Crowdsec API while it is not being contacted, to detect its recovery. Defaults to 5 seconds."),
+    AP_INIT_TAKE1("CrowdsecMaxLookups",
+                  set_crowdsec_max_lookups, NULL, RSRC_CONF,
+                  "Set how many requests of each child may wait on a lookup by the Crowdsec API at once, before CrowdsecFallback applies to requests needing another. Requests waiting on a lookup already in progress count too. Set to 0 for no limit. Defaults to half the threads of each child."),
+    AP_INIT_TAKE1("CrowdsecClient",
+                  set_crowdsec_client, NULL, RSRC_CONF,
+                  "Set to 'proxy' to query the Crowdsec API through a mod_proxy subrequest, or 'builtin' to use kept alive connections made directly to CrowdsecURL. Defaults to 'proxy'."),
+    AP_INIT_TAKE1("CrowdsecBatchWindow",
+                  set_crowdsec_batch_window, NULL, RSRC_CONF,
+                  "Set how long the builtin client gathers lookups in each child, before sending them pipelined over a single connection. Needs a threaded MPM. Defaults to 0, every lookup is sent on its own."),
+    AP_INIT_TAKE1("CrowdsecConnectTimeout",
+                  set_crowdsec_connect_timeout, NULL, RSRC_CONF,
+                  "Set how long to wait to connect to the Crowdsec API with the builtin client, and in stream mode. Defaults to 1 second."),
+    AP_INIT_TAKE1("CrowdsecTimeout",
+                  set_crowdsec_timeout, NULL, RSRC_CONF,
+                  "Set how long to wait for the Crowdsec API to respond with the builtin client. Defaults to 5 seconds."),
+    AP_INIT_TAKE1("CrowdsecMode",
+                  set_crowdsec_mode, NULL, RSRC_CONF,
+                  "Set to 'live' to query the Crowdsec API on each cache miss, or 'stream' to pull the decisions in the background and check requests locally. Stream mode requires mod_watchdog. Defaults to 'live'."),
+    AP_INIT_TAKE1("CrowdsecHedge",
+                  set_crowdsec_hedge, NULL, RSRC_CONF,
+                  "Set how long the builtin client waits for a lookup to one of several CrowdsecURLs, before sending it to another as well. May be a time, or a percentile of recent lookups such as 95%. Defaults to 0, never."),
+    AP_INIT_TAKE12("CrowdsecThrottle",
+                   set_crowdsec_throttle, NULL, RSRC_CONF,
+                   "Set the requests a second allowed to addresses with a throttle decision, and optionally how many at once, defaulting to the rate. Requests over the rate are turned away with 429 Too Many Requests. Defaults to 0, throttle decisions block."),
+    AP_INIT_FLAG("CrowdsecConnectionFilter",
+                 set_crowdsec_connection_filter, NULL, RSRC_CONF,
+                 "Drop connections from addresses with a ban decision as they are accepted, before TLS and HTTP. Needs CrowdsecMode stream. Defaults to off."),
+    AP_INIT_ITERATE("CrowdsecTrustedNetworks",
+                    set_crowdsec_trusted_networks, NULL, RSRC_CONF,
+                    "Set to one or more addresses or ranges, such as 127.0.0.1 or 10.0.0.0/8, whose requests are let through without being looked up."),
+    AP_INIT_ITERATE("CrowdsecGeoDatabase",
+                    set_crowdsec_geo_database, NULL, RSRC_CONF,
+                    "Set to one or more MaxMind databases, such as GeoLite2-Country.mmdb and GeoLite2-ASN.mmdb, to match Country and AS scoped decisions locally in stream mode."),
+    AP_INIT_TAKE1("CrowdsecStreamInterval",
+                  set_crowdsec_stream_interval, NULL, RSRC_CONF,
+                  "Set how often decisions are pulled from the Crowdsec API in stream mode. Defaults to 10 seconds."),
+    AP_INIT_TAKE1("CrowdsecStreamSnapshot",
+                  set_crowdsec_stream_snapshot, NULL, RSRC_CONF,
+                  "Set the file the decisions are saved to in stream mode, and loaded from on restart. Relative to the ServerRoot. Defaults to 'none'."),
+    AP_INIT_TAKE1("CrowdsecDecisionStoreSize",
+                  set_crowdsec_store_size, NULL, RSRC_CONF,
+                  "Set how many IPv4 address decisions the decision store holds in stream mode, with room for a quarter as many IPv6 ones. Once full, the decisions least worth keeping make way. Defaults to 131072."),
     {NULL}
 };
 
@@ -979,13 +9781,19 @@ static void register_hooks(apr_pool_t * p)
 {
     ap_hook_pre_config(crowdsec_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_post_config(crowdsec_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(crowdsec_child_init, NULL, NULL, APR_HOOK_MIDDLE);
 
     ap_register_output_filter("CROWDSEC", crowdsec_out_filter, NULL,
                               AP_FTYPE_CONTENT_SET);
     ap_register_input_filter("CROWDSEC_NULL", null_in_filter, NULL,
                              AP_FTYPE_CONTENT_SET);
 
+    ap_hook_pre_connection(crowdsec_pre_connection, NULL, NULL,
+                           APR_HOOK_FIRST);
     ap_hook_access_checker(crowdsec_check_access, NULL, NULL, APR_HOOK_FIRST);
+    ap_hook_handler(crowdsec_metrics_handle, NULL, NULL, APR_HOOK_MIDDLE);
+    APR_OPTIONAL_HOOK(ap, status_hook, crowdsec_status_hook, NULL, NULL,
+                      APR_HOOK_MIDDLE);
 
 }
 